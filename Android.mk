@@ -15,6 +15,18 @@
 LOCAL_PATH := $(call my-dir)
 
 
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := fuse_sideload.c
+
+LOCAL_CFLAGS := -O2 -g -Wall -Wno-unused-parameter
+LOCAL_CFLAGS += -D_XOPEN_SOURCE -D_GNU_SOURCE
+
+LOCAL_MODULE := libfusesideload
+
+LOCAL_STATIC_LIBRARIES := libcutils libc libmincrypt
+include $(BUILD_STATIC_LIBRARY)
+
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
@@ -42,8 +54,9 @@ LOCAL_STATIC_LIBRARIES := \
     libminzip \
     libz \
     libmtdutils \
-    libmincrypt \
     libminadbd \
+    libfusesideload \
+    libmincrypt \
     libminui \
     libpng \
     libfs_mgr \
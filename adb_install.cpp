@@ -24,12 +24,16 @@
 #include <sys/stat.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "ui.h"
 #include "cutils/properties.h"
 #include "install.h"
 #include "common.h"
 #include "adb_install.h"
+#include "fuse_sideload.h"
 extern "C" {
 #include "minadbd/adb.h"
 }
@@ -69,6 +73,202 @@ maybe_restart_adbd() {
     }
 }
 
+// How often the transfer rate is printed, and how long the host can
+// go without sending anything before we say so.  A slow USB link and
+// a hung one look the same on the progress bar.
+#define PROGRESS_PRINT_INTERVAL 5
+#define PROGRESS_STALL_SECONDS 10
+
+// The rolling rate covers the last RATE_WINDOW samples, taken at least
+// a second apart.
+#define RATE_WINDOW 5
+
+struct transfer_stats {
+    double start;         // time of the first report
+    double last_change;   // time 'received' last went up
+    double last_print;
+    uint64_t received;
+    uint64_t total;
+    bool move_bar;        // false while install_package() owns the bar
+
+    double sample_time[RATE_WINDOW];
+    uint64_t sample_bytes[RATE_WINDOW];
+    int samples;          // number of samples taken so far
+};
+
+static double
+now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Bytes per second over the sample window, or over the whole
+// transfer until the window has filled.
+static double
+rolling_rate(const transfer_stats* ts) {
+    if (ts->samples < 2) return 0;
+    int newest = (ts->samples - 1) % RATE_WINDOW;
+    int oldest = (ts->samples < RATE_WINDOW) ? 0 : ts->samples % RATE_WINDOW;
+    double dt = ts->sample_time[newest] - ts->sample_time[oldest];
+    if (dt <= 0) return 0;
+    return (ts->sample_bytes[newest] - ts->sample_bytes[oldest]) / dt;
+}
+
+static void
+update_stats(transfer_stats* ts, const sideload_progress* p) {
+    double t = now();
+
+    if (p != NULL) {
+        if (ts->total == 0) {
+            ts->start = ts->last_change = ts->last_print = t;
+            ts->total = p->total;
+        }
+        if (p->received > ts->received) {
+            ts->received = p->received;
+            ts->last_change = t;
+        }
+        if (ts->move_bar && ts->total > 0) {
+            ui->SetProgress((float)ts->received / (float)ts->total);
+        }
+    }
+    if (ts->total == 0) return;
+
+    // Reports can come in bursts; a window of samples milliseconds
+    // apart would make the rate noise.
+    int last = (ts->samples + RATE_WINDOW - 1) % RATE_WINDOW;
+    if (ts->samples == 0 || t - ts->sample_time[last] >= 1) {
+        int slot = ts->samples++ % RATE_WINDOW;
+        ts->sample_time[slot] = t;
+        ts->sample_bytes[slot] = ts->received;
+    }
+
+    if (t - ts->last_print >= PROGRESS_PRINT_INTERVAL && ts->received < ts->total) {
+        int stalled = (int)(t - ts->last_change);
+        if (stalled >= PROGRESS_STALL_SECONDS) {
+            ui->Print("  no data from host for %d s\n", stalled);
+        } else {
+            ui->Print("  %llu of %llu KB (%.0f KB/s)\n",
+                      (unsigned long long)(ts->received / 1024),
+                      (unsigned long long)(ts->total / 1024),
+                      rolling_rate(ts) / 1024);
+        }
+        ts->last_print = t;
+    }
+}
+
+// Spend about a second taking progress reports from the minadbd
+// child, accounting for each batch as it arrives, so the caller's
+// checks run about once a second however often the child reports.
+// Closes the pipe and sets *fd to -1 once the child has closed its
+// end.
+static void
+wait_for_progress(int* fd, transfer_stats* ts) {
+    if (*fd < 0) {
+        sleep(1);
+        return;
+    }
+
+    double deadline = now() + 1;
+    int timeout;
+    while (*fd >= 0 && (timeout = (int)((deadline - now()) * 1000)) > 0) {
+        struct pollfd pfd;
+        pfd.fd = *fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout) <= 0) break;
+
+        sideload_progress p;
+        bool have = false;
+        ssize_t n;
+        while ((n = read(*fd, &p, sizeof(p))) == sizeof(p)) {
+            have = true;
+        }
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            close(*fd);
+            *fd = -1;
+        }
+        if (have) update_stats(ts, &p);
+    }
+    update_stats(ts, NULL);
+}
+
+// Drain what's left in the progress pipe, close it and print a
+// summary of the transfer.
+static void
+finish_progress(int* fd, transfer_stats* ts) {
+    if (*fd >= 0) {
+        // pick up whatever the child reported just before exiting
+        sideload_progress p;
+        while (read(*fd, &p, sizeof(p)) == sizeof(p)) {
+            if (p.received > ts->received) {
+                ts->received = p.received;
+                ts->last_change = now();
+            }
+        }
+        close(*fd);
+        *fd = -1;
+    }
+    if (ts->received > 0 && ts->start > 0) {
+        double elapsed = ts->last_change - ts->start;
+        ui->Print("Received %llu KB in %.1f s (%.0f KB/s)\n",
+                  (unsigned long long)(ts->received / 1024), elapsed,
+                  elapsed > 0 ? ts->received / elapsed / 1024 : 0.0);
+    }
+}
+
+struct progress_reader {
+    int* fd;
+    transfer_stats* stats;
+    volatile bool done;
+};
+
+static void*
+progress_thread(void* cookie) {
+    progress_reader* r = reinterpret_cast<progress_reader*>(cookie);
+    while (!r->done) {
+        wait_for_progress(r->fd, r->stats);
+    }
+    return NULL;
+}
+
+// Install from the package the host serves over FUSE.  The blocks
+// come over USB as the install reads them, so keep reporting on the
+// transfer from another thread meanwhile; a slow link would
+// otherwise look just like a hang.
+static int
+install_served_package(int* progress_fd, transfer_stats* stats,
+                       int* wipe_cache, const char* install_file) {
+    progress_reader reader;
+    reader.fd = progress_fd;
+    reader.stats = stats;
+    reader.done = false;
+    stats->move_bar = false;
+
+    pthread_t thread;
+    bool reading = *progress_fd >= 0 &&
+        pthread_create(&thread, NULL, progress_thread, &reader) == 0;
+    int result = install_package(FUSE_SIDELOAD_HOST_PATHNAME, wipe_cache,
+                                 install_file, false);
+    if (reading) {
+        reader.done = true;
+        pthread_join(thread, NULL);
+    }
+    return result;
+}
+
+// Check without blocking whether the child has exited, filling in
+// *status if so.  Returns 1 if it has, 0 if it's still running and -1
+// (with errno set) if it can't be waited for.
+static int
+child_exited(pid_t child, int* status) {
+    pid_t r;
+    do {
+        r = waitpid(child, status, WNOHANG);
+    } while (r < 0 && errno == EINTR);
+    if (r > 0) return 1;
+    return (r == 0) ? 0 : -1;
+}
+
 int
 apply_from_adb(RecoveryUI* ui_, int* wipe_cache, const char* install_file) {
     ui = ui_;
@@ -79,17 +279,86 @@ apply_from_adb(RecoveryUI* ui_, int* wipe_cache, const char* install_file) {
     ui->Print("\n\nNow send the package you want to apply\n"
               "to the device with \"adb sideload <filename>\"...\n");
 
+    // The child reports how much of a "sideload" package it has
+    // received through this pipe; reads never block.
+    int progress[2];
+    if (pipe(progress) < 0) {
+        progress[0] = progress[1] = -1;
+    } else {
+        fcntl(progress[0], F_SETFL, O_NONBLOCK);
+        fcntl(progress[0], F_SETFD, FD_CLOEXEC);
+    }
+    ui->SetProgressType(RecoveryUI::DETERMINATE);
+    ui->ShowProgress(1.0, 0);
+
     pid_t child;
     if ((child = fork()) == 0) {
-        execl("/sbin/recovery", "recovery", "--adbd", NULL);
+        if (progress[1] >= 0) {
+            char fd[16];
+            snprintf(fd, sizeof(fd), "%d", progress[1]);
+            execl("/sbin/recovery", "recovery", "--adbd", fd, NULL);
+        } else {
+            execl("/sbin/recovery", "recovery", "--adbd", NULL);
+        }
         _exit(-1);
     }
-    int status;
+    if (progress[1] >= 0) close(progress[1]);
+
+    // A host that supports "sideload-host" serves the package through
+    // FUSE_SIDELOAD_HOST_PATHNAME, which starts to exist once it
+    // connects, and we install straight from that.  Older hosts use
+    // "sideload", which copies the whole package to
+    // ADB_SIDELOAD_FILENAME and then makes the child exit.  Poll for
+    // either.  (inotify doesn't work with FUSE.)
+    //
     // TODO(dougz): there should be a way to cancel waiting for a
     // package (by pushing some button combo on the device).  For now
     // you just have to 'adb sideload' a file that's not a valid
     // package, like "/dev/null".
-    waitpid(child, &status, 0);
+    int result = INSTALL_ERROR;
+    int status = 0;
+    bool waited = false;
+    bool served = false;
+    struct stat st;
+    transfer_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.move_bar = true;
+    for (;;) {
+        int exited = child_exited(child, &status);
+        if (exited > 0) {
+            waited = true;
+            break;
+        }
+        if (exited < 0) {
+            ui->Print("Error waiting for adbd:\n  %s\n", strerror(errno));
+            break;
+        }
+        if (stat(FUSE_SIDELOAD_HOST_PATHNAME, &st) == 0) {
+            served = true;
+            break;
+        }
+        if (errno != ENOENT) {
+            ui->Print("Error reading package:\n  %s\n", strerror(errno));
+            break;
+        }
+        wait_for_progress(&progress[0], &stats);
+    }
+    ui->SetProgressType(RecoveryUI::EMPTY);
+
+    if (served) {
+        result = install_served_package(&progress[0], &stats, wipe_cache,
+                                        install_file);
+    } else if (!waited) {
+        kill(child, SIGKILL);
+    }
+    finish_progress(&progress[0], &stats);
+
+    if (!waited) {
+        // Calling stat() on this magic filename signals the minadbd
+        // subprocess to shut down.
+        stat(FUSE_SIDELOAD_HOST_EXIT_PATHNAME, &st);
+        while (waitpid(child, &status, 0) < 0 && errno == EINTR) ;
+    }
     if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
         ui->Print("status %d\n", WEXITSTATUS(status));
     }
@@ -97,7 +366,10 @@ apply_from_adb(RecoveryUI* ui_, int* wipe_cache, const char* install_file) {
     set_usb_driver(false);
     maybe_restart_adbd();
 
-    struct stat st;
+    if (served || !waited) {
+        return result;
+    }
+
     if (stat(ADB_SIDELOAD_FILENAME, &st) != 0) {
         if (errno == ENOENT) {
             ui->Print("No package received.\n");
@@ -106,5 +378,5 @@ apply_from_adb(RecoveryUI* ui_, int* wipe_cache, const char* install_file) {
         }
         return INSTALL_ERROR;
     }
-    return install_package(ADB_SIDELOAD_FILENAME, wipe_cache, install_file);
+    return install_package(ADB_SIDELOAD_FILENAME, wipe_cache, install_file, true);
 }
@@ -19,18 +19,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 #include "mincrypt/sha.h"
 #include "applypatch.h"
+#include "contentcache.h"
+#include "emmcio.h"
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 
-static int LoadPartitionContents(const char* filename, FileContents* file);
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int load_data);
 static ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
@@ -44,6 +49,10 @@ static int GenerateTarget(FileContents* source_file,
 
 static int mtd_partitions_scanned = 0;
 
+// How many times to write an EMMC partition before giving up on
+// reading back what was written.
+#define EMMC_WRITE_ATTEMPTS 3
+
 // Read a file into memory; optionally (retouch_flag == RETOUCH_DO_MASK) mask
 // the retouched entries back to their original value (such that SHA-1 checks
 // don't fail due to randomization); store the file contents and associated
@@ -53,12 +62,13 @@ static int mtd_partitions_scanned = 0;
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag) {
     file->data = NULL;
+    file->mapped = 0;
 
     // A special 'filename' beginning with "MTD:" or "EMMC:" means to
     // load the contents of a partition.
     if (strncmp(filename, "MTD:", 4) == 0 ||
         strncmp(filename, "EMMC:", 5) == 0) {
-        return LoadPartitionContents(filename, file);
+        return LoadPartitionContents(filename, file, 1);
     }
 
     if (stat(filename, &file->st) != 0) {
@@ -66,6 +76,10 @@ int LoadFileContents(const char* filename, FileContents* file,
         return -1;
     }
 
+    if (ContentCacheFindFile(filename, &file->st, retouch_flag, file) == 0) {
+        return 0;
+    }
+
     file->size = file->st.st_size;
     file->data = malloc(file->size);
 
@@ -101,10 +115,97 @@ int LoadFileContents(const char* filename, FileContents* file,
         }
     }
 
+    SHA_hash(file->data, file->size, file->sha1);
+    ContentCacheAddFile(filename, retouch_flag, file);
+    return 0;
+}
+
+// Files smaller than this aren't worth an mmap().
+#define MAP_MIN_SIZE (64 * 1024)
+
+// Like LoadFileContents(), but a large regular file is mmap()ed
+// read-only (copy-on-write, if retouch masking has to modify it)
+// instead of being copied into memory, and so must be freed with
+// FreeFileContents().  Such files bypass the content cache; the page
+// cache already holds them.  Partitions, small files and cache hits are
+// loaded as LoadFileContents() would.
+//
+// Return 0 on success.
+int MapFileContents(const char* filename, FileContents* file,
+                    int retouch_flag) {
+    file->data = NULL;
+    file->mapped = 0;
+
+    if (strncmp(filename, "MTD:", 4) == 0 ||
+        strncmp(filename, "EMMC:", 5) == 0 ||
+        stat(filename, &file->st) != 0 ||
+        file->st.st_size < MAP_MIN_SIZE ||
+        ContentCacheFindFile(filename, &file->st, retouch_flag, file) == 0) {
+        if (file->data != NULL) return 0;
+        return LoadFileContents(filename, file, retouch_flag);
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+        return -1;
+    }
+    file->size = file->st.st_size;
+    void* data = mmap(NULL, file->size,
+                      PROT_READ | (retouch_flag ? PROT_WRITE : 0),
+                      MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("failed to mmap \"%s\" (%s); reading it\n",
+               filename, strerror(errno));
+        return LoadFileContents(filename, file, retouch_flag);
+    }
+    madvise(data, file->size, MADV_WILLNEED);
+    file->data = data;
+    file->mapped = 1;
+
+    if (retouch_flag) {
+        int32_t desired_offset = 0;
+        if (retouch_mask_data(file->data, file->size,
+                              &desired_offset, NULL) != RETOUCH_DATA_MATCHED) {
+            printf("error trying to mask retouch entries\n");
+            FreeFileContents(file);
+            return -1;
+        }
+    }
+
     SHA_hash(file->data, file->size, file->sha1);
     return 0;
 }
 
+void FreeFileContents(FileContents* file) {
+    if (file->data != NULL) {
+        if (file->mapped) {
+            munmap(file->data, file->size);
+        } else {
+            free(file->data);
+        }
+    }
+    file->data = NULL;
+    file->mapped = 0;
+}
+
+// Replace a mapped file's data with a copy in memory, so the file can
+// be deleted and its space actually freed.  Return 0 on success.
+static int UnmapFileContents(FileContents* file) {
+    if (!file->mapped) return 0;
+    unsigned char* copy = malloc(file->size);
+    if (copy == NULL) {
+        printf("failed to alloc %ld bytes for source\n", (long)file->size);
+        return -1;
+    }
+    memcpy(copy, file->data, file->size);
+    munmap(file->data, file->size);
+    file->data = copy;
+    file->mapped = 0;
+    return 0;
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -135,9 +236,74 @@ static int compare_size_indices(const void* a, const void* b) {
 // "end-of-file" marker), so the caller must specify the possible
 // lengths and the hash of the data, and we'll do the load expecting
 // to find one of those hashes.
+//
+// If load_data is 0, the partition is only hashed: it's read in
+// PARTITION_READ_SIZE pieces (with O_DIRECT for EMMC) and file->data
+// is left NULL, while file->size and file->sha1 are filled in as
+// usual.  Nothing the size of the partition is allocated.
 enum PartitionType { MTD, EMMC };
 
-static int LoadPartitionContents(const char* filename, FileContents* file) {
+#define PARTITION_READ_SIZE (1024 * 1024)
+
+// Source of partition data for a hash-only LoadPartitionContents().
+typedef struct {
+    enum PartitionType type;
+    MtdReadContext* mtd;
+    int fd;
+    unsigned char* buffer;      // PARTITION_READ_SIZE bytes
+    off64_t buffer_offset;      // partition offset of buffer[0] (EMMC)
+    size_t buffer_len;
+    off64_t pos;                // next byte to hash
+} PartitionHasher;
+
+// Hash the next 'len' bytes of the partition into 'ctx'.  Return the
+// number of bytes hashed, which is less than 'len' only on error or at
+// the end of the partition.
+static size_t HashPartitionData(PartitionHasher* h, SHA_CTX* ctx, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        size_t n = len - done;
+        if (h->type == MTD) {
+            if (n > PARTITION_READ_SIZE) n = PARTITION_READ_SIZE;
+            if (mtd_read_data(h->mtd, (char*)h->buffer, n) != (ssize_t)n) break;
+            SHA_update(ctx, h->buffer, n);
+        } else {
+            if (h->pos == h->buffer_offset + (off64_t)h->buffer_len) {
+                // Always read whole aligned pieces, as O_DIRECT needs;
+                // only the end of the device can come up short.
+                off64_t offset = h->pos;
+                ssize_t r;
+                do {
+                    r = pread64(h->fd, h->buffer, PARTITION_READ_SIZE, offset);
+                } while (r < 0 && errno == EINTR);
+                if (r <= 0) break;
+                h->buffer_offset = offset;
+                h->buffer_len = r;
+            }
+            size_t avail = h->buffer_offset + h->buffer_len - h->pos;
+            if (n > avail) n = avail;
+            SHA_update(ctx, h->buffer + (h->pos - h->buffer_offset), n);
+        }
+        h->pos += n;
+        done += n;
+    }
+    return done;
+}
+
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int load_data) {
+    int result = -1;
+    int* index = NULL;
+    size_t* size = NULL;
+    char** sha1sum = NULL;
+    MtdReadContext* ctx = NULL;
+    FILE* dev = NULL;
+    PartitionHasher hasher;
+    memset(&hasher, 0, sizeof(hasher));
+    hasher.fd = -1;
+
+    file->data = NULL;
+
     char* copy = strdup(filename);
     const char* magic = strtok(copy, ":");
 
@@ -150,9 +316,10 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     } else {
         printf("LoadPartitionContents called with bad filename (%s)\n",
                filename);
-        return -1;
+        goto done;
     }
     const char* partition = strtok(NULL, ":");
+    hasher.type = type;
 
     int i;
     int colons = 0;
@@ -167,16 +334,16 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     }
 
     int pairs = (colons-1)/2;     // # of (size,sha1) pairs in filename
-    int* index = malloc(pairs * sizeof(int));
-    size_t* size = malloc(pairs * sizeof(size_t));
-    char** sha1sum = malloc(pairs * sizeof(char*));
+    index = malloc(pairs * sizeof(int));
+    size = malloc(pairs * sizeof(size_t));
+    sha1sum = malloc(pairs * sizeof(char*));
 
     for (i = 0; i < pairs; ++i) {
         const char* size_str = strtok(NULL, ":");
         size[i] = strtol(size_str, NULL, 10);
         if (size[i] == 0) {
             printf("LoadPartitionContents called with bad size (%s)\n", filename);
-            return -1;
+            goto done;
         }
         sha1sum[i] = strtok(NULL, ":");
         index[i] = i;
@@ -187,8 +354,26 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     size_array = size;
     qsort(index, pairs, sizeof(int), compare_size_indices);
 
-    MtdReadContext* ctx = NULL;
-    FILE* dev = NULL;
+    // If we've seen one of the possibilities before, there's no need
+    // to read anything.
+    uint8_t parsed_sha[SHA_DIGEST_SIZE];
+    for (i = 0; i < pairs; ++i) {
+        if (ParseSha1(sha1sum[index[i]], parsed_sha) == 0 &&
+            ContentCacheFindPartition(partition, size[index[i]], parsed_sha,
+                                      load_data, file) == 0) {
+            printf("partition read matched size %zu sha %s (cached)\n",
+                   size[index[i]], sha1sum[index[i]]);
+            result = 0;
+            goto done;
+        }
+    }
+
+    if (!load_data &&
+        posix_memalign((void**)&hasher.buffer, 4096, PARTITION_READ_SIZE) != 0) {
+        hasher.buffer = NULL;
+        printf("failed to allocate buffer for reading \"%s\"\n", partition);
+        goto done;
+    }
 
     switch (type) {
         case MTD:
@@ -201,32 +386,44 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             if (mtd == NULL) {
                 printf("mtd partition \"%s\" not found (loading %s)\n",
                        partition, filename);
-                return -1;
+                goto done;
             }
 
             ctx = mtd_read_partition(mtd);
             if (ctx == NULL) {
                 printf("failed to initialize read of mtd partition \"%s\"\n",
                        partition);
-                return -1;
+                goto done;
             }
+            hasher.mtd = ctx;
             break;
 
         case EMMC:
+            if (!load_data) {
+                hasher.fd = open(partition, O_RDONLY | O_DIRECT);
+                if (hasher.fd < 0 && errno == EINVAL) {
+                    hasher.fd = open(partition, O_RDONLY);
+                }
+                if (hasher.fd < 0) {
+                    printf("failed to open emmc partition \"%s\": %s\n",
+                           partition, strerror(errno));
+                    goto done;
+                }
+                break;
+            }
             dev = fopen(partition, "rb");
             if (dev == NULL) {
                 printf("failed to open emmc partition \"%s\": %s\n",
                        partition, strerror(errno));
-                return -1;
+                goto done;
             }
     }
 
     SHA_CTX sha_ctx;
     SHA_init(&sha_ctx);
-    uint8_t parsed_sha[SHA_DIGEST_SIZE];
 
     // allocate enough memory to hold the largest size.
-    file->data = malloc(size[index[pairs-1]]);
+    file->data = load_data ? malloc(size[index[pairs-1]]) : NULL;
     char* p = (char*)file->data;
     file->size = 0;                // # bytes read so far
 
@@ -237,23 +434,25 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         size_t next = size[index[i]] - file->size;
         size_t read = 0;
         if (next > 0) {
-            switch (type) {
-                case MTD:
-                    read = mtd_read_data(ctx, p, next);
-                    break;
+            if (!load_data) {
+                read = HashPartitionData(&hasher, &sha_ctx, next);
+            } else {
+                switch (type) {
+                    case MTD:
+                        read = mtd_read_data(ctx, p, next);
+                        break;
 
-                case EMMC:
-                    read = fread(p, 1, next, dev);
-                    break;
+                    case EMMC:
+                        read = fread(p, 1, next, dev);
+                        break;
+                }
+                if (read == next) SHA_update(&sha_ctx, p, read);
             }
             if (next != read) {
                 printf("short read (%zu bytes of %zu) for partition \"%s\"\n",
                        read, next, partition);
-                free(file->data);
-                file->data = NULL;
-                return -1;
+                goto done;
             }
-            SHA_update(&sha_ctx, p, read);
             file->size += read;
         }
 
@@ -266,9 +465,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
             printf("failed to parse sha1 %s in %s\n",
                    sha1sum[index[i]], filename);
-            free(file->data);
-            file->data = NULL;
-            return -1;
+            goto done;
         }
 
         if (memcmp(sha_so_far, parsed_sha, SHA_DIGEST_SIZE) == 0) {
@@ -279,28 +476,15 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             break;
         }
 
-        p += read;
+        if (load_data) p += read;
     }
 
-    switch (type) {
-        case MTD:
-            mtd_read_close(ctx);
-            break;
-
-        case EMMC:
-            fclose(dev);
-            break;
-    }
-
-
     if (i == pairs) {
         // Ran off the end of the list of (size,sha1) pairs without
         // finding a match.
         printf("contents of partition \"%s\" didn't match %s\n",
                partition, filename);
-        free(file->data);
-        file->data = NULL;
-        return -1;
+        goto done;
     }
 
     const uint8_t* sha_final = SHA_final(&sha_ctx);
@@ -313,15 +497,38 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     file->st.st_uid = 0;
     file->st.st_gid = 0;
 
+    ContentCacheAddPartition(partition, file);
+    result = 0;
+
+done:
+    if (ctx != NULL) mtd_read_close(ctx);
+    if (dev != NULL) fclose(dev);
+    if (hasher.fd >= 0) close(hasher.fd);
+    free(hasher.buffer);
+    if (result != 0) {
+        free(file->data);
+        file->data = NULL;
+    }
     free(copy);
     free(index);
     free(size);
     free(sha1sum);
+    return result;
+}
+
 
+static int SetFileOwnership(const char* filename, const struct stat* st) {
+    if (chmod(filename, st->st_mode) != 0) {
+        printf("chmod of \"%s\" failed: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (chown(filename, st->st_uid, st->st_gid) != 0) {
+        printf("chown of \"%s\" failed: %s\n", filename, strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
-
 // Save the contents of the given FileContents object under the given
 // filename.  Return 0 on success.
 int SaveFileContents(const char* filename, const FileContents* file) {
@@ -343,16 +550,73 @@ int SaveFileContents(const char* filename, const FileContents* file) {
     fsync(fd);
     close(fd);
 
-    if (chmod(filename, file->st.st_mode) != 0) {
-        printf("chmod of \"%s\" failed: %s\n", filename, strerror(errno));
+    return SetFileOwnership(filename, &file->st);
+}
+
+// Copy the file 'source_filename' (whose contents are 'file') to
+// 'filename' inside the kernel with copy_file_range(), so the data
+// never comes through user space.  Return 0 on success, or -1 (having
+// written nothing useful) if that isn't possible, as when the kernel
+// can't copy between the two filesystems.
+static int CopyFileContents(const char* source_filename, const FileContents* file,
+                            const char* filename) {
+#ifdef __NR_copy_file_range
+    int in = open(source_filename, O_RDONLY);
+    if (in < 0) return -1;
+    int out = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (out < 0) {
+        close(in);
         return -1;
     }
-    if (chown(filename, file->st.st_uid, file->st.st_gid) != 0) {
-        printf("chown of \"%s\" failed: %s\n", filename, strerror(errno));
+
+    ssize_t left = file->size;
+    while (left > 0) {
+        ssize_t n = syscall(__NR_copy_file_range, in, NULL, out, NULL, left, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        left -= n;
+    }
+    close(in);
+    if (left != 0) {
+        printf("can't copy \"%s\" in the kernel (%s)\n", source_filename,
+               strerror(errno));
+        close(out);
         return -1;
     }
+    fsync(out);
+    close(out);
 
-    return 0;
+    return SetFileOwnership(filename, &file->st);
+#else
+    return -1;
+#endif
+}
+
+// Save the source file, about to be deleted to make room for the
+// target, as CACHE_TEMP_SOURCE.  If it's on the same filesystem as
+// /cache it's simply renamed; otherwise it's copied in the kernel if
+// possible and written out from 'file' if not.  Return 1 if the source
+// was moved (so it's already gone), 0 if it was copied and -1 on
+// failure.
+static int BackUpSourceFile(const char* source_filename, const FileContents* file) {
+    struct stat cache_st;
+    if (stat("/cache", &cache_st) == 0 && cache_st.st_dev == file->st.st_dev) {
+        if (rename(source_filename, CACHE_TEMP_SOURCE) == 0) {
+            return 1;
+        }
+        printf("failed to rename \"%s\" to %s: %s\n",
+               source_filename, CACHE_TEMP_SOURCE, strerror(errno));
+    }
+
+    if (MakeFreeSpaceOnCache(file->size) < 0) {
+        printf("not enough free space on /cache\n");
+        return -1;
+    }
+    if (CopyFileContents(source_filename, file, CACHE_TEMP_SOURCE) == 0 ||
+        SaveFileContents(CACHE_TEMP_SOURCE, file) == 0) {
+        return 0;
+    }
+    return -1;
 }
 
 // Write a memory buffer to 'target' partition, a string of the form
@@ -379,6 +643,8 @@ int WriteToPartition(unsigned char* data, size_t len,
         return -1;
     }
 
+    ContentCacheDrop(partition);
+
     switch (type) {
         case MTD:
             if (!mtd_partitions_scanned) {
@@ -422,108 +688,26 @@ int WriteToPartition(unsigned char* data, size_t len,
 
         case EMMC:
         {
-            size_t start = 0;
-            int success = 0;
-            int fd = open(partition, O_RDWR | O_SYNC);
-            if (fd < 0) {
-                printf("failed to open %s: %s\n", partition, strerror(errno));
-                return -1;
-            }
             int attempt;
-
-            for (attempt = 0; attempt < 10; ++attempt) {
-                size_t next_sync = start + (1<<20);
-                printf("raw O_SYNC write %s attempt %d start at %d\n", partition, attempt+1, start);
-                lseek(fd, start, SEEK_SET);
-                while (start < len) {
-                    size_t to_write = len - start;
-                    if (to_write > 4096) to_write = 4096;
-
-                    ssize_t written = write(fd, data+start, to_write);
-                    if (written < 0) {
-                        if (errno == EINTR) {
-                            written = 0;
-                        } else {
-                            printf("failed write writing to %s (%s)\n",
-                                   partition, strerror(errno));
-                            return -1;
-                        }
-                    }
-                    start += written;
-                    if (start >= next_sync) {
-                        fsync(fd);
-                        next_sync = start + (1<<20);
-                    }
-                }
-                fsync(fd);
-
-                // drop caches so our subsequent verification read
-                // won't just be reading the cache.
-                sync();
-                int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
-                write(dc, "3\n", 2);
-                close(dc);
-                sleep(1);
-                printf("  caches dropped\n");
-
-                // verify
-                lseek(fd, 0, SEEK_SET);
-                unsigned char buffer[4096];
-                start = len;
-                size_t p;
-                for (p = 0; p < len; p += sizeof(buffer)) {
-                    size_t to_read = len - p;
-                    if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
-
-                    size_t so_far = 0;
-                    while (so_far < to_read) {
-                        ssize_t read_count = read(fd, buffer+so_far, to_read-so_far);
-                        if (read_count < 0) {
-                            if (errno == EINTR) {
-                                read_count = 0;
-                            } else {
-                                printf("verify read error %s at %zu: %s\n",
-                                       partition, p, strerror(errno));
-                                return -1;
-                            }
-                        }
-                        if ((size_t)read_count < to_read) {
-                            printf("short verify read %s at %zu: %zd %zu %s\n",
-                                   partition, p, read_count, to_read, strerror(errno));
-                        }
-                        so_far += read_count;
-                    }
-
-                    if (memcmp(buffer, data+p, to_read)) {
-                        printf("verification failed starting at %zu\n", p);
-                        start = p;
-                        break;
-                    }
-                }
-
-                if (start == len) {
+            for (attempt = 0; attempt < EMMC_WRITE_ATTEMPTS; ++attempt) {
+                EmmcWriter* w = EmmcWriterOpen(partition);
+                if (w == NULL) return -1;
+                uint8_t sha1[SHA_DIGEST_SIZE];
+                EmmcWriterWrite(w, data, len);
+                if (EmmcWriterFinish(w, sha1, NULL) != 0) return -1;
+
+                int r = EmmcVerify(partition, len, sha1);
+                if (r < 0) return -1;
+                if (r == 0) {
                     printf("verification read succeeded (attempt %d)\n", attempt+1);
-                    success = true;
                     break;
                 }
-
-                sleep(2);
+                printf("verification of %s failed (attempt %d)\n", partition, attempt+1);
             }
-
-            if (!success) {
+            if (attempt == EMMC_WRITE_ATTEMPTS) {
                 printf("failed to verify after all attempts\n");
                 return -1;
             }
-
-            if (close(fd) != 0) {
-                printf("error closing %s (%s)\n", partition, strerror(errno));
-                return -1;
-            }
-            // hack: sync and sleep after closing in hopes of getting
-            // the data actually onto flash.
-            printf("sleeping after close\n");
-            sync();
-            sleep(5);
             break;
         }
     }
@@ -586,19 +770,26 @@ int applypatch_check(const char* filename,
                      int num_patches, char** const patch_sha1_str) {
     FileContents file;
     file.data = NULL;
+    file.mapped = 0;
 
     // It's okay to specify no sha1s; the check will pass if the
     // LoadFileContents is successful.  (Useful for reading
     // partitions, where the filename encodes the sha1s; no need to
-    // check them twice.)
-    if (LoadFileContents(filename, &file, RETOUCH_DO_MASK) != 0 ||
+    // check them twice.)  Partitions are only hashed, not loaded.
+    int loaded;
+    if (strncmp(filename, "MTD:", 4) == 0 ||
+        strncmp(filename, "EMMC:", 5) == 0) {
+        loaded = LoadPartitionContents(filename, &file, 0);
+    } else {
+        loaded = MapFileContents(filename, &file, RETOUCH_DO_MASK);
+    }
+    if (loaded != 0 ||
         (num_patches > 0 &&
          FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0)) {
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
-        file.data = NULL;
+        FreeFileContents(&file);
 
         // If the source file is missing or corrupted, it might be because
         // we were killed in the middle of patching it.  A copy of it
@@ -606,19 +797,19 @@ int applypatch_check(const char* filename,
         // exists and matches the sha1 we're looking for, the check still
         // passes.
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
             printf("failed to load cache file\n");
             return 1;
         }
 
         if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            FreeFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    FreeFileContents(&file);
     return 0;
 }
 
@@ -737,12 +928,14 @@ int applypatch(const char* source_filename,
     FileContents copy_file;
     FileContents source_file;
     copy_file.data = NULL;
+    copy_file.mapped = 0;
     source_file.data = NULL;
+    source_file.mapped = 0;
     const Value* source_patch_value = NULL;
     const Value* copy_patch_value = NULL;
 
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file,
+    if (MapFileContents(target_filename, &source_file,
                          RETOUCH_DO_MASK) == 0) {
         if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
@@ -750,7 +943,7 @@ int applypatch(const char* source_filename,
             printf("already ");
             print_short_sha1(target_sha1);
             putchar('\n');
-            free(source_file.data);
+            FreeFileContents(&source_file);
             return 0;
         }
     }
@@ -760,9 +953,8 @@ int applypatch(const char* source_filename,
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
-        source_file.data = NULL;
-        LoadFileContents(source_filename, &source_file,
+        FreeFileContents(&source_file);
+        MapFileContents(source_filename, &source_file,
                          RETOUCH_DO_MASK);
     }
 
@@ -775,11 +967,10 @@ int applypatch(const char* source_filename,
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
-        source_file.data = NULL;
+        FreeFileContents(&source_file);
         printf("source file is bad; trying copy\n");
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file,
+        if (MapFileContents(CACHE_TEMP_SOURCE, &copy_file,
                              RETOUCH_DO_MASK) < 0) {
             // fail.
             printf("failed to read copy file\n");
@@ -795,7 +986,7 @@ int applypatch(const char* source_filename,
         if (copy_patch_value == NULL) {
             // fail.
             printf("copy file doesn't match source SHA-1s either\n");
-            free(copy_file.data);
+            FreeFileContents(&copy_file);
             return 1;
         }
     }
@@ -804,12 +995,132 @@ int applypatch(const char* source_filename,
                                 &copy_file, copy_patch_value,
                                 source_filename, target_filename,
                                 target_sha1, target_size, bonus_data);
-    free(source_file.data);
-    free(copy_file.data);
+    FreeFileContents(&source_file);
+    FreeFileContents(&copy_file);
 
     return result;
 }
 
+static int KnownPatchFormat(const Value* patch) {
+    return patch->size >= 8 &&
+        (memcmp(patch->data, "BSDIFF40", 8) == 0 ||
+         memcmp(patch->data, "IMGDIFF2", 8) == 0);
+}
+
+// Apply 'patch' (which must be in a known format) to 'source', passing
+// the output to 'sink' and hashing it into 'ctx'.  Return 0 on success.
+static int ApplyPatch(const FileContents* source, const Value* patch,
+                      SinkFn sink, void* token, SHA_CTX* ctx,
+                      const Value* bonus_data) {
+    if (memcmp(patch->data, "BSDIFF40", 8) == 0) {
+        return ApplyBSDiffPatch(source->data, source->size,
+                                patch, 0, sink, token, ctx);
+    }
+    return ApplyImagePatch(source->data, source->size,
+                           patch, sink, token, ctx, bonus_data);
+}
+
+// Apply 'patch' to 'source', writing the output to the EMMC partition
+// 'target' ("EMMC:<partition_device>:...") as it is produced, then
+// read the partition back and check it has 'target_sha1'.  This saves
+// the separate pass that writes out a fully patched buffer, though the
+// patch code still holds each bsdiff chunk's output in memory while
+// producing it.  The partition is overwritten even if the patch turns
+// out to be bad, so the source must already be saved somewhere.  A
+// failed readback is retried by patching again.
+// Return 0 on success.
+static int PatchToEmmc(const FileContents* source, const Value* patch,
+                       const char* target,
+                       const uint8_t target_sha1[SHA_DIGEST_SIZE],
+                       size_t target_size, const Value* bonus_data) {
+    char* copy = strdup(target);
+    strtok(copy, ":");
+    const char* partition = strtok(NULL, ":");
+    if (partition == NULL) {
+        printf("bad partition target name \"%s\"\n", target);
+        free(copy);
+        return -1;
+    }
+
+    ContentCacheDrop(partition);
+
+    int result = -1;
+    int attempt;
+    for (attempt = 0; attempt < EMMC_WRITE_ATTEMPTS; ++attempt) {
+        EmmcWriter* w = EmmcWriterOpen(partition);
+        if (w == NULL) break;
+
+        int patched = ApplyPatch(source, patch, EmmcWriterSink, w, NULL,
+                                 bonus_data);
+        uint8_t sha1[SHA_DIGEST_SIZE];
+        size_t written;
+        if (EmmcWriterFinish(w, sha1, &written) != 0 || patched != 0) {
+            printf("applying patch to %s failed\n", partition);
+            break;
+        }
+        if (written != target_size ||
+            memcmp(sha1, target_sha1, SHA_DIGEST_SIZE) != 0) {
+            printf("patch did not produce expected sha1\n");
+            break;
+        }
+
+        int r = EmmcVerify(partition, written, target_sha1);
+        if (r < 0) break;
+        if (r == 0) {
+            printf("verification read succeeded (attempt %d)\n", attempt+1);
+            // A later check of the target needn't read it again.
+            FileContents written_file;
+            memset(&written_file, 0, sizeof(written_file));
+            written_file.size = written;
+            memcpy(written_file.sha1, target_sha1, SHA_DIGEST_SIZE);
+            ContentCacheAddPartition(partition, &written_file);
+            result = 0;
+            break;
+        }
+        printf("verification of %s failed (attempt %d)\n", partition, attempt+1);
+    }
+    if (attempt == EMMC_WRITE_ATTEMPTS) {
+        printf("failed to verify after all attempts\n");
+    }
+    free(copy);
+    return result;
+}
+
+// Apply 'patch' to 'source', writing the output to the new file
+// 'outname' and giving it the ownership and mode of 'source'.  The
+// file is closed but not synced; the caller must sync it before
+// renaming it into place.  Fails (removing 'outname') unless the output
+// has 'target_sha1'.  Used by applypatch_batch().  Return 0 on success.
+int PatchToFile(const FileContents* source, const Value* patch,
+                const char* outname, const uint8_t target_sha1[SHA_DIGEST_SIZE]) {
+    if (patch->type != VAL_BLOB || !KnownPatchFormat(patch)) {
+        printf("%s: unknown patch file format\n", outname);
+        return -1;
+    }
+
+    int output = open(outname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (output < 0) {
+        printf("failed to open output file %s: %s\n", outname, strerror(errno));
+        return -1;
+    }
+
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    int result = ApplyPatch(source, patch, FileSink, &output, &ctx, NULL);
+    if (close(output) != 0) result = -1;
+
+    if (result != 0) {
+        printf("applying patch to %s failed\n", outname);
+    } else if (memcmp(SHA_final(&ctx), target_sha1, SHA_DIGEST_SIZE) != 0) {
+        printf("patch for %s did not produce expected sha1\n", outname);
+        result = -1;
+    } else if (SetFileOwnership(outname, &source->st) != 0) {
+        result = -1;
+    }
+    if (result != 0) unlink(outname);
+    return result;
+}
+
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
                           FileContents* copy_file,
@@ -846,21 +1157,24 @@ static int GenerateTarget(FileContents* source_file,
 
         if (strncmp(target_filename, "MTD:", 4) == 0 ||
             strncmp(target_filename, "EMMC:", 5) == 0) {
-            // If the target is a partition, we're actually going to
-            // write the output to /tmp and then copy it to the
-            // partition.  statfs() always returns 0 blocks free for
-            // /tmp, so instead we'll just assume that /tmp has enough
-            // space to hold the file.
+            // If the target is a partition, the output is either
+            // streamed straight to it (EMMC) or held in memory and
+            // then written (MTD); either way the target filesystem's
+            // free space doesn't matter.
 
             // We still write the original source to cache, in case
-            // the partition write is interrupted.
-            if (MakeFreeSpaceOnCache(source_file->size) < 0) {
-                printf("not enough free space on /cache\n");
-                return 1;
-            }
-            if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
-                printf("failed to back up source file\n");
-                return 1;
+            // the partition write is interrupted.  If we're patching
+            // from that copy (resuming an interrupted write), it's
+            // the only good copy there is; leave it be.
+            if (source_patch_value != NULL) {
+                if (MakeFreeSpaceOnCache(source_file->size) < 0) {
+                    printf("not enough free space on /cache\n");
+                    return 1;
+                }
+                if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+                    printf("failed to back up source file\n");
+                    return 1;
+                }
             }
             made_copy = 1;
             retry = 0;
@@ -896,17 +1210,17 @@ static int GenerateTarget(FileContents* source_file,
                     return 1;
                 }
 
-                if (MakeFreeSpaceOnCache(source_file->size) < 0) {
-                    printf("not enough free space on /cache\n");
-                    return 1;
-                }
-
-                if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+                int moved = BackUpSourceFile(source_filename, source_file);
+                if (moved < 0) {
                     printf("failed to back up source file\n");
                     return 1;
                 }
                 made_copy = 1;
-                unlink(source_filename);
+                if (!moved) {
+                    // A mapping would keep the deleted file's blocks in use.
+                    if (UnmapFileContents(source_file) != 0) return 1;
+                    unlink(source_filename);
+                }
 
                 size_t free_space = FreeSpaceForFile(target_fs);
                 printf("(now %ld bytes free for target) ", (long)free_space);
@@ -927,12 +1241,30 @@ static int GenerateTarget(FileContents* source_file,
             return 1;
         }
 
+        if (!KnownPatchFormat(patch)) {
+            printf("Unknown patch file format\n");
+            return 1;
+        }
+
+        if (strncmp(target_filename, "EMMC:", 5) == 0) {
+            // The output goes straight to the partition; the copy of
+            // the source on /cache covers us if it's interrupted.
+            if (PatchToEmmc(source_to_use, patch, target_filename,
+                            target_sha1, target_size, bonus_data) != 0) {
+                return 1;
+            }
+            printf("now ");
+            print_short_sha1(target_sha1);
+            putchar('\n');
+            if (made_copy) unlink(CACHE_TEMP_SOURCE);
+            return 0;
+        }
+
         SinkFn sink = NULL;
         void* token = NULL;
         output = -1;
         outname = NULL;
-        if (strncmp(target_filename, "MTD:", 4) == 0 ||
-            strncmp(target_filename, "EMMC:", 5) == 0) {
+        if (strncmp(target_filename, "MTD:", 4) == 0) {
             // We store the decoded output in memory.
             msi.buffer = malloc(target_size);
             if (msi.buffer == NULL) {
@@ -960,25 +1292,9 @@ static int GenerateTarget(FileContents* source_file,
             token = &output;
         }
 
-        char* header = patch->data;
-        ssize_t header_bytes_read = patch->size;
-
         SHA_init(&ctx);
-
-        int result;
-
-        if (header_bytes_read >= 8 &&
-            memcmp(header, "BSDIFF40", 8) == 0) {
-            result = ApplyBSDiffPatch(source_to_use->data, source_to_use->size,
-                                      patch, 0, sink, token, &ctx);
-        } else if (header_bytes_read >= 8 &&
-                   memcmp(header, "IMGDIFF2", 8) == 0) {
-            result = ApplyImagePatch(source_to_use->data, source_to_use->size,
-                                     patch, sink, token, &ctx, bonus_data);
-        } else {
-            printf("Unknown patch file format\n");
-            return 1;
-        }
+        int result = ApplyPatch(source_to_use, patch, sink, token, &ctx,
+                                bonus_data);
 
         if (output >= 0) {
             fsync(output);
@@ -1012,7 +1328,7 @@ static int GenerateTarget(FileContents* source_file,
     }
 
     if (output < 0) {
-        // Copy the temp file to the partition.
+        // Write the in-memory output to the MTD partition.
         if (WriteToPartition(msi.buffer, msi.pos, target_filename) != 0) {
             printf("write of patched data to %s failed\n", target_filename);
             return 1;
@@ -17,7 +17,9 @@
 #ifndef _APPLYPATCH_H
 #define _APPLYPATCH_H
 
+#include <stdint.h>
 #include <sys/stat.h>
+#include <time.h>
 #include "mincrypt/sha.h"
 #include "minelf/Retouch.h"
 #include "edify/expr.h"
@@ -32,6 +34,7 @@ typedef struct _FileContents {
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  int mapped;         // data is mmap()ed; free with FreeFileContents()
 } FileContents;
 
 // When there isn't enough room on the target filesystem to hold the
@@ -63,10 +66,14 @@ int applypatch_check(const char* filename,
 
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag);
+int MapFileContents(const char* filename, FileContents* file,
+                    int retouch_flag);
 int SaveFileContents(const char* filename, const FileContents* file);
 void FreeFileContents(FileContents* file);
 int FindMatchingPatch(uint8_t* sha1, char* const * const patch_sha1_str,
                       int num_patches);
+int PatchToFile(const FileContents* source, const Value* patch,
+                const char* outname, const uint8_t target_sha1[SHA_DIGEST_SIZE]);
 
 // bsdiff.c
 void ShowBSDiffLicense();
@@ -77,13 +84,92 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
                         const Value* patch, ssize_t patch_offset,
                         unsigned char** new_data, ssize_t* new_size);
 
+// Where patching spends its time, for "applypatch -B".  While
+// gPatchTiming is set, ApplyBSDiffPatch() and ApplyImagePatch() add
+// the wall time of each stage to gPatchStageNs[]; otherwise each
+// stage costs one test.  The counters aren't locked, so only turn
+// this on while patching from a single thread.
+typedef enum {
+    PATCH_STAGE_BZIP2,      // decoding bsdiff's bzip2 streams
+    PATCH_STAGE_ADD,        // adding the diff to the old data
+    PATCH_STAGE_INFLATE,    // expanding deflated source chunks
+    PATCH_STAGE_DEFLATE,    // recompressing deflated target chunks
+    PATCH_STAGE_SHA,        // hashing the output
+    PATCH_STAGE_SINK,       // handing the output to the sink
+    PATCH_STAGE_COUNT
+} PatchStage;
+
+extern int gPatchTiming;
+extern uint64_t gPatchStageNs[PATCH_STAGE_COUNT];
+
+// Returns the start of a stage to pass to PatchStageEnd(), or 0 if
+// timing is off.
+static inline uint64_t PatchStageStart() {
+    if (!gPatchTiming) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void PatchStageEnd(PatchStage stage, uint64_t start) {
+    if (start == 0) return;
+    gPatchStageNs[stage] += PatchStageStart() - start;
+}
+
 // imgpatch.c
 int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                     const Value* patch,
                     SinkFn sink, void* token, SHA_CTX* ctx,
                     const Value* bonus_data);
+// The most memory ApplyImagePatch() will allocate at once for 'patch',
+// going by its chunk headers, or 0 if it isn't an IMGDIFF2 patch.
+size_t ImagePatchMemory(const Value* patch);
 
 // freecache.c
 int MakeFreeSpaceOnCache(size_t bytes_needed);
 
+// batch.c
+
+// One line of a batch list:
+//   <src-file> <tgt-file> <tgt-sha1> <tgt-size> <src-sha1>:<patch> ...
+// with the same meaning as applypatch()'s arguments; each <patch> is a
+// name handed to the PatchLoaderFn.
+typedef struct {
+    char* source_filename;
+    char* target_filename;
+    char* target_sha1_str;
+    size_t target_size;
+    int num_patches;
+    char** patch_sha1_str;
+    char** patch_names;
+} BatchPatch;
+
+// How much memory applypatch_batch() callers let the patches in
+// flight use at once.
+#define BATCH_MEMORY_BUDGET (64 * 1024 * 1024)
+
+// Return the named patch as a malloc'd VAL_BLOB with malloc'd data
+// (the caller frees both), or NULL.  Called from one thread at a time.
+typedef Value* (*PatchLoaderFn)(const char* name, void* cookie);
+
+int ParseBatchList(char* list, BatchPatch** patches, int* count);
+void FreeBatchList(BatchPatch* patches, int count);
+
+// How applypatch_batch() will handle each patch, decided before it
+// patches anything: in parallel, or one at a time through
+// applypatch().  Partitions, patches whose target is another patch's
+// source or target, and filesystems without room for all of their
+// targets at once go one at a time.  Fills in plan[count]; returns -1
+// if out of memory.
+#define BATCH_PARALLEL  0
+#define BATCH_SERIAL    1
+int PlanBatch(const BatchPatch* patches, int count, int* plan);
+
+// Apply every patch in 'patches', as applypatch() would, patching
+// independent files on up to 'threads' threads.  Returns 0 if every
+// target ends up with the right contents.
+int applypatch_batch(const BatchPatch* patches, int count,
+                     PatchLoaderFn loader, void* cookie,
+                     int threads, size_t memory_budget);
+
 #endif
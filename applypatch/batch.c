@@ -0,0 +1,615 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "applypatch.h"
+
+// What's become of each patch.
+#define JOB_PENDING     0
+#define JOB_DONE        1   // the target already had the right contents
+#define JOB_PATCHED     2   // "<target>.patch" is written, to be renamed
+#define JOB_DEFERRED    3   // left for applypatch() to do on its own
+
+typedef struct {
+    const BatchPatch* patch;
+    const char* target;         // with "-" resolved
+    char* dir;                  // the target's directory
+    dev_t dev;                  // ... and its filesystem
+    char* outname;              // "<target>.patch"
+    uint8_t target_sha1[SHA_DIGEST_SIZE];
+    int state;
+} Job;
+
+typedef struct {
+    Job* jobs;
+    int count;
+    PatchLoaderFn loader;
+    void* cookie;
+
+    pthread_mutex_t lock;
+    pthread_cond_t budget_freed;
+    int next;                   // next job to hand out
+    size_t budget;
+    size_t in_use;              // memory the jobs are expected to use
+    int running;                // jobs patching within the budget
+
+    // Loaders needn't be thread-safe: the package loader shares the
+    // archive's file offset.
+    pthread_mutex_t loader_lock;
+} Batch;
+
+// -----------------------------------------------------------------
+//   parsing the list
+// -----------------------------------------------------------------
+
+static char* next_token(char** p) {
+    while (**p == ' ' || **p == '\t') ++*p;
+    if (**p == '\0') return NULL;
+    char* start = *p;
+    while (**p != '\0' && **p != ' ' && **p != '\t') ++*p;
+    if (**p != '\0') *(*p)++ = '\0';
+    return start;
+}
+
+int ParseBatchList(char* list, BatchPatch** patches, int* count) {
+    int alloc = 16;
+    *count = 0;
+    *patches = malloc(alloc * sizeof(BatchPatch));
+    if (*patches == NULL) return -1;
+
+    int line_number = 0;
+    char* line;
+    char* save;
+    for (line = strtok_r(list, "\n", &save); line != NULL;
+         line = strtok_r(NULL, "\n", &save)) {
+        ++line_number;
+        size_t len = strlen(line);
+        if (len > 0 && line[len-1] == '\r') line[len-1] = '\0';
+
+        char* p = line;
+        char* source = next_token(&p);
+        if (source == NULL || source[0] == '#') continue;
+        char* target = next_token(&p);
+        char* target_sha1 = next_token(&p);
+        char* size_str = next_token(&p);
+
+        uint8_t digest[SHA_DIGEST_SIZE];
+        char* endptr = NULL;
+        size_t target_size = size_str ? strtoul(size_str, &endptr, 10) : 0;
+        if (size_str == NULL || *endptr != '\0' ||
+            ParseSha1(target_sha1, digest) != 0) {
+            printf("batch list line %d: expected <src> <tgt> <tgt-sha1> <tgt-size> "
+                   "<src-sha1>:<patch> ...\n", line_number);
+            goto fail;
+        }
+
+        if (*count == alloc) {
+            alloc *= 2;
+            BatchPatch* n = realloc(*patches, alloc * sizeof(BatchPatch));
+            if (n == NULL) goto oom;
+            *patches = n;
+        }
+        BatchPatch* bp = &(*patches)[*count];
+        memset(bp, 0, sizeof(*bp));
+        ++*count;
+        bp->source_filename = strdup(source);
+        bp->target_filename = strdup(target);
+        bp->target_sha1_str = strdup(target_sha1);
+        bp->target_size = target_size;
+        if (bp->source_filename == NULL || bp->target_filename == NULL ||
+            bp->target_sha1_str == NULL) {
+            goto oom;
+        }
+
+        char* arg;
+        int patch_alloc = 0;
+        while ((arg = next_token(&p)) != NULL) {
+            char* colon = strchr(arg, ':');
+            if (colon == NULL) {
+                printf("batch list line %d: \"%s\" isn't <src-sha1>:<patch>\n",
+                       line_number, arg);
+                goto fail;
+            }
+            *colon = '\0';
+            if (ParseSha1(arg, digest) != 0) {
+                printf("batch list line %d: bad sha1 \"%s\"\n", line_number, arg);
+                goto fail;
+            }
+            if (bp->num_patches == patch_alloc) {
+                patch_alloc = patch_alloc * 2 + 2;
+                char** sha1s = realloc(bp->patch_sha1_str,
+                                       patch_alloc * sizeof(char*));
+                if (sha1s == NULL) goto oom;
+                bp->patch_sha1_str = sha1s;
+                char** names = realloc(bp->patch_names,
+                                       patch_alloc * sizeof(char*));
+                if (names == NULL) goto oom;
+                bp->patch_names = names;
+            }
+            bp->patch_sha1_str[bp->num_patches] = strdup(arg);
+            bp->patch_names[bp->num_patches] = strdup(colon + 1);
+            ++bp->num_patches;
+            if (bp->patch_sha1_str[bp->num_patches-1] == NULL ||
+                bp->patch_names[bp->num_patches-1] == NULL) {
+                goto oom;
+            }
+        }
+        if (bp->num_patches == 0) {
+            printf("batch list line %d: no patches\n", line_number);
+            goto fail;
+        }
+    }
+    return 0;
+
+  oom:
+    printf("batch list line %d: out of memory\n", line_number);
+  fail:
+    FreeBatchList(*patches, *count);
+    *patches = NULL;
+    *count = 0;
+    return -1;
+}
+
+void FreeBatchList(BatchPatch* patches, int count) {
+    int i, j;
+    for (i = 0; i < count; ++i) {
+        BatchPatch* bp = &patches[i];
+        free(bp->source_filename);
+        free(bp->target_filename);
+        free(bp->target_sha1_str);
+        for (j = 0; j < bp->num_patches; ++j) {
+            free(bp->patch_sha1_str[j]);
+            free(bp->patch_names[j]);
+        }
+        free(bp->patch_sha1_str);
+        free(bp->patch_names);
+    }
+    free(patches);
+}
+
+// -----------------------------------------------------------------
+//   planning
+// -----------------------------------------------------------------
+
+typedef struct {
+    const char* name;
+    int job;
+    int is_target;
+} NameRef;
+
+static int compare_name_refs(const void* a, const void* b) {
+    return strcmp(((const NameRef*)a)->name, ((const NameRef*)b)->name);
+}
+
+// Defer any patch whose target is another patch's source or target:
+// those have to happen in list order.
+static void DeferConflicts(Batch* b) {
+    NameRef* refs = malloc(2 * b->count * sizeof(NameRef));
+    if (refs == NULL) {
+        int i;
+        for (i = 0; i < b->count; ++i) b->jobs[i].state = JOB_DEFERRED;
+        return;
+    }
+    int n = 0, i;
+    for (i = 0; i < b->count; ++i) {
+        refs[n].name = b->jobs[i].patch->source_filename;
+        refs[n].job = i;
+        refs[n++].is_target = 0;
+        if (b->jobs[i].target != b->jobs[i].patch->source_filename) {
+            refs[n].name = b->jobs[i].target;
+            refs[n].job = i;
+            refs[n++].is_target = 1;
+        }
+    }
+    qsort(refs, n, sizeof(NameRef), compare_name_refs);
+
+    int start, end;
+    for (start = 0; start < n; start = end) {
+        int jobs_differ = 0, has_target = 0;
+        for (end = start; end < n && strcmp(refs[end].name, refs[start].name) == 0; ++end) {
+            if (refs[end].job != refs[start].job) jobs_differ = 1;
+            if (refs[end].is_target ||
+                b->jobs[refs[end].job].target == b->jobs[refs[end].job].patch->source_filename) {
+                has_target = 1;
+            }
+        }
+        if (jobs_differ && has_target) {
+            for (i = start; i < end; ++i) b->jobs[refs[i].job].state = JOB_DEFERRED;
+        }
+    }
+    free(refs);
+}
+
+// Check once per filesystem that there's room for every patched file
+// at the same time (they're all written before any is renamed), with
+// the same margins applypatch() uses.  Patches to a filesystem that's
+// too full are deferred: applypatch() knows how to make room.
+static void CheckFreeSpace(Batch* b) {
+    int i, j;
+    for (i = 0; i < b->count; ++i) {
+        Job* job = &b->jobs[i];
+        if (job->state != JOB_PENDING || job->dev == (dev_t)-1) continue;
+        dev_t dev = job->dev;
+
+        size_t needed = 0;
+        for (j = i; j < b->count; ++j) {
+            if (b->jobs[j].state == JOB_PENDING && b->jobs[j].dev == dev) {
+                needed += b->jobs[j].patch->target_size;
+            }
+        }
+        size_t free_space = FreeSpaceForFile(job->dir);
+        int enough = free_space != (size_t)-1 &&
+                     free_space > (256 << 10) &&
+                     free_space > needed / 2 * 3;
+        printf("batch: %ld bytes of targets on the filesystem of %s; %ld free%s\n",
+               (long)needed, job->dir, (long)free_space,
+               enough ? "" : "; patching those one at a time");
+
+        for (j = i; j < b->count; ++j) {
+            if (b->jobs[j].state == JOB_PENDING && b->jobs[j].dev == dev) {
+                if (!enough) b->jobs[j].state = JOB_DEFERRED;
+                b->jobs[j].dev = (dev_t)-1;     // accounted for
+            }
+        }
+    }
+}
+
+// -----------------------------------------------------------------
+//   patching
+// -----------------------------------------------------------------
+
+// Release what a PatchLoaderFn returned.  (libapplypatch doesn't
+// link edify's FreeValue().)
+static void FreePatch(Value* patch) {
+    if (patch == NULL) return;
+    free(patch->data);
+    free(patch);
+}
+
+// What patching with 'patch' is expected to cost, beyond the mapped
+// source: the patch itself, the output and bsdiff's buffers (about
+// twice the target), and whatever an imgdiff patch expands.
+static size_t JobCost(const Job* job, const Value* patch) {
+    size_t cost = job->patch->target_size;
+    size_t parts[3] = { cost, patch->size, ImagePatchMemory(patch) };
+    int i;
+    for (i = 0; i < 3; ++i) {
+        cost = (cost > SIZE_MAX - parts[i]) ? SIZE_MAX : cost + parts[i];
+    }
+    return cost;
+}
+
+// Wait until a job that will use 'cost' bytes fits in the budget.
+// 'held' of them (the loaded patch) are in use already, so they count
+// against the other jobs while this one waits.  A job bigger than the
+// whole budget runs once nothing else is.
+static void ReserveMemory(Batch* b, size_t held, size_t cost) {
+    if (cost > b->budget) cost = b->budget;
+    if (held > cost) held = cost;
+    pthread_mutex_lock(&b->lock);
+    b->in_use += held;
+    while (b->running > 0 && b->in_use - held + cost > b->budget) {
+        pthread_cond_wait(&b->budget_freed, &b->lock);
+    }
+    b->in_use += cost - held;
+    ++b->running;
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void ReleaseMemory(Batch* b, size_t cost) {
+    if (cost > b->budget) cost = b->budget;
+    pthread_mutex_lock(&b->lock);
+    b->in_use -= cost;
+    --b->running;
+    pthread_cond_broadcast(&b->budget_freed);
+    pthread_mutex_unlock(&b->lock);
+}
+
+// Produce job's "<target>.patch", or decide it needs no patching or
+// must be left to applypatch().
+static void RunJob(Batch* b, Job* job) {
+    const BatchPatch* bp = job->patch;
+    FileContents target_file, source_file;
+    target_file.data = NULL;
+    target_file.mapped = 0;
+    source_file.data = NULL;
+    source_file.mapped = 0;
+    FileContents* source = &source_file;
+
+    job->state = JOB_DEFERRED;
+    if (MapFileContents(job->target, &target_file, RETOUCH_DO_MASK) == 0) {
+        if (memcmp(target_file.sha1, job->target_sha1, SHA_DIGEST_SIZE) == 0) {
+            printf("patch %s: already\n", job->target);
+            job->state = JOB_DONE;
+            goto done;
+        }
+        if (job->target == bp->source_filename) source = &target_file;
+    }
+    if (source == &source_file &&
+        MapFileContents(bp->source_filename, &source_file,
+                        RETOUCH_DO_MASK) != 0) {
+        goto done;
+    }
+
+    int to_use = FindMatchingPatch(source->sha1, bp->patch_sha1_str,
+                                   bp->num_patches);
+    if (to_use < 0) goto done;
+
+    pthread_mutex_lock(&b->loader_lock);
+    Value* patch = b->loader(bp->patch_names[to_use], b->cookie);
+    pthread_mutex_unlock(&b->loader_lock);
+    if (patch == NULL) goto done;
+    size_t cost = JobCost(job, patch);
+    ReserveMemory(b, patch->size, cost);
+    if (PatchToFile(source, patch, job->outname, job->target_sha1) == 0) {
+        job->state = JOB_PATCHED;
+    }
+    FreePatch(patch);
+    ReleaseMemory(b, cost);
+
+  done:
+    FreeFileContents(&target_file);
+    FreeFileContents(&source_file);
+}
+
+static void* Worker(void* cookie) {
+    Batch* b = (Batch*)cookie;
+    pthread_mutex_lock(&b->lock);
+    for (;;) {
+        while (b->next < b->count && b->jobs[b->next].state != JOB_PENDING) {
+            ++b->next;
+        }
+        if (b->next == b->count) break;
+        Job* job = &b->jobs[b->next++];
+        pthread_mutex_unlock(&b->lock);
+
+        // RunJob() takes its share of the budget once it knows which
+        // patch it's applying.
+        RunJob(b, job);
+
+        pthread_mutex_lock(&b->lock);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+// -----------------------------------------------------------------
+//   committing
+// -----------------------------------------------------------------
+
+static int compare_strings(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Flush the data of every file on the filesystem containing 'dir'.
+static void SyncFilesystem(const char* dir) {
+    int fd = open(dir, O_RDONLY);
+#ifdef __NR_syncfs
+    if (fd >= 0 && syscall(__NR_syncfs, fd) == 0) {
+        close(fd);
+        return;
+    }
+#endif
+    if (fd >= 0) close(fd);
+    sync();
+}
+
+// Make the patched files durable, one sync per filesystem, then rename
+// them all into place and sync each directory once.  A patch whose
+// rename fails is deferred.
+static void CommitPatchedFiles(Batch* b) {
+    char** dirs = malloc(b->count * sizeof(char*));
+    dev_t* devs = malloc(b->count * sizeof(dev_t));
+    int dir_count = 0, dev_count = 0;
+    int i, j;
+    if (dirs == NULL || devs == NULL) {
+        free(dirs);
+        free(devs);
+        sync();
+        dirs = NULL;
+        devs = NULL;
+    }
+
+    for (i = 0; i < b->count; ++i) {
+        Job* job = &b->jobs[i];
+        if (job->state != JOB_PATCHED) continue;
+        struct stat st;
+        if (devs == NULL || stat(job->outname, &st) != 0) continue;
+        for (j = 0; j < dev_count && devs[j] != st.st_dev; ++j) ;
+        if (j == dev_count) {
+            devs[dev_count++] = st.st_dev;
+            SyncFilesystem(job->dir);
+        }
+    }
+
+    for (i = 0; i < b->count; ++i) {
+        Job* job = &b->jobs[i];
+        if (job->state != JOB_PATCHED) continue;
+        if (rename(job->outname, job->target) != 0) {
+            printf("rename of .patch to \"%s\" failed: %s\n",
+                   job->target, strerror(errno));
+            unlink(job->outname);
+            job->state = JOB_DEFERRED;
+            continue;
+        }
+        printf("patch %s: now ", job->target);
+        for (j = 0; j < 4; ++j) printf("%02x", job->target_sha1[j]);
+        printf("\n");
+        if (dirs != NULL) dirs[dir_count++] = job->dir;
+    }
+
+    if (dirs != NULL) {
+        qsort(dirs, dir_count, sizeof(char*), compare_strings);
+        for (i = 0; i < dir_count; ++i) {
+            if (i > 0 && strcmp(dirs[i], dirs[i-1]) == 0) continue;
+            int fd = open(dirs[i], O_RDONLY);
+            if (fd >= 0) {
+                fsync(fd);
+                close(fd);
+            }
+        }
+    }
+    free(dirs);
+    free(devs);
+}
+
+// Run one deferred patch the ordinary way.
+static int RunDeferred(Batch* b, const BatchPatch* bp) {
+    Value** patch_data = calloc(bp->num_patches, sizeof(Value*));
+    int result = 1;
+    int i;
+    if (patch_data == NULL) return 1;
+    for (i = 0; i < bp->num_patches; ++i) {
+        patch_data[i] = b->loader(bp->patch_names[i], b->cookie);
+        if (patch_data[i] == NULL) {
+            printf("failed to load patch %s\n", bp->patch_names[i]);
+            goto done;
+        }
+    }
+    result = applypatch(bp->source_filename, bp->target_filename,
+                        bp->target_sha1_str, bp->target_size,
+                        bp->num_patches, bp->patch_sha1_str, patch_data, NULL);
+  done:
+    for (i = 0; i < bp->num_patches; ++i) FreePatch(patch_data[i]);
+    free(patch_data);
+    return result;
+}
+
+// Set up b's jobs for 'patches' and decide which can run in parallel.
+// Returns -1 if out of memory.
+static int PrepareBatch(Batch* b, const BatchPatch* patches, int count) {
+    memset(b, 0, sizeof(*b));
+    b->count = count;
+    b->jobs = calloc(count ? count : 1, sizeof(Job));
+    if (b->jobs == NULL) {
+        printf("batch: out of memory\n");
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        Job* job = &b->jobs[i];
+        const BatchPatch* bp = &patches[i];
+        job->patch = bp;
+        job->target = strcmp(bp->target_filename, "-") == 0 ?
+            bp->source_filename : bp->target_filename;
+        job->dev = (dev_t)-1;
+        ParseSha1(bp->target_sha1_str, job->target_sha1);
+
+        // Partitions, and anything odd, go the ordinary way.
+        const char* slash = strrchr(job->target, '/');
+        struct stat st;
+        if (strncmp(bp->source_filename, "MTD:", 4) == 0 ||
+            strncmp(bp->source_filename, "EMMC:", 5) == 0 ||
+            slash == NULL || slash == job->target) {
+            job->state = JOB_DEFERRED;
+            continue;
+        }
+        job->dir = strndup(job->target, slash - job->target);
+        job->outname = malloc(strlen(job->target) + 10);
+        if (job->dir == NULL || job->outname == NULL ||
+            stat(job->dir, &st) != 0) {
+            job->state = JOB_DEFERRED;
+            continue;
+        }
+        strcpy(job->outname, job->target);
+        strcat(job->outname, ".patch");
+        job->dev = st.st_dev;
+    }
+
+    DeferConflicts(b);
+    CheckFreeSpace(b);
+    return 0;
+}
+
+static void FreeJobs(Batch* b) {
+    int i;
+    for (i = 0; i < b->count; ++i) {
+        free(b->jobs[i].dir);
+        free(b->jobs[i].outname);
+    }
+    free(b->jobs);
+}
+
+int PlanBatch(const BatchPatch* patches, int count, int* plan) {
+    Batch b;
+    if (PrepareBatch(&b, patches, count) != 0) return -1;
+    int i;
+    for (i = 0; i < count; ++i) {
+        plan[i] = b.jobs[i].state == JOB_PENDING ? BATCH_PARALLEL : BATCH_SERIAL;
+    }
+    FreeJobs(&b);
+    return 0;
+}
+
+int applypatch_batch(const BatchPatch* patches, int count,
+                     PatchLoaderFn loader, void* cookie,
+                     int threads, size_t memory_budget) {
+    Batch b;
+    if (PrepareBatch(&b, patches, count) != 0) return 1;
+    b.loader = loader;
+    b.cookie = cookie;
+    b.budget = memory_budget;
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_mutex_init(&b.loader_lock, NULL);
+    pthread_cond_init(&b.budget_freed, NULL);
+
+    int i;
+    if (threads > count) threads = count;
+    if (threads < 1) threads = 1;
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    for (i = 0; tids != NULL && i < threads - 1; ++i) {
+        if (pthread_create(&tids[started], NULL, Worker, &b) == 0) ++started;
+    }
+    Worker(&b);
+    for (i = 0; i < started; ++i) pthread_join(tids[i], NULL);
+    free(tids);
+    printf("batch: patched with %d thread%s\n", started + 1, started ? "s" : "");
+
+    CommitPatchedFiles(&b);
+
+    int done = 0, patched = 0, deferred = 0, failures = 0;
+    for (i = 0; i < count; ++i) {
+        switch (b.jobs[i].state) {
+            case JOB_DONE: ++done; break;
+            case JOB_PATCHED: ++patched; break;
+            default:
+                ++deferred;
+                if (RunDeferred(&b, &patches[i]) != 0) ++failures;
+                break;
+        }
+    }
+    printf("batch: %d patched, %d already done, %d one at a time, %d failed\n",
+           patched, done, deferred, failures);
+
+    FreeJobs(&b);
+    pthread_mutex_destroy(&b.lock);
+    pthread_mutex_destroy(&b.loader_lock);
+    pthread_cond_destroy(&b.budget_freed);
+    return failures == 0 ? 0 : 1;
+}
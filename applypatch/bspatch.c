@@ -31,6 +31,9 @@
 #include "mincrypt/sha.h"
 #include "applypatch.h"
 
+int gPatchTiming = 0;
+uint64_t gPatchStageNs[PATCH_STAGE_COUNT];
+
 void ShowBSDiffLicense() {
     puts("The bsdiff library used herein is:\n"
          "\n"
@@ -82,6 +85,7 @@ static off_t offtin(u_char *buf)
 }
 
 int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
+    uint64_t start = PatchStageStart();
     stream->next_out = (char*)buffer;
     stream->avail_out = size;
     while (stream->avail_out > 0) {
@@ -94,6 +98,7 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
             printf("need %d more bytes\n", stream->avail_out);
         }
     }
+    PatchStageEnd(PATCH_STAGE_BZIP2, start);
     return 0;
 }
 
@@ -108,12 +113,16 @@ int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
         return -1;
     }
 
+    uint64_t start = PatchStageStart();
     if (sink(new_data, new_size, token) < new_size) {
         printf("short write of output: %d (%s)\n", errno, strerror(errno));
         return 1;
     }
+    PatchStageEnd(PATCH_STAGE_SINK, start);
     if (ctx) {
+        start = PatchStageStart();
         SHA_update(ctx, new_data, new_size);
+        PatchStageEnd(PATCH_STAGE_SHA, start);
     }
     free(new_data);
 
@@ -218,11 +227,13 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         }
 
         // Add old data to diff string
+        uint64_t start = PatchStageStart();
         for (i = 0; i < ctrl[0]; ++i) {
             if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
                 (*new_data)[newpos+i] += old_data[oldpos+i];
             }
         }
+        PatchStageEnd(PATCH_STAGE_ADD, start);
 
         // Adjust pointers
         newpos += ctrl[0];
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "contentcache.h"
+
+// Hash-only entries cost next to nothing, but don't let them pile up.
+#define MAX_ENTRIES 64
+
+typedef struct Entry {
+    char* path;
+    bool is_file;
+    int retouch_flag;           // files only
+    struct stat st;             // files only
+    size_t size;
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    unsigned char* data;        // NULL if only the hash is known
+    struct Entry* prev;         // more recently used
+    struct Entry* next;         // less recently used
+} Entry;
+
+static Entry* head;             // most recently used
+static Entry* tail;
+static int entry_count;
+static size_t used;             // bytes of data held
+static size_t budget;
+
+// applypatch_batch() loads files from several threads.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void unlink_entry(Entry* e) {
+    if (e->prev) e->prev->next = e->next; else head = e->next;
+    if (e->next) e->next->prev = e->prev; else tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void push_front(Entry* e) {
+    e->next = head;
+    e->prev = NULL;
+    if (head) head->prev = e; else tail = e;
+    head = e;
+}
+
+static void free_entry(Entry* e) {
+    unlink_entry(e);
+    if (e->data) used -= e->size;
+    --entry_count;
+    free(e->data);
+    free(e->path);
+    free(e);
+}
+
+static void evict(size_t need) {
+    while (tail != NULL &&
+           (used + need > budget || entry_count >= MAX_ENTRIES)) {
+        free_entry(tail);
+    }
+}
+
+// Copy e into *file, leaving the data out unless 'with_data'.  Returns
+// -1 if the copy can't be allocated.  Callers take NULL data for a
+// failed load, so an empty file still gets a buffer.
+static int hit(Entry* e, int with_data, FileContents* file) {
+    file->data = NULL;
+    if (with_data) {
+        file->data = malloc(e->size ? e->size : 1);
+        if (file->data == NULL) return -1;
+        memcpy(file->data, e->data, e->size);
+    }
+    file->size = e->size;
+    memcpy(file->sha1, e->sha1, SHA_DIGEST_SIZE);
+    file->st = e->st;
+    unlink_entry(e);
+    push_front(e);
+    return 0;
+}
+
+// Make a new entry for 'path' with file's size and hash, copying the
+// data if there is any and it fits.  Returns NULL if it can't be kept.
+static Entry* add(const char* path, const FileContents* file) {
+    size_t size = file->size;
+    if (budget == 0 || (file->data != NULL && size > budget)) return NULL;
+
+    Entry* e = calloc(1, sizeof(Entry));
+    if (e == NULL) return NULL;
+    e->path = strdup(path);
+    e->size = size;
+    memcpy(e->sha1, file->sha1, SHA_DIGEST_SIZE);
+    if (file->data != NULL) {
+        e->data = malloc(size ? size : 1);
+        if (e->data != NULL) memcpy(e->data, file->data, size);
+    }
+    if (e->path == NULL || (file->data != NULL && e->data == NULL)) {
+        free(e->data);
+        free(e->path);
+        free(e);
+        return NULL;
+    }
+
+    evict(e->data ? size : 0);
+    if (e->data) used += size;
+    ++entry_count;
+    push_front(e);
+    return e;
+}
+
+void ContentCacheSetBudget(size_t bytes) {
+    pthread_mutex_lock(&cache_lock);
+    budget = bytes;
+    evict(0);
+    while (bytes == 0 && tail != NULL) free_entry(tail);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int ContentCacheFindPartition(const char* partition, size_t size,
+                              const uint8_t sha1[SHA_DIGEST_SIZE],
+                              int need_data, FileContents* file) {
+    int result = -1;
+    pthread_mutex_lock(&cache_lock);
+    Entry* e;
+    for (e = head; e != NULL; e = e->next) {
+        if (!e->is_file && e->size == size &&
+            (e->data != NULL || !need_data) &&
+            memcmp(e->sha1, sha1, SHA_DIGEST_SIZE) == 0 &&
+            strcmp(e->path, partition) == 0) {
+            result = hit(e, need_data, file);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+void ContentCacheAddPartition(const char* partition, const FileContents* file) {
+    pthread_mutex_lock(&cache_lock);
+    Entry* e;
+    for (e = head; e != NULL; e = e->next) {
+        if (!e->is_file && e->size == (size_t)file->size &&
+            memcmp(e->sha1, file->sha1, SHA_DIGEST_SIZE) == 0 &&
+            strcmp(e->path, partition) == 0) {
+            if (e->data != NULL || file->data == NULL) {
+                // Nothing new.
+                unlink_entry(e);
+                push_front(e);
+                pthread_mutex_unlock(&cache_lock);
+                return;
+            }
+            free_entry(e);
+            break;
+        }
+    }
+    e = add(partition, file);
+    if (e != NULL) {
+        e->st.st_mode = 0644;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int ContentCacheFindFile(const char* path, const struct stat* st,
+                         int retouch_flag, FileContents* file) {
+    int result = -1;
+    pthread_mutex_lock(&cache_lock);
+    Entry* e;
+    for (e = head; e != NULL; e = e->next) {
+        if (e->is_file && e->retouch_flag == retouch_flag &&
+            strcmp(e->path, path) == 0) {
+            if (e->st.st_dev == st->st_dev && e->st.st_ino == st->st_ino &&
+                e->st.st_size == st->st_size &&
+                e->st.st_mtime == st->st_mtime &&
+                e->st.st_mtim.tv_nsec == st->st_mtim.tv_nsec) {
+                result = hit(e, 1, file);
+                // Ownership and mode may have changed without
+                // touching the contents.
+                if (result == 0) file->st = *st;
+            } else {
+                // The file has changed since.
+                free_entry(e);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+void ContentCacheAddFile(const char* path, int retouch_flag,
+                         const FileContents* file) {
+    if (file->data == NULL) return;
+    pthread_mutex_lock(&cache_lock);
+    Entry* e;
+    for (e = head; e != NULL; e = e->next) {
+        if (e->is_file && e->retouch_flag == retouch_flag &&
+            strcmp(e->path, path) == 0) {
+            free_entry(e);
+            break;
+        }
+    }
+    e = add(path, file);
+    if (e != NULL) {
+        e->is_file = true;
+        e->retouch_flag = retouch_flag;
+        e->st = file->st;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void ContentCacheDrop(const char* path) {
+    pthread_mutex_lock(&cache_lock);
+    Entry* e = head;
+    while (e != NULL) {
+        Entry* next = e->next;
+        if (strcmp(e->path, path) == 0) free_entry(e);
+        e = next;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void ContentCacheDropPartitions() {
+    pthread_mutex_lock(&cache_lock);
+    Entry* e = head;
+    while (e != NULL) {
+        Entry* next = e->next;
+        if (!e->is_file) free_entry(e);
+        e = next;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_CONTENTCACHE_H
+#define _APPLYPATCH_CONTENTCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "applypatch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A process-wide cache of what LoadFileContents() has read, so that an
+// update script that checks, patches and sha1_check()s the same source
+// reads it once.  Entries are kept in least-recently-used order and
+// evicted once their data exceeds the budget.
+//
+// Partition entries are keyed by (partition, size, sha1); a partition
+// has no mtime, so whoever writes one must drop its entries.  An entry
+// may record only the hash, with no data: that's enough to answer a
+// check.  File entries are keyed by (path, retouch flag) and are only
+// used while the file's device, inode, size and mtime are unchanged.
+//
+// Hits hand back a malloc'd copy of the data, so callers own and free
+// it exactly as they do for an uncached load.  The cache is off (every
+// lookup misses) until a budget is set.
+
+// Set how many bytes of data the cache may hold; 0 empties and
+// disables it.
+void ContentCacheSetBudget(size_t bytes);
+
+// Look for the first 'size' bytes of 'partition' having 'sha1'.  If
+// 'need_data' is set, only an entry holding the data will do.  On a hit
+// fills in *file (file->data is NULL unless 'need_data') and returns 0;
+// returns -1 on a miss.
+int ContentCacheFindPartition(const char* partition, size_t size,
+                              const uint8_t sha1[SHA_DIGEST_SIZE],
+                              int need_data, FileContents* file);
+
+// Remember that the first file->size bytes of 'partition' have hash
+// file->sha1, and their contents if file->data isn't NULL.
+void ContentCacheAddPartition(const char* partition, const FileContents* file);
+
+// Look for 'path', loaded with 'retouch_flag', whose current stat() is
+// 'st'.  On a hit fills in *file and returns 0; returns -1 on a miss.
+int ContentCacheFindFile(const char* path, const struct stat* st,
+                         int retouch_flag, FileContents* file);
+
+// Remember the contents of 'path' as loaded with 'retouch_flag';
+// file->st must be what stat() returned before it was read.
+void ContentCacheAddFile(const char* path, int retouch_flag,
+                         const FileContents* file);
+
+// Forget everything about 'path' (a partition or a file).
+void ContentCacheDrop(const char* path);
+
+// Forget every partition entry, for when something may have written
+// to partitions behind the cache's back.
+void ContentCacheDropPartitions();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
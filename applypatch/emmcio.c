@@ -0,0 +1,302 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/aio_abi.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "emmcio.h"
+
+#ifndef O_DIRECT
+#define O_DIRECT 040000
+#endif
+
+// O_DIRECT transfers must be aligned to the device's logical block
+// size, which is never more than this.
+#define DIRECT_ALIGN 4096
+
+struct EmmcWriter {
+    char* path;
+    int fd;
+    bool direct;
+    aio_context_t aio;          // 0 if writes are synchronous
+
+    unsigned char* buf[EMMC_QUEUE_DEPTH];
+    struct iocb iocb[EMMC_QUEUE_DEPTH];
+    bool busy[EMMC_QUEUE_DEPTH];
+    int cur;                    // buffer being filled
+    size_t fill;                // bytes in it
+    off64_t offset;             // where it goes
+
+    size_t total;
+    SHA_CTX sha_ctx;
+    bool failed;
+};
+
+static long sys_io_setup(unsigned nr, aio_context_t* ctx) {
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+static long sys_io_destroy(aio_context_t ctx) {
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static long sys_io_submit(aio_context_t ctx, long n, struct iocb** iocbs) {
+    return syscall(__NR_io_submit, ctx, n, iocbs);
+}
+
+static long sys_io_getevents(aio_context_t ctx, long min_nr, long nr,
+                             struct io_event* events) {
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, NULL);
+}
+
+static int pwrite_all(int fd, const unsigned char* data, size_t len, off64_t offset) {
+    while (len > 0) {
+        ssize_t w = pwrite64(fd, data, len, offset);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (w == 0) {
+            errno = ENOSPC;
+            return -1;
+        }
+        data += w;
+        len -= w;
+        offset += w;
+    }
+    return 0;
+}
+
+static void fail(EmmcWriter* w, const char* what) {
+    printf("%s %s: %s\n", what, w->path, strerror(errno));
+    w->failed = true;
+}
+
+// Wait until buffer i is free to reuse.
+static int wait_for(EmmcWriter* w, int i) {
+    while (w->busy[i]) {
+        struct io_event events[EMMC_QUEUE_DEPTH];
+        long n = sys_io_getevents(w->aio, 1, EMMC_QUEUE_DEPTH, events);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fail(w, "failed waiting for writes to");
+            return -1;
+        }
+        long e;
+        for (e = 0; e < n; ++e) {
+            int done = (int)events[e].data;
+            w->busy[done] = false;
+            if (events[e].res != (int64_t)w->iocb[done].aio_nbytes) {
+                errno = events[e].res < 0 ? -events[e].res : ENOSPC;
+                fail(w, "failed writing");
+            }
+        }
+    }
+    return w->failed ? -1 : 0;
+}
+
+static int wait_all(EmmcWriter* w) {
+    int i, result = 0;
+    for (i = 0; i < EMMC_QUEUE_DEPTH; ++i) {
+        if (wait_for(w, i) < 0) result = -1;
+    }
+    return result;
+}
+
+// Start writing the first 'len' bytes of the current buffer, and move
+// on to the next buffer.
+static int submit(EmmcWriter* w, size_t len) {
+    int i = w->cur;
+    if (w->aio != 0) {
+        struct iocb* cb = &w->iocb[i];
+        memset(cb, 0, sizeof(*cb));
+        cb->aio_data = i;
+        cb->aio_lio_opcode = IOCB_CMD_PWRITE;
+        cb->aio_fildes = w->fd;
+        cb->aio_buf = (uintptr_t)w->buf[i];
+        cb->aio_nbytes = len;
+        cb->aio_offset = w->offset;
+        long r;
+        do {
+            r = sys_io_submit(w->aio, 1, &cb);
+        } while (r < 0 && errno == EINTR);
+        if (r != 1) {
+            fail(w, "failed queueing write to");
+            return -1;
+        }
+        w->busy[i] = true;
+    } else if (pwrite_all(w->fd, w->buf[i], len, w->offset) < 0) {
+        fail(w, "failed writing");
+        return -1;
+    }
+    w->offset += len;
+    w->cur = (i + 1) % EMMC_QUEUE_DEPTH;
+    w->fill = 0;
+    return 0;
+}
+
+EmmcWriter* EmmcWriterOpen(const char* path) {
+    EmmcWriter* w = calloc(1, sizeof(EmmcWriter));
+    if (w == NULL) {
+        printf("failed to allocate writer for %s\n", path);
+        return NULL;
+    }
+    w->path = strdup(path);
+    SHA_init(&w->sha_ctx);
+    w->fd = open(path, O_WRONLY | O_DIRECT);
+    w->direct = true;
+    if (w->fd < 0 && errno == EINVAL) {
+        // The filesystem doesn't do O_DIRECT.
+        w->fd = open(path, O_WRONLY);
+        w->direct = false;
+    }
+    if (w->fd < 0) {
+        printf("failed to open %s: %s\n", path, strerror(errno));
+        free(w->path);
+        free(w);
+        return NULL;
+    }
+
+    int i;
+    for (i = 0; i < EMMC_QUEUE_DEPTH; ++i) {
+        if (posix_memalign((void**)&w->buf[i], DIRECT_ALIGN, EMMC_IO_SIZE) != 0) {
+            printf("failed to allocate write buffers for %s\n", path);
+            w->failed = true;
+            EmmcWriterFinish(w, NULL, NULL);
+            return NULL;
+        }
+    }
+
+    if (sys_io_setup(EMMC_QUEUE_DEPTH, &w->aio) < 0) {
+        printf("no AIO (%s); writing %s synchronously\n", strerror(errno), path);
+        w->aio = 0;
+    }
+    return w;
+}
+
+int EmmcWriterWrite(EmmcWriter* w, const unsigned char* data, size_t len) {
+    if (w->failed) return -1;
+    SHA_update(&w->sha_ctx, data, len);
+    w->total += len;
+    while (len > 0) {
+        if (w->fill == 0 && wait_for(w, w->cur) < 0) return -1;
+        size_t n = EMMC_IO_SIZE - w->fill;
+        if (n > len) n = len;
+        memcpy(w->buf[w->cur] + w->fill, data, n);
+        w->fill += n;
+        data += n;
+        len -= n;
+        if (w->fill == EMMC_IO_SIZE && submit(w, EMMC_IO_SIZE) < 0) return -1;
+    }
+    return 0;
+}
+
+ssize_t EmmcWriterSink(unsigned char* data, ssize_t len, void* token) {
+    return EmmcWriterWrite((EmmcWriter*)token, data, len) == 0 ? len : -1;
+}
+
+int EmmcWriterFinish(EmmcWriter* w, uint8_t sha1[SHA_DIGEST_SIZE], size_t* size) {
+    if (!w->failed && w->fill > 0) {
+        size_t aligned = w->fill & ~(size_t)(DIRECT_ALIGN - 1);
+        size_t tail = w->fill - aligned;
+        int i = w->cur;
+        if (aligned > 0) submit(w, aligned);
+        if (tail > 0 && wait_all(w) == 0) {
+            // A partial block can't be written with O_DIRECT; write it
+            // through the page cache instead.
+            if (w->direct) {
+                fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+            }
+            if (pwrite_all(w->fd, w->buf[i] + aligned, tail, w->offset) < 0) {
+                fail(w, "failed writing");
+            }
+        }
+    }
+    wait_all(w);
+    if (!w->failed && fdatasync(w->fd) < 0) fail(w, "failed to sync");
+    if (close(w->fd) < 0 && !w->failed) fail(w, "failed to close");
+
+    if (w->aio != 0) sys_io_destroy(w->aio);
+    int i;
+    for (i = 0; i < EMMC_QUEUE_DEPTH; ++i) free(w->buf[i]);
+
+    const uint8_t* digest = SHA_final(&w->sha_ctx);
+    if (sha1 != NULL) memcpy(sha1, digest, SHA_DIGEST_SIZE);
+    if (size != NULL) *size = w->total;
+
+    int result = w->failed ? -1 : 0;
+    free(w->path);
+    free(w);
+    return result;
+}
+
+int EmmcVerify(const char* path, size_t len, const uint8_t sha1[SHA_DIGEST_SIZE]) {
+    int fd = open(path, O_RDONLY | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        // No O_DIRECT; at least make sure the data isn't coming from
+        // the pages we just wrote.
+        fd = open(path, O_RDONLY);
+        if (fd >= 0) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    if (fd < 0) {
+        printf("failed to open %s for verification: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    unsigned char* buffer;
+    if (posix_memalign((void**)&buffer, DIRECT_ALIGN, EMMC_IO_SIZE) != 0) {
+        printf("failed to allocate verification buffer\n");
+        close(fd);
+        return -1;
+    }
+
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    size_t pos = 0;
+    int result = 0;
+    while (pos < len) {
+        // Read whole blocks, even at the end.
+        size_t want = len - pos;
+        if (want > EMMC_IO_SIZE) want = EMMC_IO_SIZE;
+        want = (want + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+        ssize_t n = pread64(fd, buffer, want, pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            printf("verify read of %s failed at %zu: %s\n", path, pos,
+                   n < 0 ? strerror(errno) : "end of file");
+            result = -1;
+            break;
+        }
+        size_t use = (size_t)n < len - pos ? (size_t)n : len - pos;
+        SHA_update(&ctx, buffer, use);
+        pos += use;
+    }
+    free(buffer);
+    close(fd);
+
+    if (result == 0 && memcmp(SHA_final(&ctx), sha1, SHA_DIGEST_SIZE) != 0) {
+        result = 1;
+    }
+    return result;
+}
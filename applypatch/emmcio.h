@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_EMMCIO_H
+#define _APPLYPATCH_EMMCIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "mincrypt/sha.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Writing whole images to EMMC partitions (or any block device or
+// file) with O_DIRECT.  Data is gathered into EMMC_IO_SIZE aligned
+// buffers, and up to EMMC_QUEUE_DEPTH of them are in flight at once
+// using the kernel's native AIO, so the device always has the next
+// write queued.  Nothing goes through the page cache, and one
+// fdatasync() at the end makes the image durable.
+//
+// Where O_DIRECT or AIO isn't available the same code falls back to
+// ordinary pwrite() calls of the same size.
+
+#define EMMC_IO_SIZE        (1024 * 1024)
+#define EMMC_QUEUE_DEPTH    4
+
+typedef struct EmmcWriter EmmcWriter;
+
+// Open 'path' for writing from its start.  Returns NULL (having
+// printed why) on failure.
+EmmcWriter* EmmcWriterOpen(const char* path);
+
+// Append 'len' bytes to what's been written.  Returns 0 on success, -1
+// on failure; after a failure every later call fails too.
+int EmmcWriterWrite(EmmcWriter* w, const unsigned char* data, size_t len);
+
+// A SinkFn (see applypatch.h) that appends to the EmmcWriter 'token'.
+ssize_t EmmcWriterSink(unsigned char* data, ssize_t len, void* token);
+
+// Write anything left over, wait for every write to finish and
+// fdatasync() the device.  A final partial block is written through
+// the page cache (and still synced); the bytes after it are left as
+// they were.  On success returns 0 and, if 'sha1' isn't NULL, fills it
+// with the SHA-1 of all the data written and *size (if not NULL) with
+// its length.  Frees 'w' either way.
+int EmmcWriterFinish(EmmcWriter* w, uint8_t sha1[SHA_DIGEST_SIZE], size_t* size);
+
+// Read the first 'len' bytes of 'path' back with O_DIRECT, so they
+// come from the device rather than the page cache, and compare their
+// SHA-1 with 'sha1'.  Returns 0 if they match, 1 if they don't and -1
+// if they couldn't be read.
+int EmmcVerify(const char* path, size_t len, const uint8_t sha1[SHA_DIGEST_SIZE]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
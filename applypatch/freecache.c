@@ -11,7 +11,70 @@
 
 #include "applypatch.h"
 
-static int EliminateOpenFiles(char** files, int file_count) {
+typedef struct {
+  char* path;
+  size_t bytes;      // space freed by deleting it (0 if it has other links)
+  int chosen;
+} Expendable;
+
+// A set of paths, open-addressed; 'slots' is a power of two at least
+// twice the number of entries.
+typedef struct {
+  char** slot;
+  size_t mask;
+  size_t count;
+} PathSet;
+
+static size_t HashPath(const char* s) {
+  size_t h = 5381;
+  while (*s) h = h * 33 + (unsigned char)*s++;
+  return h;
+}
+
+static int PathSetContains(const PathSet* set, const char* path) {
+  size_t i;
+  if (set->count == 0) return 0;
+  for (i = HashPath(path) & set->mask; set->slot[i]; i = (i + 1) & set->mask) {
+    if (strcmp(set->slot[i], path) == 0) return 1;
+  }
+  return 0;
+}
+
+static int PathSetAdd(PathSet* set, const char* path) {
+  if ((set->count + 1) * 2 > set->mask + 1) {
+    size_t n = (set->mask + 1) * 2;
+    if (n < 64) n = 64;
+    char** slot = calloc(n, sizeof(char*));
+    if (slot == NULL) return -1;
+    size_t i;
+    for (i = 0; set->slot && i <= set->mask; ++i) {
+      if (set->slot[i]) {
+        size_t j = HashPath(set->slot[i]) & (n - 1);
+        while (slot[j]) j = (j + 1) & (n - 1);
+        slot[j] = set->slot[i];
+      }
+    }
+    free(set->slot);
+    set->slot = slot;
+    set->mask = n - 1;
+  }
+  if (PathSetContains(set, path)) return 0;
+  size_t i = HashPath(path) & set->mask;
+  while (set->slot[i]) i = (i + 1) & set->mask;
+  set->slot[i] = strdup(path);
+  if (set->slot[i] == NULL) return -1;
+  ++set->count;
+  return 0;
+}
+
+static void PathSetFree(PathSet* set) {
+  size_t i;
+  for (i = 0; set->slot && i <= set->mask; ++i) free(set->slot[i]);
+  free(set->slot);
+}
+
+// Collect every path under /cache that some process has open.
+static int FindOpenCacheFiles(PathSet* open_files) {
   DIR* d;
   struct dirent* de;
   d = opendir("/proc");
@@ -27,9 +90,7 @@ static int EliminateOpenFiles(char** files, int file_count) {
     // de->d_name[i] is numeric
 
     char path[FILENAME_MAX];
-    strcpy(path, "/proc/");
-    strcat(path, de->d_name);
-    strcat(path, "/fd/");
+    snprintf(path, sizeof(path), "/proc/%s/fd/", de->d_name);
 
     DIR* fdd;
     struct dirent* fdde;
@@ -39,28 +100,20 @@ static int EliminateOpenFiles(char** files, int file_count) {
       continue;
     }
     while ((fdde = readdir(fdd)) != 0) {
+      if (fdde->d_name[0] == '.') continue;
+
       char fd_path[FILENAME_MAX];
       char link[FILENAME_MAX];
-      strcpy(fd_path, path);
-      strcat(fd_path, fdde->d_name);
+      snprintf(fd_path, sizeof(fd_path), "%s%s", path, fdde->d_name);
 
       int count;
       count = readlink(fd_path, link, sizeof(link)-1);
-      if (count >= 0) {
+      if (count >= 7 && strncmp(link, "/cache/", 7) == 0) {
         link[count] = '\0';
-
-        // This is inefficient, but it should only matter if there are
-        // lots of files in /cache, and lots of them are open (neither
-        // of which should be true, especially in recovery).
-        if (strncmp(link, "/cache/", 7) == 0) {
-          int j;
-          for (j = 0; j < file_count; ++j) {
-            if (files[j] && strcmp(files[j], link) == 0) {
-              printf("%s is open by %s\n", link, de->d_name);
-              free(files[j]);
-              files[j] = NULL;
-            }
-          }
+        if (PathSetAdd(open_files, link) < 0) {
+          closedir(fdd);
+          closedir(d);
+          return -1;
         }
       }
     }
@@ -71,12 +124,22 @@ static int EliminateOpenFiles(char** files, int file_count) {
   return 0;
 }
 
-int FindExpendableFiles(char*** names, int* entries) {
+// Find the regular files we may delete, with the space each would
+// free, skipping any that are open.
+static int FindExpendableFiles(Expendable** files, int* entries) {
   DIR* d;
   struct dirent* de;
   int size = 32;
   *entries = 0;
-  *names = malloc(size * sizeof(char*));
+  *files = malloc(size * sizeof(Expendable));
+  if (*files == NULL) return -1;
+
+  PathSet open_files;
+  memset(&open_files, 0, sizeof(open_files));
+  if (FindOpenCacheFiles(&open_files) < 0) {
+    PathSetFree(&open_files);
+    return -1;
+  }
 
   char path[FILENAME_MAX];
 
@@ -94,9 +157,7 @@ int FindExpendableFiles(char*** names, int* entries) {
 
     // Look for regular files in the directory (not in any subdirectories).
     while ((de = readdir(d)) != 0) {
-      strcpy(path, dirs[i]);
-      strcat(path, "/");
-      strcat(path, de->d_name);
+      snprintf(path, sizeof(path), "%s/%s", dirs[i], de->d_name);
 
       // We can't delete CACHE_TEMP_SOURCE; if it's there we might have
       // restarted during installation and could be depending on it to
@@ -104,25 +165,64 @@ int FindExpendableFiles(char*** names, int* entries) {
       if (strcmp(path, CACHE_TEMP_SOURCE) == 0) continue;
 
       struct stat st;
-      if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
-        if (*entries >= size) {
-          size *= 2;
-          *names = realloc(*names, size * sizeof(char*));
-        }
-        (*names)[(*entries)++] = strdup(path);
+      if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+      if (PathSetContains(&open_files, path)) {
+        printf("%s is open\n", path);
+        continue;
+      }
+
+      if (*entries >= size) {
+        size *= 2;
+        *files = realloc(*files, size * sizeof(Expendable));
       }
+      Expendable* e = &(*files)[(*entries)++];
+      e->path = strdup(path);
+      e->bytes = st.st_nlink > 1 ? 0 : (size_t)st.st_blocks * 512;
+      e->chosen = 0;
     }
 
     closedir(d);
   }
+  PathSetFree(&open_files);
 
-  printf("%d regular files in deletable directories\n", *entries);
+  printf("%d unopened regular files in deletable directories\n", *entries);
+  return 0;
+}
 
-  if (EliminateOpenFiles(*names, *entries) < 0) {
-    return -1;
+static int CompareBytesDescending(const void* a, const void* b) {
+  size_t aa = ((const Expendable*)a)->bytes;
+  size_t bb = ((const Expendable*)b)->bytes;
+  return aa < bb ? 1 : (aa > bb ? -1 : 0);
+}
+
+// Mark files in 'files' (sorted largest first) to delete to free
+// 'shortfall' bytes, deleting as little as possible: the smallest
+// single file that's big enough, or else the largest files until
+// there's enough, less any of those that turn out not to be needed.
+// Returns the number of bytes the chosen files should free.
+static size_t ChooseFilesToDelete(Expendable* files, int entries, size_t shortfall) {
+  int i;
+  for (i = entries - 1; i >= 0; --i) {
+    if (files[i].bytes >= shortfall) {
+      files[i].chosen = 1;
+      return files[i].bytes;
+    }
   }
 
-  return 0;
+  size_t total = 0;
+  for (i = 0; i < entries && total < shortfall; ++i) {
+    if (files[i].bytes == 0) break;
+    files[i].chosen = 1;
+    total += files[i].bytes;
+  }
+  for (--i; i >= 0; --i) {
+    if (total - files[i].bytes >= shortfall) {
+      files[i].chosen = 0;
+      total -= files[i].bytes;
+    }
+  }
+  return total;
 }
 
 int MakeFreeSpaceOnCache(size_t bytes_needed) {
@@ -134,39 +234,48 @@ int MakeFreeSpaceOnCache(size_t bytes_needed) {
     return 0;
   }
 
-  char** names;
+  Expendable* files;
   int entries;
 
-  if (FindExpendableFiles(&names, &entries) < 0) {
+  if (FindExpendableFiles(&files, &entries) < 0) {
     return -1;
   }
 
   if (entries == 0) {
     // nothing we can delete to free up space!
     printf("no files can be deleted to free space on /cache\n");
+    free(files);
     return -1;
   }
 
-  // We could try to be smarter about which files to delete:  the
-  // biggest ones?  the smallest ones that will free up enough space?
-  // the oldest?  the newest?
-  //
-  // Instead, we'll be dumb.
+  qsort(files, entries, sizeof(Expendable), CompareBytesDescending);
+  size_t planned = ChooseFilesToDelete(files, entries, bytes_needed - free_now);
 
   int i;
+  for (i = 0; i < entries; ++i) {
+    if (files[i].chosen) {
+      unlink(files[i].path);
+      printf("deleted %s (%ld bytes)\n", files[i].path, (long)files[i].bytes);
+    }
+  }
+  free_now = FreeSpaceForFile("/cache");
+  printf("planned to free %ld bytes; now %ld bytes free\n",
+         (long)planned, (long)free_now);
+
+  // The sizes are only estimates (the filesystem may hold on to some
+  // space), so if we're still short, delete the rest largest first.
   for (i = 0; i < entries && free_now < bytes_needed; ++i) {
-    if (names[i]) {
-      unlink(names[i]);
+    if (!files[i].chosen) {
+      unlink(files[i].path);
       free_now = FreeSpaceForFile("/cache");
-      printf("deleted %s; now %ld bytes free\n", names[i], (long)free_now);
-      free(names[i]);
+      printf("deleted %s; now %ld bytes free\n", files[i].path, (long)free_now);
     }
   }
 
-  for (; i < entries; ++i) {
-    free(names[i]);
+  for (i = 0; i < entries; ++i) {
+    free(files[i].path);
   }
-  free(names);
+  free(files);
 
   return (free_now >= bytes_needed) ? 0 : -1;
 }
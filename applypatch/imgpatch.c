@@ -17,6 +17,7 @@
 // See imgdiff.c in this directory for a description of the patch file
 // format.
 
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/cdefs.h>
 #include <sys/stat.h>
@@ -30,6 +31,55 @@
 #include "imgdiff.h"
 #include "utils.h"
 
+// The output size in the bsdiff header at 'offset' in 'patch', or 0
+// if there isn't a sane one.
+static size_t BSDiffNewSize(const Value* patch, size_t offset) {
+    if (offset > (size_t)patch->size || patch->size - offset < 32 ||
+        memcmp(patch->data + offset, "BSDIFF40", 8) != 0) {
+        return 0;
+    }
+    long long size = Read8(patch->data + offset + 24);
+    return size < 0 ? 0 : (size_t)size;
+}
+
+static size_t AddSizes(size_t a, size_t b) {
+    return (a > SIZE_MAX - b) ? SIZE_MAX : a + b;
+}
+
+size_t ImagePatchMemory(const Value* patch) {
+    if (patch->size < 12 || memcmp(patch->data, "IMGDIFF2", 8) != 0) return 0;
+
+    // Every chunk's buffers are freed before the next one starts, so
+    // it's the biggest chunk that counts.
+    size_t most = 0;
+    ssize_t pos = 12;
+    int num_chunks = Read4(patch->data + 8);
+    int i;
+    for (i = 0; i < num_chunks && pos + 4 <= patch->size; ++i) {
+        int type = Read4(patch->data + pos);
+        char* header = patch->data + pos + 4;
+        size_t need = 0;
+        if (type == CHUNK_NORMAL) {
+            pos += 4 + 24;
+            if (pos > patch->size) break;
+            need = BSDiffNewSize(patch, Read8(header+16));
+        } else if (type == CHUNK_RAW) {
+            pos += 4 + 4;
+            if (pos > patch->size) break;
+            pos += Read4(header);
+        } else if (type == CHUNK_DEFLATE) {
+            pos += 4 + 60;
+            if (pos > patch->size) break;
+            // the expanded source, and the target before deflating
+            need = AddSizes(Read8(header+24), BSDiffNewSize(patch, Read8(header+16)));
+        } else {
+            break;
+        }
+        if (need > most) most = need;
+    }
+    return most;
+}
+
 /*
  * Apply the patch given in 'patch_filename' to the source data given
  * by (old_data, old_size).  Write the patched output to the 'output'
@@ -95,12 +145,16 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size __unused,
                 printf("failed to read chunk %d raw data\n", i);
                 return -1;
             }
-            SHA_update(ctx, patch->data + pos, data_len);
+            uint64_t start = PatchStageStart();
+            if (ctx) SHA_update(ctx, patch->data + pos, data_len);
+            PatchStageEnd(PATCH_STAGE_SHA, start);
+            start = PatchStageStart();
             if (sink((unsigned char*)patch->data + pos,
                      data_len, token) != data_len) {
                 printf("failed to write chunk %d raw data\n", i);
                 return -1;
             }
+            PatchStageEnd(PATCH_STAGE_SINK, start);
             pos += data_len;
         } else if (type == CHUNK_DEFLATE) {
             // deflate chunks have an additional 60 bytes in their chunk header.
@@ -156,7 +210,9 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size __unused,
 
             // Because we've provided enough room to accommodate the output
             // data, we expect one call to inflate() to suffice.
+            uint64_t start = PatchStageStart();
             ret = inflate(&strm, Z_SYNC_FLUSH);
+            PatchStageEnd(PATCH_STAGE_INFLATE, start);
             if (ret != Z_STREAM_END) {
                 printf("source inflation returned %d\n", ret);
                 return -1;
@@ -209,15 +265,21 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size __unused,
             do {
                 strm.avail_out = temp_size;
                 strm.next_out = temp_data;
+                start = PatchStageStart();
                 ret = deflate(&strm, Z_FINISH);
+                PatchStageEnd(PATCH_STAGE_DEFLATE, start);
                 ssize_t have = temp_size - strm.avail_out;
 
+                start = PatchStageStart();
                 if (sink(temp_data, have, token) != have) {
                     printf("failed to write %ld compressed bytes to output\n",
                            (long)have);
                     return -1;
                 }
-                SHA_update(ctx, temp_data, have);
+                PatchStageEnd(PATCH_STAGE_SINK, start);
+                start = PatchStageStart();
+                if (ctx) SHA_update(ctx, temp_data, have);
+                PatchStageEnd(PATCH_STAGE_SHA, start);
             } while (ret != Z_STREAM_END);
             deflateEnd(&strm);
 
@@ -14,9 +14,12 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <unistd.h>
 
 #include "applypatch.h"
@@ -155,6 +158,216 @@ int PatchMode(int argc, char** argv) {
     return result;
 }
 
+// Loads a batch list's <patch>, here a filename.
+static Value* LoadPatchFile(const char* name, void* cookie) {
+    FileContents fc;
+    if (LoadFileContents(name, &fc, RETOUCH_DONT_MASK) != 0) {
+        return NULL;
+    }
+    Value* v = malloc(sizeof(Value));
+    v->type = VAL_BLOB;
+    v->size = fc.size;
+    v->data = (char*)fc.data;
+    return v;
+}
+
+int BatchMode(int argc, char** argv) {
+    if (argc != 3) {
+        return 2;
+    }
+    FileContents fc;
+    if (LoadFileContents(argv[2], &fc, RETOUCH_DONT_MASK) != 0) {
+        printf("failed to load batch list %s\n", argv[2]);
+        return 1;
+    }
+    char* list = malloc(fc.size + 1);
+    memcpy(list, fc.data, fc.size);
+    list[fc.size] = '\0';
+    free(fc.data);
+
+    BatchPatch* patches;
+    int count;
+    int result = 1;
+    if (ParseBatchList(list, &patches, &count) == 0) {
+        long threads = sysconf(_SC_NPROCESSORS_ONLN);
+        result = applypatch_batch(patches, count, LoadPatchFile, NULL,
+                                  threads > 0 ? threads : 1,
+                                  BATCH_MEMORY_BUDGET);
+        FreeBatchList(patches, count);
+    }
+    free(list);
+    return result;
+}
+
+typedef struct {
+    unsigned char* buffer;      // NULL when writing to fd
+    ssize_t size;
+    ssize_t pos;
+    int fd;
+} BenchmarkOutput;
+
+static ssize_t BenchmarkSink(unsigned char* data, ssize_t len, void* token) {
+    BenchmarkOutput* out = (BenchmarkOutput*)token;
+    if (out->buffer == NULL) {
+        ssize_t done = 0;
+        while (done < len) {
+            ssize_t wrote = write(out->fd, data + done, len - done);
+            if (wrote <= 0) return done;
+            done += wrote;
+        }
+        out->pos += len;
+        return len;
+    }
+    if (out->pos + len > out->size) return 0;
+    memcpy(out->buffer + out->pos, data, len);
+    out->pos += len;
+    return len;
+}
+
+// Apply <patch-file> to <src-file> 'iterations' times (default 10),
+// checking each result against <tgt-file>, and report where the time
+// goes.  The output is kept in memory unless <output-file> is given,
+// in which case the sink stage includes writing it there.
+int BenchmarkMode(int argc, char** argv) {
+    if (argc < 5 || argc > 7) {
+        return 2;
+    }
+    int iterations = 10;
+    if (argc > 5) {
+        char* endptr;
+        iterations = strtol(argv[5], &endptr, 10);
+        if (iterations <= 0 || *endptr != '\0') {
+            printf("can't parse \"%s\" as iteration count\n\n", argv[5]);
+            return 1;
+        }
+    }
+
+    FileContents source, patch_file, target;
+    if (LoadFileContents(argv[2], &source, RETOUCH_DO_MASK) != 0) {
+        printf("failed to load source %s\n", argv[2]);
+        return 1;
+    }
+    if (LoadFileContents(argv[3], &patch_file, RETOUCH_DONT_MASK) != 0) {
+        printf("failed to load patch %s\n", argv[3]);
+        return 1;
+    }
+    if (LoadFileContents(argv[4], &target, RETOUCH_DONT_MASK) != 0) {
+        printf("failed to load target %s\n", argv[4]);
+        return 1;
+    }
+    Value patch;
+    patch.type = VAL_BLOB;
+    patch.size = patch_file.size;
+    patch.data = (char*)patch_file.data;
+
+    int imgdiff;
+    if (patch.size >= 8 && memcmp(patch.data, "IMGDIFF2", 8) == 0) {
+        imgdiff = 1;
+    } else if (patch.size >= 8 && memcmp(patch.data, "BSDIFF40", 8) == 0) {
+        imgdiff = 0;
+    } else {
+        printf("%s is not a BSDIFF40 or IMGDIFF2 patch\n", argv[3]);
+        return 1;
+    }
+
+    BenchmarkOutput out;
+    out.buffer = NULL;
+    out.size = target.size;
+    out.fd = -1;
+    if (argc > 6) {
+        out.fd = open(argv[6], O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (out.fd < 0) {
+            printf("failed to open %s: %s\n", argv[6], strerror(errno));
+            return 1;
+        }
+    } else {
+        out.buffer = malloc(target.size ? target.size : 1);
+        if (out.buffer == NULL) {
+            printf("failed to allocate %ld bytes for the output\n",
+                   (long)target.size);
+            return 1;
+        }
+    }
+
+    int result = 0;
+    uint64_t total_ns = 0, best_ns = 0;
+    memset(gPatchStageNs, 0, sizeof(gPatchStageNs));
+    gPatchTiming = 1;
+    int i;
+    for (i = 0; i < iterations; ++i) {
+        out.pos = 0;
+        if (out.fd >= 0 && (lseek(out.fd, 0, SEEK_SET) != 0 ||
+                            ftruncate(out.fd, 0) != 0)) {
+            printf("failed to rewind %s: %s\n", argv[6], strerror(errno));
+            result = 1;
+            break;
+        }
+
+        SHA_CTX ctx;
+        SHA_init(&ctx);
+        uint64_t start = PatchStageStart();
+        int failed = imgdiff ?
+            ApplyImagePatch(source.data, source.size, &patch,
+                            BenchmarkSink, &out, &ctx, NULL) :
+            ApplyBSDiffPatch(source.data, source.size, &patch, 0,
+                             BenchmarkSink, &out, &ctx);
+        const uint8_t* digest = SHA_final(&ctx);
+        uint64_t elapsed = PatchStageStart() - start;
+
+        if (failed || out.pos != target.size ||
+            memcmp(digest, target.sha1, SHA_DIGEST_SIZE) != 0) {
+            printf("iteration %d didn't produce %s\n", i+1, argv[4]);
+            result = 1;
+            break;
+        }
+        total_ns += elapsed;
+        if (i == 0 || elapsed < best_ns) best_ns = elapsed;
+    }
+    gPatchTiming = 0;
+
+    if (result == 0) {
+        static const char* names[PATCH_STAGE_COUNT] = {
+            "bzip2 decode", "add loop", "inflate", "deflate", "sha", "sink",
+        };
+        double per_iteration_ms = total_ns / 1e6 / iterations;
+        uint64_t staged_ns = 0;
+        printf("%s (%s) on %s: %ld byte source, %ld byte patch, "
+               "%ld byte target, %d iterations\n",
+               argv[3], imgdiff ? "IMGDIFF2" : "BSDIFF40", argv[2],
+               (long)source.size, (long)patch.size, (long)target.size,
+               iterations);
+        printf("  %-14s %10s %7s\n", "stage", "ms/iter", "share");
+        int s;
+        for (s = 0; s < PATCH_STAGE_COUNT; ++s) {
+            staged_ns += gPatchStageNs[s];
+            printf("  %-14s %10.3f %6.1f%%\n", names[s],
+                   gPatchStageNs[s] / 1e6 / iterations,
+                   total_ns ? 100.0 * gPatchStageNs[s] / total_ns : 0.0);
+        }
+        uint64_t other_ns = total_ns > staged_ns ? total_ns - staged_ns : 0;
+        printf("  %-14s %10.3f %6.1f%%\n", "other",
+               other_ns / 1e6 / iterations,
+               total_ns ? 100.0 * other_ns / total_ns : 0.0);
+        printf("  %-14s %10.3f (best %.3f)\n", "total",
+               per_iteration_ms, best_ns / 1e6);
+        printf("  throughput     %.1f MB/s of target (best %.1f MB/s)\n",
+               target.size / 1048576.0 / (per_iteration_ms / 1000.0),
+               target.size / 1048576.0 / (best_ns / 1e9));
+
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+            printf("  peak RSS       %ld KB\n", (long)usage.ru_maxrss);
+        }
+    }
+
+    if (out.fd >= 0) close(out.fd);
+    free(out.buffer);
+    free(source.data);
+    free(patch_file.data);
+    free(target.data);
+    return result;
+}
+
 // This program applies binary patches to files in a way that is safe
 // (the original file is not touched until we have the desired
 // replacement for it) and idempotent (it's okay to run this program
@@ -186,12 +399,16 @@ int main(int argc, char** argv) {
             "[<src-sha1>:<patch> ...]\n"
             "   or  %s -c <file> [<sha1> ...]\n"
             "   or  %s -s <bytes>\n"
+            "   or  %s -m <batch-list>\n"
+            "   or  %s -B <src-file> <patch-file> <tgt-file> [<iterations> [<output-file>]]\n"
             "   or  %s -l\n"
             "\n"
             "Filenames may be of the form\n"
             "  MTD:<partition>:<len_1>:<sha1_1>:<len_2>:<sha1_2>:...\n"
-            "to specify reading from or writing to an MTD partition.\n\n",
-            argv[0], argv[0], argv[0], argv[0]);
+            "to specify reading from or writing to an MTD partition.\n\n"
+            "A batch list has one patch per line:\n"
+            "  <src-file> <tgt-file> <tgt-sha1> <tgt-size> <src-sha1>:<patch> ...\n\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
         return 2;
     }
 
@@ -203,6 +420,10 @@ int main(int argc, char** argv) {
         result = CheckMode(argc, argv);
     } else if (strncmp(argv[1], "-s", 3) == 0) {
         result = SpaceMode(argc, argv);
+    } else if (strncmp(argv[1], "-m", 3) == 0) {
+        result = BatchMode(argc, argv);
+    } else if (strncmp(argv[1], "-B", 3) == 0) {
+        result = BenchmarkMode(argc, argv);
     } else {
         result = PatchMode(argc, argv);
     }
@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "rangeset.h"
+
+// Most iovecs handed to the kernel in one call.
+#define RANGESET_IOV_MAX 64
+
+static RangeSet* alloc_range_set(size_t count) {
+    if (count > (SIZE_MAX - sizeof(RangeSet)) / (2 * sizeof(size_t))) return NULL;
+    RangeSet* rs = malloc(sizeof(RangeSet) + count * 2 * sizeof(size_t));
+    if (rs == NULL) return NULL;
+    rs->count = 0;
+    rs->size = 0;
+    return rs;
+}
+
+RangeSet* ParseRangeSet(const char* text) {
+    char* end;
+    long num = strtol(text, &end, 10);
+    if (end == text || num <= 0 || num % 2 != 0) return NULL;
+    // Each number takes at least two characters (",0"); don't size an
+    // allocation by a count the text can't hold.
+    if ((unsigned long)num > SIZE_MAX / 2 ||
+        strnlen(end, num * 2) < (size_t)num * 2) return NULL;
+
+    RangeSet* rs = alloc_range_set(num / 2);
+    if (rs == NULL) return NULL;
+
+    long i;
+    for (i = 0; i < num; ++i) {
+        if (*end != ',') goto fail;
+        text = end + 1;
+        unsigned long long v = strtoull(text, &end, 10);
+        if (end == text || v > SIZE_MAX) goto fail;
+        rs->pos[i] = v;
+    }
+    if (*end != '\0' && *end != ' ' && *end != '\n') goto fail;
+
+    rs->count = num / 2;
+    for (i = 0; i < num; i += 2) {
+        if (rs->pos[i] >= rs->pos[i+1]) goto fail;
+        rs->size += rs->pos[i+1] - rs->pos[i];
+    }
+    return rs;
+
+  fail:
+    free(rs);
+    return NULL;
+}
+
+char* RangeSetToString(const RangeSet* rs) {
+    // 20 digits and a comma per number, plus the count
+    size_t len = (rs->count * 2 + 1) * 21 + 1;
+    char* out = malloc(len);
+    if (out == NULL) return NULL;
+
+    size_t p = snprintf(out, len, "%zu", rs->count * 2);
+    size_t i;
+    for (i = 0; i < rs->count * 2; ++i) {
+        p += snprintf(out + p, len - p, ",%zu", rs->pos[i]);
+    }
+    return out;
+}
+
+static int compare_ranges(const void* a, const void* b) {
+    const size_t* ra = (const size_t*) a;
+    const size_t* rb = (const size_t*) b;
+    if (ra[0] != rb[0]) return (ra[0] < rb[0]) ? -1 : 1;
+    if (ra[1] != rb[1]) return (ra[1] < rb[1]) ? -1 : 1;
+    return 0;
+}
+
+// Sort the ranges and join any that touch or overlap, recomputing
+// count and size.
+static void normalize(RangeSet* rs) {
+    qsort(rs->pos, rs->count, 2 * sizeof(size_t), compare_ranges);
+
+    size_t i, out = 0;
+    rs->size = 0;
+    for (i = 0; i < rs->count; ++i) {
+        size_t start = rs->pos[i*2], end = rs->pos[i*2+1];
+        if (out > 0 && start <= rs->pos[out*2-1]) {
+            if (end > rs->pos[out*2-1]) rs->pos[out*2-1] = end;
+        } else {
+            rs->pos[out*2] = start;
+            rs->pos[out*2+1] = end;
+            ++out;
+        }
+    }
+    rs->count = out;
+    for (i = 0; i < out; ++i) {
+        rs->size += rs->pos[i*2+1] - rs->pos[i*2];
+    }
+}
+
+RangeSet* MergeRangeSets(const RangeSet* a, const RangeSet* b) {
+    RangeSet* rs = alloc_range_set(a->count + b->count);
+    if (rs == NULL) return NULL;
+
+    memcpy(rs->pos, a->pos, a->count * 2 * sizeof(size_t));
+    memcpy(rs->pos + a->count * 2, b->pos, b->count * 2 * sizeof(size_t));
+    rs->count = a->count + b->count;
+    normalize(rs);
+    return rs;
+}
+
+static RangeSet* normalized_copy(const RangeSet* rs) {
+    RangeSet* copy = alloc_range_set(rs->count);
+    if (copy == NULL) return NULL;
+    memcpy(copy->pos, rs->pos, rs->count * 2 * sizeof(size_t));
+    copy->count = rs->count;
+    normalize(copy);
+    return copy;
+}
+
+RangeSet* IntersectRangeSets(const RangeSet* a, const RangeSet* b) {
+    RangeSet* na = normalized_copy(a);
+    RangeSet* nb = normalized_copy(b);
+    RangeSet* rs = alloc_range_set(a->count + b->count);
+    if (na == NULL || nb == NULL || rs == NULL) {
+        free(na);
+        free(nb);
+        free(rs);
+        return NULL;
+    }
+
+    // Both lists are sorted and disjoint, so each overlap is found by
+    // advancing whichever range ends first.
+    size_t i = 0, j = 0;
+    while (i < na->count && j < nb->count) {
+        size_t start = na->pos[i*2] > nb->pos[j*2] ? na->pos[i*2] : nb->pos[j*2];
+        size_t end = na->pos[i*2+1] < nb->pos[j*2+1] ? na->pos[i*2+1] : nb->pos[j*2+1];
+        if (start < end) {
+            rs->pos[rs->count*2] = start;
+            rs->pos[rs->count*2+1] = end;
+            rs->count++;
+            rs->size += end - start;
+        }
+        if (na->pos[i*2+1] < nb->pos[j*2+1]) {
+            ++i;
+        } else {
+            ++j;
+        }
+    }
+
+    free(na);
+    free(nb);
+    return rs;
+}
+
+int RangeSetsOverlap(const RangeSet* a, const RangeSet* b) {
+    size_t i, j;
+    for (i = 0; i < a->count; ++i) {
+        for (j = 0; j < b->count; ++j) {
+            if (a->pos[i*2] < b->pos[j*2+1] && b->pos[j*2] < a->pos[i*2+1]) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void RangeSetIteratorInit(RangeSetIterator* it, const RangeSet* rs) {
+    it->rs = rs;
+    it->range = 0;
+    it->offset = 0;
+}
+
+int RangeSetNext(RangeSetIterator* it, size_t* start, size_t* len,
+                 size_t max_blocks) {
+    if (it->range >= it->rs->count) return 0;
+
+    size_t first = it->rs->pos[it->range*2] + it->offset;
+    size_t n = it->rs->pos[it->range*2+1] - first;
+    if (max_blocks > 0 && n > max_blocks) n = max_blocks;
+
+    *start = first;
+    *len = n;
+    it->offset += n;
+    if (first + n == it->rs->pos[it->range*2+1]) {
+        it->range++;
+        it->offset = 0;
+    }
+    return 1;
+}
+
+// preadv()/pwritev() with a 64-bit offset on every ABI.  The kernel
+// takes the offset as two longs, low half first, and ignores the high
+// one on 64-bit kernels.
+static ssize_t sys_preadv64(int fd, const struct iovec* iov, int iovcnt, off64_t offset) {
+    uint64_t pos = offset;
+    return syscall(__NR_preadv, fd, iov, iovcnt,
+                   (unsigned long) pos, (unsigned long) (pos >> 32));
+}
+
+static ssize_t sys_pwritev64(int fd, const struct iovec* iov, int iovcnt, off64_t offset) {
+    uint64_t pos = offset;
+    return syscall(__NR_pwritev, fd, iov, iovcnt,
+                   (unsigned long) pos, (unsigned long) (pos >> 32));
+}
+
+static int range_set_io(int fd, const RangeSet* rs, size_t block_size,
+                        const struct iovec* iov, int iovcnt, int writing) {
+    size_t total = 0;
+    int i;
+    for (i = 0; i < iovcnt; ++i) {
+        total += iov[i].iov_len;
+    }
+    if (total != rs->size * block_size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // (vi, voff) is the next unused byte of the caller's iov.
+    int vi = 0;
+    size_t voff = 0;
+    struct iovec batch[RANGESET_IOV_MAX];
+    size_t r;
+
+    for (r = 0; r < rs->count; ++r) {
+        off64_t offset = (off64_t) rs->pos[r*2] * block_size;
+        size_t left = (rs->pos[r*2+1] - rs->pos[r*2]) * block_size;
+
+        while (left > 0) {
+            int n = 0;
+            int bvi = vi;
+            size_t bvoff = voff;
+            size_t bytes = 0;
+            while (n < RANGESET_IOV_MAX && bytes < left && bvi < iovcnt) {
+                size_t take = iov[bvi].iov_len - bvoff;
+                if (take > left - bytes) take = left - bytes;
+                if (take > 0) {
+                    batch[n].iov_base = (char*) iov[bvi].iov_base + bvoff;
+                    batch[n].iov_len = take;
+                    ++n;
+                    bytes += take;
+                    bvoff += take;
+                }
+                if (bvoff == iov[bvi].iov_len) {
+                    ++bvi;
+                    bvoff = 0;
+                }
+            }
+
+            ssize_t done = writing ? sys_pwritev64(fd, batch, n, offset)
+                                   : sys_preadv64(fd, batch, n, offset);
+            if (done < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            if (done == 0) {
+                errno = writing ? ENOSPC : EIO;
+                return -1;
+            }
+
+            // Consume 'done' bytes of the caller's iov; a short
+            // transfer just resumes part way through.
+            offset += done;
+            left -= done;
+            while (done > 0) {
+                size_t avail = iov[vi].iov_len - voff;
+                if ((size_t) done < avail) {
+                    voff += done;
+                    done = 0;
+                } else {
+                    done -= avail;
+                    ++vi;
+                    voff = 0;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int ReadRangeSet(int fd, const RangeSet* rs, size_t block_size,
+                 const struct iovec* iov, int iovcnt) {
+    return range_set_io(fd, rs, block_size, iov, iovcnt, 0);
+}
+
+int WriteRangeSet(int fd, const RangeSet* rs, size_t block_size,
+                  const struct iovec* iov, int iovcnt) {
+    return range_set_io(fd, rs, block_size, iov, iovcnt, 1);
+}
+
+int ReadRangeSetBuffer(int fd, const RangeSet* rs, size_t block_size,
+                       void* buffer) {
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = rs->size * block_size;
+    return range_set_io(fd, rs, block_size, &iov, 1, 0);
+}
+
+int WriteRangeSetBuffer(int fd, const RangeSet* rs, size_t block_size,
+                        const void* buffer) {
+    struct iovec iov;
+    iov.iov_base = (void*) buffer;
+    iov.iov_len = rs->size * block_size;
+    return range_set_io(fd, rs, block_size, &iov, 1, 1);
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_RANGESET_H
+#define _APPLYPATCH_RANGESET_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A list of half-open block ranges [pos[0], pos[1]), [pos[2], pos[3]),
+// ...  The order of the ranges is significant: a RangeSet names the
+// blocks of some stream of data, in order, so ParseRangeSet keeps
+// them as written.  MergeRangeSets and IntersectRangeSets return sets
+// that are sorted and have no adjacent or overlapping ranges.
+//
+// RangeSets are allocated with malloc(); release them with free().
+typedef struct {
+    size_t count;   // number of ranges
+    size_t size;    // total number of blocks
+    size_t pos[0];  // count pairs of [start, end)
+} RangeSet;
+
+// Parse the "N,a1,b1,a2,b2,..." form used in transfer lists, where N
+// is the count of numbers that follow.  Returns NULL if the text is
+// malformed or any range is empty.
+RangeSet* ParseRangeSet(const char* text);
+
+// Format a RangeSet the way ParseRangeSet reads it.  The caller frees
+// the returned string.
+char* RangeSetToString(const RangeSet* rs);
+
+// Blocks in either set (a may equal b).
+RangeSet* MergeRangeSets(const RangeSet* a, const RangeSet* b);
+
+// Blocks in both sets.  The result may be empty (count == 0).
+RangeSet* IntersectRangeSets(const RangeSet* a, const RangeSet* b);
+
+// Nonzero if any block is in both sets.
+int RangeSetsOverlap(const RangeSet* a, const RangeSet* b);
+
+// Walks the blocks of a RangeSet, in order, a run of consecutive
+// blocks at a time.
+typedef struct {
+    const RangeSet* rs;
+    size_t range;   // current range
+    size_t offset;  // blocks of the current range already returned
+} RangeSetIterator;
+
+void RangeSetIteratorInit(RangeSetIterator* it, const RangeSet* rs);
+
+// Return the next run of at most 'max_blocks' consecutive blocks (all
+// the rest of the current range if max_blocks is 0) in *start and
+// *len.  Returns 0 when there are no blocks left.
+int RangeSetNext(RangeSetIterator* it, size_t* start, size_t* len,
+                 size_t max_blocks);
+
+// Read the blocks of 'rs' from fd, in order, into the memory
+// described by iov (which must add up to rs->size * block_size
+// bytes), or write them from it.  Each run of consecutive blocks
+// costs one preadv()/pwritev() call however the memory is split up.
+// Return 0 on success, or -1 with errno set.  Hitting end of file
+// while reading fails with EIO.
+int ReadRangeSet(int fd, const RangeSet* rs, size_t block_size,
+                 const struct iovec* iov, int iovcnt);
+int WriteRangeSet(int fd, const RangeSet* rs, size_t block_size,
+                  const struct iovec* iov, int iovcnt);
+
+// Same for a single contiguous buffer.
+int ReadRangeSetBuffer(int fd, const RangeSet* rs, size_t block_size,
+                       void* buffer);
+int WriteRangeSetBuffer(int fd, const RangeSet* rs, size_t block_size,
+                        const void* buffer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares ways of moving the blocks of a fragmented RangeSet between
+// a file (or block device) and memory:
+//
+//   per-block    one pread()/pwrite() per 4k block
+//   per-range    ReadRangeSetBuffer()/WriteRangeSetBuffer(): one call
+//                per run of consecutive blocks
+//   gather       WriteRangeSet() from a separate 4k buffer per block,
+//                still one call per run
+//
+// usage: rangeset_benchmark <file> [megabytes] [run_blocks]
+//
+// The file is written to; give it a scratch file or partition.  The
+// set covers every other run of 'run_blocks' blocks (default 8) over
+// the first 2 * megabytes (default 64) of the file.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "rangeset.h"
+
+#define BLOCKSIZE 4096
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void report(const char* name, const RangeSet* rs, double elapsed) {
+    printf("%-20s %8zu blocks in %6zu runs: %.3f s, %.1f MB/s\n",
+           name, rs->size, rs->count, elapsed,
+           rs->size * (double)BLOCKSIZE / 1048576.0 / elapsed);
+}
+
+static int per_block(int fd, const RangeSet* rs, unsigned char* buffer, int writing) {
+    size_t i, b;
+    unsigned char* p = buffer;
+    for (i = 0; i < rs->count; ++i) {
+        for (b = rs->pos[i*2]; b < rs->pos[i*2+1]; ++b) {
+            off64_t offset = (off64_t)b * BLOCKSIZE;
+            ssize_t n = writing ? pwrite64(fd, p, BLOCKSIZE, offset)
+                                : pread64(fd, p, BLOCKSIZE, offset);
+            if (n != BLOCKSIZE) return -1;
+            p += BLOCKSIZE;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file> [megabytes] [run_blocks]\n", argv[0]);
+        return 2;
+    }
+    size_t megabytes = (argc > 2) ? strtoul(argv[2], NULL, 10) : 64;
+    size_t run = (argc > 3) ? strtoul(argv[3], NULL, 10) : 8;
+    if (megabytes == 0 || run == 0) {
+        fprintf(stderr, "megabytes and run_blocks must be positive\n");
+        return 2;
+    }
+
+    size_t blocks = megabytes * 1048576 / BLOCKSIZE;
+    size_t runs = (blocks + run - 1) / run;
+
+    RangeSet* rs = malloc(sizeof(RangeSet) + runs * 2 * sizeof(size_t));
+    unsigned char* buffer = malloc(runs * run * BLOCKSIZE);
+    struct iovec* iov = malloc(runs * run * sizeof(struct iovec));
+    unsigned char** pieces = malloc(runs * run * sizeof(unsigned char*));
+    if (rs == NULL || buffer == NULL || iov == NULL || pieces == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    rs->count = runs;
+    rs->size = 0;
+    size_t i;
+    for (i = 0; i < runs; ++i) {
+        rs->pos[i*2] = i * run * 2;
+        rs->pos[i*2+1] = i * run * 2 + run;
+        rs->size += run;
+    }
+    for (i = 0; i < rs->size * BLOCKSIZE; ++i) {
+        buffer[i] = i * 7;
+    }
+    for (i = 0; i < rs->size; ++i) {
+        pieces[i] = malloc(BLOCKSIZE);
+        if (pieces[i] == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        memcpy(pieces[i], buffer + i * BLOCKSIZE, BLOCKSIZE);
+        iov[i].iov_base = pieces[i];
+        iov[i].iov_len = BLOCKSIZE;
+    }
+
+    int fd = open(argv[1], O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "can't open %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    double start;
+
+    start = now();
+    if (per_block(fd, rs, buffer, 1) < 0) goto fail;
+    fsync(fd);
+    report("write per-block", rs, now() - start);
+
+    start = now();
+    if (WriteRangeSetBuffer(fd, rs, BLOCKSIZE, buffer) < 0) goto fail;
+    fsync(fd);
+    report("write per-range", rs, now() - start);
+
+    start = now();
+    if (WriteRangeSet(fd, rs, BLOCKSIZE, iov, rs->size) < 0) goto fail;
+    fsync(fd);
+    report("write gather", rs, now() - start);
+
+    start = now();
+    if (per_block(fd, rs, buffer, 0) < 0) goto fail;
+    report("read per-block", rs, now() - start);
+
+    start = now();
+    if (ReadRangeSetBuffer(fd, rs, BLOCKSIZE, buffer) < 0) goto fail;
+    report("read per-range", rs, now() - start);
+
+    start = now();
+    if (ReadRangeSet(fd, rs, BLOCKSIZE, iov, rs->size) < 0) goto fail;
+    report("read scatter", rs, now() - start);
+
+    close(fd);
+    return 0;
+
+  fail:
+    fprintf(stderr, "I/O failed: %s\n", strerror(errno));
+    close(fd);
+    return 1;
+}
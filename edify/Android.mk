@@ -5,7 +5,10 @@ LOCAL_PATH := $(call my-dir)
 edify_src_files := \
 	lexer.l \
 	parser.y \
-	expr.c
+	expr.c \
+	profile.c \
+	parsed.c \
+	bytecode.c
 
 # "-x c" forces the lex/yacc files to be compiled as c;
 # the build system otherwise forces them to be c++.
@@ -26,6 +29,21 @@ LOCAL_YACCFLAGS := -v
 
 include $(BUILD_HOST_EXECUTABLE)
 
+#
+# Build the host-side interpreter benchmark
+#
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+		$(edify_src_files) \
+		edify_benchmark.c
+
+LOCAL_CFLAGS := $(edify_cflags) -O2
+LOCAL_MODULE := edify_benchmark
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_HOST_EXECUTABLE)
+
 #
 # Build the device-side library
 #
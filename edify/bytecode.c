@@ -0,0 +1,479 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "profile.h"
+
+typedef enum {
+    OP_CONST,           // push constant 'arg'
+    OP_CALL,            // call exprs[arg] and push its result
+    OP_POP,             // discard the top value
+    OP_STRING,          // fail unless the top value is a string
+    OP_JUMP,            // go to 'arg'
+    OP_JUMP_IF_FALSE,   // go to 'arg' if the top value is "", keeping it
+    OP_JUMP_IF_TRUE,    // go to 'arg' unless the top value is "", keeping it
+    OP_CONCAT,          // replace the top 'arg' values with their concatenation
+    OP_NOT,             // replace the top value with "t" if it's "", else ""
+    OP_EQ,              // replace the top two values with "t" if equal, else ""
+    OP_NE,              // ... with "t" if different, else ""
+    OP_SUBSTR,          // ... with "t" if the first is in the second, else ""
+} Opcode;
+
+static const char* op_names[] = {
+    "const", "call", "pop", "string", "jump", "jump_if_false",
+    "jump_if_true", "concat", "not", "eq", "ne", "substr",
+};
+
+typedef struct {
+    uint8_t op;
+    int arg;
+} Instruction;
+
+struct Program {
+    Instruction* code;
+    int code_count;
+    int code_alloc;
+
+    // Interned constants; the VM pushes pointers to these rather than
+    // copies.  Constants 0 and 1 are "" and "t".
+    Value* consts;
+    int const_count;
+    int const_alloc;
+    int* const_hash;    // open-addressed index into consts, -1 if empty
+    int hash_size;
+
+    Expr** exprs;       // targets of OP_CALL
+    int expr_count;
+    int expr_alloc;
+};
+
+#define CONST_FALSE 0
+#define CONST_TRUE  1
+
+// Grow *array (of *alloc elements of 'size' bytes) to hold at least
+// 'needed'.
+static bool grow(void** array, int* alloc, int needed, size_t size) {
+    if (needed <= *alloc) return true;
+    int n = *alloc * 2 + 16;
+    if (n < needed) n = needed;
+    void* p = realloc(*array, n * size);
+    if (p == NULL) return false;
+    *array = p;
+    *alloc = n;
+    return true;
+}
+
+static int emit(Program* prog, Opcode op, int arg) {
+    if (!grow((void**)&prog->code, &prog->code_alloc, prog->code_count + 1,
+              sizeof(Instruction))) {
+        return -1;
+    }
+    prog->code[prog->code_count].op = op;
+    prog->code[prog->code_count].arg = arg;
+    return prog->code_count++;
+}
+
+static uint32_t hash_string(const char* s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+static bool rehash(Program* prog, int size) {
+    int* table = malloc(size * sizeof(int));
+    if (table == NULL) return false;
+    int i;
+    for (i = 0; i < size; ++i) table[i] = -1;
+    for (i = 0; i < prog->const_count; ++i) {
+        uint32_t h = hash_string(prog->consts[i].data) & (size - 1);
+        while (table[h] >= 0) h = (h + 1) & (size - 1);
+        table[h] = i;
+    }
+    free(prog->const_hash);
+    prog->const_hash = table;
+    prog->hash_size = size;
+    return true;
+}
+
+// Returns the index of the constant 'str', adding it if necessary.
+// The Program borrows 'str', which lives in the parse tree.
+static int intern(Program* prog, char* str) {
+    uint32_t h = hash_string(str) & (prog->hash_size - 1);
+    while (prog->const_hash[h] >= 0) {
+        int i = prog->const_hash[h];
+        if (strcmp(prog->consts[i].data, str) == 0) return i;
+        h = (h + 1) & (prog->hash_size - 1);
+    }
+
+    if (!grow((void**)&prog->consts, &prog->const_alloc, prog->const_count + 1,
+              sizeof(Value))) {
+        return -1;
+    }
+    int i = prog->const_count++;
+    prog->consts[i].type = VAL_STRING;
+    prog->consts[i].size = strlen(str);
+    prog->consts[i].data = str;
+    prog->const_hash[h] = i;
+
+    // Keep the table at most half full.
+    if (prog->const_count * 2 > prog->hash_size &&
+        !rehash(prog, prog->hash_size * 2)) {
+        return -1;
+    }
+    return i;
+}
+
+static int compile(Program* prog, Expr* e);
+
+// True if 'e' compiles to instructions that always leave a string.
+static bool yields_string(const Expr* e) {
+    return e->fn == Literal ||
+           e->fn == ConcatFn ||
+           (e->fn == LogicalNotFn && e->argc == 1) ||
+           ((e->fn == EqualityFn || e->fn == InequalityFn || e->fn == SubstringFn) &&
+            e->argc == 2);
+}
+
+// Compile each argument followed by OP_STRING, which is what
+// evaluating them with Evaluate() amounts to.  The check is left out
+// where it can't fail.
+static int compile_strings(Program* prog, Expr* e, int count) {
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (compile(prog, e->argv[i]) < 0) return -1;
+        if (!yields_string(e->argv[i]) && emit(prog, OP_STRING, 0) < 0) return -1;
+    }
+    return 0;
+}
+
+// "a; b; c" parses as "(a; b); c", so a long script is a very deep
+// tree down its left side.  Walk that side with a loop rather than by
+// recursion.
+static int compile_sequence(Program* prog, Expr* e) {
+    int n = 0;
+    Expr* left;
+    for (left = e; left->fn == SequenceFn && left->argc == 2; left = left->argv[0]) {
+        ++n;
+    }
+
+    Expr** rights = malloc(n * sizeof(Expr*));
+    if (rights == NULL) return -1;
+    int i = n;
+    for (left = e; left->fn == SequenceFn && left->argc == 2; left = left->argv[0]) {
+        rights[--i] = left->argv[1];
+    }
+
+    int result = compile(prog, left);
+    for (i = 0; i < n && result >= 0; ++i) {
+        if (emit(prog, OP_POP, 0) < 0 || compile(prog, rights[i]) < 0) result = -1;
+    }
+    free(rights);
+    return result;
+}
+
+static int compile_call(Program* prog, Expr* e) {
+    if (!grow((void**)&prog->exprs, &prog->expr_alloc, prog->expr_count + 1,
+              sizeof(Expr*))) {
+        return -1;
+    }
+    prog->exprs[prog->expr_count] = e;
+    return emit(prog, OP_CALL, prog->expr_count++);
+}
+
+// The builtins below are only compiled inline for the argument counts
+// the parser produces; anything else is left to the Function itself,
+// so that its error handling is unchanged.
+static int compile(Program* prog, Expr* e) {
+    int j1, j2;
+
+    if (e->fn == Literal) {
+        int k = intern(prog, e->name);
+        return (k < 0) ? -1 : emit(prog, OP_CONST, k);
+    }
+
+    if (e->fn == SequenceFn && e->argc == 2) {
+        return compile_sequence(prog, e);
+    }
+
+    if (e->fn == ConcatFn) {
+        if (e->argc == 0) return emit(prog, OP_CONST, CONST_FALSE);
+        if (compile_strings(prog, e, e->argc) < 0) return -1;
+        return emit(prog, OP_CONCAT, e->argc);
+    }
+
+    // && and || and the two-argument ifelse() yield the left side
+    // itself if it decides the answer, else the right side.
+    if ((e->fn == LogicalAndFn || e->fn == LogicalOrFn || e->fn == IfElseFn) &&
+        e->argc == 2) {
+        if (compile_strings(prog, e, 1) < 0) return -1;
+        j1 = emit(prog, e->fn == LogicalOrFn ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE, 0);
+        if (j1 < 0 || emit(prog, OP_POP, 0) < 0 || compile(prog, e->argv[1]) < 0) return -1;
+        prog->code[j1].arg = prog->code_count;
+        return 0;
+    }
+
+    if (e->fn == IfElseFn && e->argc == 3) {
+        if (compile_strings(prog, e, 1) < 0) return -1;
+        j1 = emit(prog, OP_JUMP_IF_FALSE, 0);
+        if (j1 < 0 || emit(prog, OP_POP, 0) < 0 || compile(prog, e->argv[1]) < 0) return -1;
+        j2 = emit(prog, OP_JUMP, 0);
+        if (j2 < 0) return -1;
+        prog->code[j1].arg = prog->code_count;
+        if (emit(prog, OP_POP, 0) < 0 || compile(prog, e->argv[2]) < 0) return -1;
+        prog->code[j2].arg = prog->code_count;
+        return 0;
+    }
+
+    if (e->fn == LogicalNotFn && e->argc == 1) {
+        if (compile_strings(prog, e, 1) < 0) return -1;
+        return emit(prog, OP_NOT, 0);
+    }
+
+    if ((e->fn == EqualityFn || e->fn == InequalityFn || e->fn == SubstringFn) &&
+        e->argc == 2) {
+        if (compile_strings(prog, e, 2) < 0) return -1;
+        return emit(prog, e->fn == EqualityFn ? OP_EQ :
+                          e->fn == InequalityFn ? OP_NE : OP_SUBSTR, 0);
+    }
+
+    return compile_call(prog, e);
+}
+
+Program* CompileExpr(Expr* root) {
+    Program* prog = calloc(1, sizeof(Program));
+    if (prog == NULL) return NULL;
+
+    if (!rehash(prog, 64) ||
+        intern(prog, "") != CONST_FALSE ||
+        intern(prog, "t") != CONST_TRUE ||
+        compile(prog, root) < 0) {
+        FreeProgram(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+void FreeProgram(Program* prog) {
+    if (prog == NULL) return;
+    free(prog->code);
+    free(prog->consts);
+    free(prog->const_hash);
+    free(prog->exprs);
+    free(prog);
+}
+
+void DumpProgram(const Program* prog) {
+    int pc;
+    for (pc = 0; pc < prog->code_count; ++pc) {
+        const Instruction* in = &prog->code[pc];
+        printf("%5d  %-14s", pc, op_names[in->op]);
+        switch (in->op) {
+          case OP_CONST:
+            printf("\"%s\"", prog->consts[in->arg].data);
+            break;
+          case OP_CALL:
+            printf("%s/%d", prog->exprs[in->arg]->name, prog->exprs[in->arg]->argc);
+            break;
+          case OP_JUMP:
+          case OP_JUMP_IF_FALSE:
+          case OP_JUMP_IF_TRUE:
+          case OP_CONCAT:
+            printf("%d", in->arg);
+            break;
+        }
+        printf("\n");
+    }
+    printf("%d instructions, %d constants, %d calls\n",
+           prog->code_count, prog->const_count, prog->expr_count);
+}
+
+// -----------------------------------------------------------------
+//   the interpreter
+// -----------------------------------------------------------------
+
+// A stack slot either owns its Value or borrows one of the Program's
+// constants.
+typedef struct {
+    Value* v;
+    bool owned;
+} Slot;
+
+static void release(Slot* s) {
+    if (s->owned) FreeValue(s->v);
+}
+
+Value* ExecuteProgramValue(State* state, const Program* prog) {
+    Slot local[32];
+    Slot* stack = local;
+    int stack_alloc = sizeof(local) / sizeof(local[0]);
+    int sp = 0;
+    int pc = 0;
+    Value* result = NULL;
+
+    // Every instruction pushes at most one value.
+#define PUSH(value, own) do {                                           \
+        if (sp == stack_alloc) {                                        \
+            Slot* bigger = malloc(stack_alloc * 2 * sizeof(Slot));      \
+            if (bigger == NULL) {                                       \
+                ErrorAbort(state, "out of memory");                     \
+                goto fail;                                              \
+            }                                                           \
+            memcpy(bigger, stack, sp * sizeof(Slot));                   \
+            if (stack != local) free(stack);                            \
+            stack = bigger;                                             \
+            stack_alloc *= 2;                                           \
+        }                                                               \
+        stack[sp].v = (value);                                          \
+        stack[sp].owned = (own);                                        \
+        ++sp;                                                           \
+    } while (0)
+#define PUSH_BOOL(b) PUSH(&prog->consts[(b) ? CONST_TRUE : CONST_FALSE], false)
+
+    while (pc < prog->code_count) {
+        const Instruction* in = &prog->code[pc++];
+        switch (in->op) {
+          case OP_CONST:
+            PUSH(&prog->consts[in->arg], false);
+            break;
+
+          case OP_CALL: {
+            Expr* e = prog->exprs[in->arg];
+            Value* v = CallExpr(state, e);
+            if (v == NULL) goto fail;
+            PUSH(v, true);
+            break;
+          }
+
+          case OP_POP:
+            release(&stack[--sp]);
+            break;
+
+          case OP_STRING:
+            if (stack[sp-1].v->type != VAL_STRING) {
+                ErrorAbort(state, "expecting string, got value type %d",
+                           stack[sp-1].v->type);
+                goto fail;
+            }
+            break;
+
+          case OP_JUMP:
+            pc = in->arg;
+            break;
+
+          case OP_JUMP_IF_FALSE:
+            if (stack[sp-1].v->data[0] == '\0') pc = in->arg;
+            break;
+
+          case OP_JUMP_IF_TRUE:
+            if (stack[sp-1].v->data[0] != '\0') pc = in->arg;
+            break;
+
+          case OP_CONCAT: {
+            // Lengths come from strlen(), as in ConcatFn, so a
+            // string with an embedded NUL is cut short at it.
+            int n = in->arg;
+            int i;
+            size_t length = 0;
+            for (i = sp - n; i < sp; ++i) {
+                length += strlen(stack[i].v->data);
+            }
+            char* s = malloc(length + 1);
+            if (s == NULL) {
+                ErrorAbort(state, "out of memory");
+                goto fail;
+            }
+            size_t p = 0;
+            for (i = sp - n; i < sp; ++i) {
+                size_t len = strlen(stack[i].v->data);
+                memcpy(s + p, stack[i].v->data, len);
+                p += len;
+                release(&stack[i]);
+            }
+            s[p] = '\0';
+            sp -= n;
+            PUSH(StringValue(s), true);
+            break;
+          }
+
+          case OP_NOT: {
+            bool b = stack[sp-1].v->data[0] == '\0';
+            release(&stack[--sp]);
+            PUSH_BOOL(b);
+            break;
+          }
+
+          case OP_EQ:
+          case OP_NE:
+          case OP_SUBSTR: {
+            const char* left = stack[sp-2].v->data;
+            const char* right = stack[sp-1].v->data;
+            bool b;
+            if (in->op == OP_SUBSTR) {
+                b = strstr(right, left) != NULL;
+            } else {
+                b = (strcmp(left, right) == 0) == (in->op == OP_EQ);
+            }
+            release(&stack[--sp]);
+            release(&stack[--sp]);
+            PUSH_BOOL(b);
+            break;
+          }
+        }
+    }
+
+    // Exactly one value should be left.
+    if (sp != 1) {
+        ErrorAbort(state, "bad program: %d values left on the stack", sp);
+        goto fail;
+    }
+    result = stack[0].v;
+    if (!stack[0].owned) {
+        result = StringValue(strdup(result->data));
+    }
+    if (stack != local) free(stack);
+    return result;
+
+  fail:
+    while (sp > 0) {
+        release(&stack[--sp]);
+    }
+    if (stack != local) free(stack);
+    return NULL;
+
+#undef PUSH_BOOL
+#undef PUSH
+}
+
+char* ExecuteProgram(State* state, const Program* prog) {
+    Value* v = ExecuteProgramValue(state, prog);
+    if (v == NULL) return NULL;
+    if (v->type != VAL_STRING) {
+        ErrorAbort(state, "expecting string, got value type %d", v->type);
+        FreeValue(v);
+        return NULL;
+    }
+    char* result = v->data;
+    free(v);
+    return result;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _EDIFY_BYTECODE_H
+#define _EDIFY_BYTECODE_H
+
+#include "expr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A parsed script compiled for a simple stack machine.
+//
+// The operators and builtins whose behavior edify defines (";", "+",
+// "&&", "||", "!", "==", "!=", ifelse() and is_substring()) become
+// instructions and jumps, and literals become references to a table
+// of interned constants, so none of them allocate unless their result
+// is a new string.  Every other function is a macro that evaluates its
+// own arguments, so calls to them are compiled as a single
+// instruction that calls the Function with its Expr arguments, just
+// as Evaluate() would.
+typedef struct Program Program;
+
+// Compile the tree rooted at 'root'.  The tree must outlive the
+// Program.  Returns NULL if out of memory.
+Program* CompileExpr(Expr* root);
+
+// Run a compiled script.  These give exactly what EvaluateValue() and
+// Evaluate() give for the tree the Program was compiled from,
+// including the error left in state->errmsg on failure.
+Value* ExecuteProgramValue(State* state, const Program* prog);
+char* ExecuteProgram(State* state, const Program* prog);
+
+void FreeProgram(Program* prog);
+
+// Print the instructions to stdout.
+void DumpProgram(const Program* prog);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // _EDIFY_BYTECODE_H
@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Times evaluating a synthetic updater-script by walking the parse
+// tree (Evaluate()) and by running its compiled form
+// (ExecuteProgram()), and checks that both give the same result.
+// The compiled form is timed again with profiling on, to show what
+// that costs.  Loading the script's parsed form is timed against
+// parsing it.
+//
+// usage: edify_benchmark [statements] [runs]
+//
+// The script (100000 statements by default) mixes the shapes that
+// generated OTA scripts are made of: device asserts, metadata calls
+// with many literal arguments, progress updates and conditionals.
+// The functions it calls only evaluate and free their arguments.
+//
+// With glibc, heap allocations are counted as well.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "bytecode.h"
+#include "expr.h"
+#include "parsed.h"
+#include "parser.h"
+#include "profile.h"
+
+extern int yyparse(Expr** root, int* error_count);
+
+// The tree walker recurses once per statement.
+#define EVAL_STACK_SIZE (512 * 1024 * 1024)
+
+#ifdef __GLIBC__
+// glibc lets a program replace malloc(); these count calls and pass
+// them on.  (free() needs no wrapper.)
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+
+static unsigned long allocations = 0;
+
+void* malloc(size_t size) {
+    __sync_fetch_and_add(&allocations, 1);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    __sync_fetch_and_add(&allocations, 1);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size) {
+    __sync_fetch_and_add(&allocations, 1);
+    return __libc_realloc(p, size);
+}
+
+#define ALLOCATIONS() (allocations)
+#else
+#define ALLOCATIONS() (0UL)
+#endif
+
+static Value* NoopFn(const char* name, State* state, int argc, Expr* argv[]) {
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) return NULL;
+    int i;
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+    return StringValue(strdup(argc > 0 ? "t" : ""));
+}
+
+static Value* GetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
+    char* key;
+    if (ReadArgs(state, argv, 1, &key) < 0) return NULL;
+    free(key);
+    return StringValue(strdup("generic"));
+}
+
+static char* make_script(int statements, size_t* size) {
+    size_t alloc = statements * 160 + 1;
+    char* script = malloc(alloc);
+    size_t p = 0;
+    int i;
+    for (i = 0; i < statements; ++i) {
+        switch (i % 4) {
+          case 0:
+            p += snprintf(script + p, alloc - p,
+                          "assert(getprop(\"ro.product.device\") == \"generic\" || "
+                          "getprop(\"ro.build.product\") == \"generic\");\n");
+            break;
+          case 1:
+            p += snprintf(script + p, alloc - p,
+                          "set_metadata(\"/system/bin/file%d\", \"uid\", 0, \"gid\", "
+                          "2000, \"mode\", 0755, \"capabilities\", 0x0);\n", i);
+            break;
+          case 2:
+            p += snprintf(script + p, alloc - p,
+                          "show_progress(0.1, 10) + \"\" == \"t\" && ui_print(\"step %d\");\n", i);
+            break;
+          case 3:
+            p += snprintf(script + p, alloc - p,
+                          "if is_substring(\"file\", \"/system/bin/file%d\") then "
+                          "ui_print(\"yes\") else abort() endif;\n", i);
+            break;
+        }
+    }
+    *size = p;
+    return script;
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+typedef struct {
+    Expr* root;
+    char* script;
+    const Program* prog;
+    int runs;
+    double elapsed;
+    unsigned long allocations;
+    char* result;
+} Job;
+
+static void* run(void* cookie) {
+    Job* job = (Job*) cookie;
+    double start = now();
+    unsigned long before = ALLOCATIONS();
+    int i;
+    for (i = 0; i < job->runs; ++i) {
+        State state;
+        state.cookie = NULL;
+        state.script = job->script;
+        state.errmsg = NULL;
+        free(job->result);
+        job->result = job->prog ? ExecuteProgram(&state, job->prog)
+                                : Evaluate(&state, job->root);
+        free(state.errmsg);
+    }
+    job->elapsed = now() - start;
+    job->allocations = ALLOCATIONS() - before;
+    return NULL;
+}
+
+static void time_job(Job* job) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, EVAL_STACK_SIZE);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, run, job) != 0) {
+        fprintf(stderr, "can't start thread\n");
+        exit(1);
+    }
+    pthread_join(thread, NULL);
+    pthread_attr_destroy(&attr);
+}
+
+int main(int argc, char** argv) {
+    int statements = (argc > 1) ? atoi(argv[1]) : 100000;
+    int runs = (argc > 2) ? atoi(argv[2]) : 5;
+    if (statements <= 0 || runs <= 0) {
+        fprintf(stderr, "usage: %s [statements] [runs]\n", argv[0]);
+        return 2;
+    }
+
+    RegisterBuiltins();
+    RegisterFunction("getprop", GetPropFn);
+    RegisterFunction("set_metadata", NoopFn);
+    RegisterFunction("show_progress", NoopFn);
+    RegisterFunction("ui_print", NoopFn);
+    FinishRegistration();
+
+    size_t size;
+    char* script = make_script(statements, &size);
+
+    double start = now();
+    unsigned long before = ALLOCATIONS();
+    Expr* root;
+    int error_count = 0;
+    yy_scan_bytes(script, size);
+    int error = yyparse(&root, &error_count);
+    if (error != 0 || error_count > 0) {
+        fprintf(stderr, "%d parse errors\n", error_count);
+        return 1;
+    }
+    printf("parse:    %.3f s, %lu allocations for %d statements (%zu bytes)\n",
+           now() - start, ALLOCATIONS() - before, statements, size);
+
+    size_t saved_size;
+    unsigned char* saved = SaveParsedScript(root, script, &saved_size);
+    if (saved == NULL) {
+        fprintf(stderr, "save failed\n");
+        return 1;
+    }
+    start = now();
+    before = ALLOCATIONS();
+    Expr* loaded;
+    char* loaded_script;
+    if (LoadParsedScript(saved, saved_size, &loaded, &loaded_script) != 0) {
+        fprintf(stderr, "load failed\n");
+        return 1;
+    }
+    printf("load:     %.3f s, %lu allocations (%zu bytes parsed)\n",
+           now() - start, ALLOCATIONS() - before, saved_size);
+    free(saved);
+    free(loaded_script);
+
+    start = now();
+    Program* prog = CompileExpr(root);
+    if (prog == NULL) {
+        fprintf(stderr, "compile failed\n");
+        return 1;
+    }
+    printf("compile:  %.3f s\n", now() - start);
+
+    Job tree = { root, script, NULL, runs, 0, 0, NULL };
+    Job vm = { root, script, prog, runs, 0, 0, NULL };
+    Job profiled = { root, script, prog, runs, 0, 0, NULL };
+    time_job(&tree);
+    time_job(&vm);
+    SetProfiling(1);
+    time_job(&profiled);
+    SetProfiling(0);
+
+    printf("evaluate: %.3f s, %lu allocations per run\n",
+           tree.elapsed / runs, tree.allocations / runs);
+    printf("execute:  %.3f s, %lu allocations per run (%.2fx)\n",
+           vm.elapsed / runs, vm.allocations / runs, tree.elapsed / vm.elapsed);
+    printf("profiled: %.3f s, %lu allocations per run (%+.1f%%)\n",
+           profiled.elapsed / runs, profiled.allocations / runs,
+           (profiled.elapsed / vm.elapsed - 1) * 100);
+    DumpProfile(stdout, NULL, 0);
+
+    if (tree.result == NULL || vm.result == NULL || strcmp(tree.result, vm.result) != 0) {
+        printf("results differ: \"%s\" vs \"%s\"\n",
+               tree.result ? tree.result : "(NULL)", vm.result ? vm.result : "(NULL)");
+        return 1;
+    }
+    free(tree.result);
+    free(vm.result);
+    free(profiled.result);
+    FreeProgram(prog);
+    FreeParseTrees();
+    free(script);
+    return 0;
+}
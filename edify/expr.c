@@ -17,11 +17,13 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <unistd.h>
 
 #include "expr.h"
+#include "profile.h"
 
 // Functions should:
 //
@@ -32,8 +34,101 @@ int BooleanString(const char* s) {
     return s[0] != '\0';
 }
 
+// -----------------------------------------------------------------
+//   memory
+// -----------------------------------------------------------------
+
+// Released Value structs, kept for reuse.
+#define VALUE_CACHE_SIZE 64
+static Value* value_cache[VALUE_CACHE_SIZE];
+static int value_cache_count = 0;
+
+Value* NewValue() {
+    if (value_cache_count > 0) {
+        return value_cache[--value_cache_count];
+    }
+    return malloc(sizeof(Value));
+}
+
+static void ReleaseValue(Value* v) {
+    if (value_cache_count < VALUE_CACHE_SIZE) {
+        value_cache[value_cache_count++] = v;
+    } else {
+        free(v);
+    }
+}
+
+// The parse arena is a list of chunks; allocations are carved off the
+// front of the newest one.  Anything too big to share a chunk gets a
+// chunk of its own.
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN (2 * sizeof(void*))
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t used;
+    size_t size;
+    // data follows, aligned to ARENA_ALIGN
+} ArenaChunk;
+
+#define ARENA_HEADER_SIZE \
+    ((sizeof(ArenaChunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+static ArenaChunk* parse_arena = NULL;
+
+void* ParseAlloc(size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    ArenaChunk* c = parse_arena;
+    if (c == NULL || c->size - c->used < size) {
+        size_t chunk = (size > ARENA_CHUNK_SIZE / 4) ? size : ARENA_CHUNK_SIZE;
+        ArenaChunk* n = malloc(ARENA_HEADER_SIZE + chunk);
+        if (n == NULL) {
+            fprintf(stderr, "edify: out of memory allocating parse tree\n");
+            abort();
+        }
+        n->used = 0;
+        n->size = chunk;
+        if (c != NULL && chunk == size) {
+            // Keep filling the current chunk; put this one behind it.
+            n->next = c->next;
+            c->next = n;
+            n->used = size;
+            return (char*)n + ARENA_HEADER_SIZE;
+        }
+        n->next = c;
+        parse_arena = c = n;
+    }
+    void* p = (char*)c + ARENA_HEADER_SIZE + c->used;
+    c->used += size;
+    return p;
+}
+
+char* ParseStrdup(const char* str) {
+    size_t len = strlen(str) + 1;
+    char* copy = ParseAlloc(len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+void FreeParseTrees() {
+    while (parse_arena != NULL) {
+        ArenaChunk* next = parse_arena->next;
+        free(parse_arena);
+        parse_arena = next;
+    }
+}
+
+// -----------------------------------------------------------------
+//   evaluation
+// -----------------------------------------------------------------
+
 char* Evaluate(State* state, Expr* expr) {
-    Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    // Most arguments are literals; skip wrapping them in a Value just
+    // to unwrap it again.
+    if (expr->fn == Literal) {
+        return strdup(expr->name);
+    }
+    Value* v = CallExpr(state, expr);
     if (v == NULL) return NULL;
     if (v->type != VAL_STRING) {
         ErrorAbort(state, "expecting string, got value type %d", v->type);
@@ -41,17 +136,17 @@ char* Evaluate(State* state, Expr* expr) {
         return NULL;
     }
     char* result = v->data;
-    free(v);
+    ReleaseValue(v);
     return result;
 }
 
 Value* EvaluateValue(State* state, Expr* expr) {
-    return expr->fn(expr->name, state, expr->argc, expr->argv);
+    return CallExpr(state, expr);
 }
 
 Value* StringValue(char* str) {
     if (str == NULL) return NULL;
-    Value* v = malloc(sizeof(Value));
+    Value* v = NewValue();
     v->type = VAL_STRING;
     v->size = strlen(str);
     v->data = str;
@@ -61,7 +156,7 @@ Value* StringValue(char* str) {
 void FreeValue(Value* v) {
     if (v == NULL) return;
     free(v->data);
-    free(v);
+    ReleaseValue(v);
 }
 
 Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -327,11 +422,12 @@ Value* Literal(const char* name, State* state, int argc, Expr* argv[]) {
 Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
     va_list v;
     va_start(v, count);
-    Expr* e = malloc(sizeof(Expr));
+    Expr* e = ParseAlloc(sizeof(Expr));
     e->fn = fn;
     e->name = "(operator)";
+    e->is_operator = 1;
     e->argc = count;
-    e->argv = malloc(count * sizeof(Expr*));
+    e->argv = ParseAlloc(count * sizeof(Expr*));
     int i;
     for (i = 0; i < count; ++i) {
         e->argv[i] = va_arg(v, Expr*);
@@ -360,17 +456,170 @@ void RegisterFunction(const char* name, Function fn) {
     ++fn_entries;
 }
 
+int RegisteredFunctionCount() {
+    return fn_entries;
+}
+
+NamedFunction ReplaceRegisteredFunction(int index, Function fn) {
+    NamedFunction old = fn_table[index];
+    fn_table[index].fn = fn;
+    return old;
+}
+
 static int fn_entry_compare(const void* a, const void* b) {
     const char* na = ((const NamedFunction*)a)->name;
     const char* nb = ((const NamedFunction*)b)->name;
     return strcmp(na, nb);
 }
 
+// FinishRegistration() builds a perfect hash of the function names,
+// so that FindFunction() is one hash of the name and one strcmp().
+// Each name's 64-bit hash is split into h1 and h2.  Names are put in
+// buckets by h1, and every bucket gets a displacement d, chosen so
+// that (h1 + d * h2) sends each of its names to a slot of its own.
+// The slots are kept at most half full, which makes the search short.
+// Lookups use the bsearch() below if no displacements can be found.
+#define FN_MAX_DISPLACEMENT 65535
+
+static NamedFunction* fn_slots = NULL;  // fn_slot_count entries, power of two
+static int fn_slot_count = 0;
+static uint16_t* fn_disp = NULL;        // fn_bucket_count entries
+static int fn_bucket_count = 0;
+
+static uint64_t fn_hash(const char* name) {
+    // 64-bit FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (; *name; ++name) {
+        h ^= (unsigned char)*name;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static unsigned fn_slot(uint64_t h, unsigned d) {
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    return (h1 + d * h2) & (fn_slot_count - 1);
+}
+
+static int bucket_size_compare(const void* a, const void* b) {
+    // (count << 16 | bucket) pairs, largest count first
+    uint32_t ka = *(const uint32_t*)a, kb = *(const uint32_t*)b;
+    return (ka < kb) - (ka > kb);
+}
+
+static void free_fn_hash() {
+    free(fn_slots);
+    free(fn_disp);
+    fn_slots = NULL;
+    fn_disp = NULL;
+    fn_slot_count = fn_bucket_count = 0;
+}
+
+static bool build_fn_hash() {
+    free_fn_hash();
+    if (fn_entries == 0 || fn_entries > 0xffff) return false;
+
+    fn_slot_count = 1;
+    while (fn_slot_count < fn_entries * 2) fn_slot_count *= 2;
+    fn_bucket_count = (fn_entries + 3) / 4;
+
+    uint64_t* hashes = malloc(fn_entries * sizeof(uint64_t));
+    int* members = malloc(fn_entries * sizeof(int));       // grouped by bucket
+    int* first = calloc(fn_bucket_count + 1, sizeof(int));
+    int* fill = malloc(fn_bucket_count * sizeof(int));
+    uint32_t* order = malloc(fn_bucket_count * sizeof(uint32_t));
+    bool* used = malloc(fn_slot_count * sizeof(bool));
+    unsigned* tried = malloc(fn_entries * sizeof(unsigned));
+    fn_slots = calloc(fn_slot_count, sizeof(NamedFunction));
+    fn_disp = calloc(fn_bucket_count, sizeof(uint16_t));
+    bool ok = hashes && members && first && fill && order && used && tried &&
+              fn_slots && fn_disp;
+
+    int i, b;
+    if (ok) {
+        // Counting sort of the names into their buckets.
+        for (i = 0; i < fn_entries; ++i) {
+            hashes[i] = fn_hash(fn_table[i].name);
+            first[(uint32_t)hashes[i] % fn_bucket_count + 1]++;
+        }
+        for (b = 0; b < fn_bucket_count; ++b) {
+            order[b] = (uint32_t)(first[b+1] << 16) | b;
+            first[b+1] += first[b];
+        }
+        memcpy(fill, first, fn_bucket_count * sizeof(int));
+        for (i = 0; i < fn_entries; ++i) {
+            members[fill[(uint32_t)hashes[i] % fn_bucket_count]++] = i;
+        }
+        qsort(order, fn_bucket_count, sizeof(uint32_t), bucket_size_compare);
+        memset(used, 0, fn_slot_count * sizeof(bool));
+    }
+
+    // Place the biggest buckets first, while the table is emptiest.
+    int o;
+    for (o = 0; ok && o < fn_bucket_count; ++o) {
+        b = order[o] & 0xffff;
+        int n = first[b+1] - first[b];
+        int* m = members + first[b];
+        unsigned d;
+        for (d = 0; d <= FN_MAX_DISPLACEMENT; ++d) {
+            int k;
+            for (k = 0; k < n; ++k) {
+                unsigned slot = fn_slot(hashes[m[k]], d);
+                if (used[slot]) break;
+                used[slot] = true;
+                tried[k] = slot;
+            }
+            if (k == n) break;
+            while (k-- > 0) used[tried[k]] = false;
+        }
+        if (d > FN_MAX_DISPLACEMENT) {
+            ok = false;
+            break;
+        }
+        fn_disp[b] = d;
+        int k;
+        for (k = 0; k < n; ++k) fn_slots[tried[k]] = fn_table[m[k]];
+    }
+
+    free(hashes);
+    free(members);
+    free(first);
+    free(fill);
+    free(order);
+    free(used);
+    free(tried);
+    if (!ok) free_fn_hash();
+    return ok;
+}
+
 void FinishRegistration() {
     qsort(fn_table, fn_entries, sizeof(NamedFunction), fn_entry_compare);
+
+    // A name registered twice would keep the hash from ever being
+    // built, so drop the extra entries.
+    int i, out = 0;
+    for (i = 0; i < fn_entries; ++i) {
+        if (out > 0 && strcmp(fn_table[out-1].name, fn_table[i].name) == 0) {
+            fn_table[out-1] = fn_table[i];
+        } else {
+            fn_table[out++] = fn_table[i];
+        }
+    }
+    fn_entries = out;
+
+    build_fn_hash();
 }
 
 Function FindFunction(const char* name) {
+    if (fn_slots != NULL) {
+        uint64_t h = fn_hash(name);
+        const NamedFunction* nf =
+                &fn_slots[fn_slot(h, fn_disp[(uint32_t)h % fn_bucket_count])];
+        if (nf->name != NULL && strcmp(nf->name, name) == 0) return nf->fn;
+        return NULL;
+    }
+
     NamedFunction key;
     key.name = name;
     NamedFunction* nf = bsearch(&key, fn_table, fn_entries,
@@ -403,25 +652,27 @@ void RegisterBuiltins() {
 // zero or more char** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadArgs(State* state, Expr* argv[], int count, ...) {
-    char** args = malloc(count * sizeof(char*));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = Evaluate(state, argv[i]);
-        if (args[i] == NULL) {
+        char** out = va_arg(v, char**);
+        *out = Evaluate(state, argv[i]);
+        if (*out == NULL) {
             va_end(v);
+            // Walk the outputs again to free what was filled in.
+            va_start(v, count);
             int j;
             for (j = 0; j < i; ++j) {
-                free(args[j]);
+                char** done = va_arg(v, char**);
+                free(*done);
+                *done = NULL;
             }
-            free(args);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, char**)) = args[i];
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
@@ -429,25 +680,26 @@ int ReadArgs(State* state, Expr* argv[], int count, ...) {
 // zero or more Value** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadValueArgs(State* state, Expr* argv[], int count, ...) {
-    Value** args = malloc(count * sizeof(Value*));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = EvaluateValue(state, argv[i]);
-        if (args[i] == NULL) {
+        Value** out = va_arg(v, Value**);
+        *out = EvaluateValue(state, argv[i]);
+        if (*out == NULL) {
             va_end(v);
+            va_start(v, count);
             int j;
             for (j = 0; j < i; ++j) {
-                FreeValue(args[j]);
+                Value** done = va_arg(v, Value**);
+                FreeValue(*done);
+                *done = NULL;
             }
-            free(args);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, Value**)) = args[i];
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
@@ -63,6 +63,7 @@ struct Expr {
     int argc;
     Expr** argv;
     int start, end;
+    int is_operator;    // made by Build(); name is "(operator)"
 };
 
 // Take one of the Expr*s passed to the function as an argument,
@@ -121,6 +122,14 @@ void RegisterFunction(const char* name, Function fn);
 // Register all the builtins.
 void RegisterBuiltins();
 
+// How many functions have been registered so far.
+int RegisteredFunctionCount();
+
+// Swap the Function registered by the index'th RegisterFunction()
+// call for 'fn', returning the entry as it was.  Only valid before
+// FinishRegistration().
+NamedFunction ReplaceRegisteredFunction(int index, Function fn);
+
 // Call this after all calls to RegisterFunction() but before parsing
 // any scripts to finish building the function table.
 void FinishRegistration();
@@ -164,6 +173,27 @@ Value* StringValue(char* str);
 // Free a Value object.
 void FreeValue(Value* v);
 
+// Get an uninitialized Value struct.  Values are ordinary malloc()'d
+// blocks, so they may be released with free() as always, but ones
+// released with FreeValue() (or by Evaluate()) are kept for reuse.
+// Like the rest of edify, this must only be used on the thread
+// evaluating the script.
+Value* NewValue();
+
+
+// --- parse tree memory ---
+
+// The parser allocates every Expr, argument array and literal string
+// from one arena, which is freed all at once by FreeParseTrees().
+// Parse trees are never freed piecemeal, so functions may keep
+// pointers into them (such as an Expr's name) for as long as the tree
+// is in use.
+void* ParseAlloc(size_t size);
+char* ParseStrdup(const char* str);
+
+// Free every parse tree built so far.
+void FreeParseTrees();
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -18,8 +18,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bytecode.h"
 #include "expr.h"
+#include "parsed.h"
 #include "parser.h"
+#include "profile.h"
 
 extern int yyparse(Expr** root, int* error_count);
 
@@ -36,38 +39,122 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     if (error > 0 || error_count > 0) {
         printf("error parsing \"%s\" (%d errors)\n",
                expr_str, error_count);
+        FreeParseTrees();
         ++*errors;
         return 0;
     }
 
-    State state;
-    state.cookie = NULL;
-    state.script = strdup(expr_str);
-    state.errmsg = NULL;
-
-    result = Evaluate(&state, e);
-    free(state.errmsg);
-    free(state.script);
-    if (result == NULL && expected != NULL) {
-        printf("error evaluating \"%s\"\n", expr_str);
+    // Check the tree, the compiled form of it and the tree saved and
+    // loaded again all give the same answer.
+    Program* prog = CompileExpr(e);
+    size_t saved_size;
+    unsigned char* saved = SaveParsedScript(e, expr_str, &saved_size);
+    Expr* loaded;
+    char* loaded_script;
+    if (saved == NULL ||
+        LoadParsedScript(saved, saved_size, &loaded, &loaded_script) != 0) {
+        printf("error saving and loading \"%s\"\n", expr_str);
         ++*errors;
+        free(saved);
+        FreeProgram(prog);
+        FreeParseTrees();
         return 0;
     }
+    free(saved);
 
-    if (result == NULL && expected == NULL) {
-        return 1;
+    int pass;
+    for (pass = 0; pass < 3; ++pass) {
+        const char* how = pass == 0 ? "evaluating" : pass == 1 ? "executing" : "loading";
+
+        State state;
+        state.cookie = NULL;
+        state.script = strdup(pass == 2 ? loaded_script : expr_str);
+        state.errmsg = NULL;
+
+        result = (pass == 0) ? Evaluate(&state, e) :
+                 (pass == 1) ? ExecuteProgram(&state, prog) : Evaluate(&state, loaded);
+        free(state.errmsg);
+        free(state.script);
+        if (result == NULL && expected != NULL) {
+            printf("error %s \"%s\"\n", how, expr_str);
+            ++*errors;
+            break;
+        }
+
+        if (result == NULL && expected == NULL) {
+            continue;
+        }
+
+        if (expected == NULL || strcmp(result, expected) != 0) {
+            printf("%s \"%s\": expected \"%s\", got \"%s\"\n",
+                   how, expr_str, expected ? expected : "(NULL)", result);
+            ++*errors;
+            free(result);
+            break;
+        }
+
+        free(result);
     }
+    FreeProgram(prog);
+    free(loaded_script);
+    FreeParseTrees();
+    return pass == 3;
+}
 
-    if (strcmp(result, expected) != 0) {
-        printf("evaluating \"%s\": expected \"%s\", got \"%s\"\n",
-               expr_str, expected, result);
+static void expect_load_fails(const unsigned char* data, size_t size,
+                              const char* what, int* errors) {
+    Expr* loaded;
+    char* loaded_script;
+    if (LoadParsedScript(data, size, &loaded, &loaded_script) == 0) {
+        printf("loaded parsed script %s\n", what);
+        free(loaded_script);
         ++*errors;
-        free(result);
-        return 0;
     }
+}
 
-    free(result);
-    return 1;
+// Damaged parsed scripts must be rejected, not loaded.
+void test_parsed_errors(int* errors) {
+    const char* script = "ifelse(a == b, concat(c, d), !e)";
+    Expr* e;
+    int error_count = 0;
+    yy_scan_string(script);
+    if (yyparse(&e, &error_count) != 0 || error_count > 0) {
+        printf("error parsing \"%s\"\n", script);
+        ++*errors;
+        FreeParseTrees();
+        return;
+    }
+
+    size_t size;
+    unsigned char* saved = SaveParsedScript(e, script, &size);
+    unsigned char* bad = malloc(size);
+    if (saved == NULL || bad == NULL) {
+        printf("error saving \"%s\"\n", script);
+        ++*errors;
+    } else {
+        size_t cut;
+        for (cut = 0; cut < size; cut += 7) {
+            expect_load_fails(saved, cut, "cut short", errors);
+        }
+        expect_load_fails(saved, size - 1, "cut short", errors);
+
+        // Point the last argument back at the root.
+        memcpy(bad, saved, size);
+        memset(bad + size - 4, 0, 4);
+        expect_load_fails(bad, size, "with a loop", errors);
+
+        // Rename concat() to a function that doesn't exist.
+        memcpy(bad, saved, size);
+        size_t i;
+        for (i = 0; i + 7 <= size; ++i) {
+            if (memcmp(bad + i, "concat", 7) == 0) bad[i] = 'k';
+        }
+        expect_load_fails(bad, size, "with an unknown function", errors);
+    }
+
+    free(bad);
+    free(saved);
+    FreeParseTrees();
 }
 
 int test() {
@@ -95,6 +182,8 @@ int test() {
     expect("concat(a,\n \"b\")", "ab", &errors);
     expect("concat(a + b,\nc,\"d\")", "abcd", &errors);
     expect("\"concat\"(a + b,\nc,\"d\")", "abcd", &errors);
+    expect("concat(, a)", "a", &errors);
+    expect("concat(, a, b, c)", "abc", &errors);
 
     // logical and
     expect("a && b", "b", &errors);
@@ -144,6 +233,20 @@ int test() {
     expect("if \"\" then yes endif", "", &errors);
     expect("if \"\"; t then yes endif", "yes", &errors);
 
+    // builtins called with the wrong number of arguments
+    expect("concat()", "", &errors);
+    expect("ifelse(t)", NULL, &errors);
+    expect("is_substring(a, b, c)", "", &errors);
+
+    // more values live at once than the interpreter's initial stack
+    expect("concat(a,b,c,d,e,f,g,h,i,j,k,l,m,n,o,p,q,r,s,t,u,v,w,x,y,z,"
+           "a,b,c,d,e,f,g,h,i,j,k,l,m,n,o,p,q,r,s,t,u,v,w,x,y,z)",
+           "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz", &errors);
+    expect("a + (b + (c + (d + (e + (f + (g + (h + (i + (j + (k + (l + (m + "
+           "(n + (o + (p + (q + (r + (s + (t + (u + (v + (w + (x + (y + (z + "
+           "(a + (b + (c + (d + (e + (f + (g + h))))))))))))))))))))))))))))))))",
+           "abcdefghijklmnopqrstuvwxyzabcdefgh", &errors);
+
     // numeric comparisons
     expect("less_than_int(3, 14)", "t", &errors);
     expect("less_than_int(14, 3)", "", &errors);
@@ -154,6 +257,16 @@ int test() {
     expect("greater_than_int(x, 3)", "", &errors);
     expect("greater_than_int(3, x)", "", &errors);
 
+    // function lookup
+    if (FindFunction("concat") != ConcatFn || FindFunction("ifelse") != IfElseFn ||
+        FindFunction("is_substring") != SubstringFn ||
+        FindFunction("concat2") != NULL || FindFunction("") != NULL) {
+        printf("function lookup failed\n");
+        ++errors;
+    }
+
+    test_parsed_errors(&errors);
+
     printf("\n");
 
     return errors;
@@ -173,8 +286,108 @@ void ExprDump(int depth, Expr* n, char* script) {
     }
 }
 
+static Value* HostStubFn(const char* name, State* state, int argc, Expr* argv[]) {
+    return ErrorAbort(state, "%s() is not available on the host", name);
+}
+
+static char* read_file(const char* path, size_t* size) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return NULL;
+    char* data = NULL;
+    size_t alloc = 0;
+    *size = 0;
+    for (;;) {
+        if (*size + 1 >= alloc) {
+            alloc = alloc * 2 + 8192;
+            char* p = realloc(data, alloc);
+            if (p == NULL) break;
+            data = p;
+        }
+        size_t n = fread(data + *size, 1, alloc - *size - 1, f);
+        if (n == 0) break;
+        *size += n;
+    }
+    fclose(f);
+    if (data != NULL) data[*size] = '\0';
+    return data;
+}
+
+// Register each name listed (one per line) in 'path' as a function
+// that can't be run here, for checking scripts meant for a device.
+static int register_function_names(const char* path) {
+    size_t size;
+    char* names = read_file(path, &size);
+    if (names == NULL) {
+        printf("can't read %s\n", path);
+        return -1;
+    }
+    char* name;
+    for (name = strtok(names, " \t\r\n"); name != NULL; name = strtok(NULL, " \t\r\n")) {
+        RegisterFunction(name, HostStubFn);
+    }
+    // The table keeps pointers to the names.
+    return 0;
+}
+
+// edify -c [-f <function list>] <script> <output>
+//
+// Check that <script> parses and calls nothing but builtins and the
+// functions listed in <function list>, and write the result to
+// <output> as a parsed script (see parsed.h).
+static int check_and_save(int argc, char** argv) {
+    int i = 2;
+    if (argc == 6 && strcmp(argv[i], "-f") == 0) {
+        if (register_function_names(argv[i+1]) < 0) return 1;
+        i += 2;
+    }
+    FinishRegistration();
+    if (argc != i + 2) {
+        printf("usage: %s -c [-f <function list>] <script> <output>\n", argv[0]);
+        return 2;
+    }
+
+    size_t size;
+    char* script = read_file(argv[i], &size);
+    if (script == NULL) {
+        printf("can't read %s\n", argv[i]);
+        return 1;
+    }
+
+    Expr* root;
+    int error_count = 0;
+    yy_scan_bytes(script, size);
+    int error = yyparse(&root, &error_count);
+    if (error != 0 || error_count > 0) {
+        printf("%s: %d parse errors\n", argv[i], error_count);
+        return 1;
+    }
+
+    size_t saved_size;
+    unsigned char* saved = SaveParsedScript(root, script, &saved_size);
+    if (saved == NULL) {
+        printf("failed to save %s\n", argv[i]);
+        return 1;
+    }
+    FILE* f = fopen(argv[i+1], "wb");
+    if (f == NULL ||
+        fwrite(saved, 1, saved_size, f) != saved_size ||
+        fclose(f) != 0) {
+        printf("can't write %s\n", argv[i+1]);
+        return 1;
+    }
+    free(saved);
+    FreeParseTrees();
+    free(script);
+    return 0;
+}
+
 int main(int argc, char** argv) {
     RegisterBuiltins();
+
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        return check_and_save(argc, argv);
+    }
+
     FinishRegistration();
 
     if (argc == 1) {
@@ -200,12 +413,18 @@ int main(int argc, char** argv) {
 
         ExprDump(0, root, buffer);
 
+        Program* prog = CompileExpr(root);
+        DumpProgram(prog);
+
         State state;
         state.cookie = NULL;
         state.script = buffer;
         state.errmsg = NULL;
 
-        char* result = Evaluate(&state, root);
+        SetProfiling(1);
+        char* result = ExecuteProgram(&state, prog);
+        SetProfiling(0);
+        FreeProgram(prog);
         if (result == NULL) {
             printf("result was NULL, message is: %s\n",
                    (state.errmsg == NULL ? "(NULL)" : state.errmsg));
@@ -213,6 +432,7 @@ int main(int argc, char** argv) {
         } else {
             printf("result is [%s]\n", result);
         }
+        DumpProfile(stdout, buffer, 10);
     }
     return 0;
 }
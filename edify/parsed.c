@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+#include "parsed.h"
+
+#define NODE_WORDS 6
+
+static const struct {
+    Function fn;
+    int kind;
+    int min_args, max_args;
+} operators[] = {
+    { SequenceFn,   PARSED_SEQUENCE, 2, 2 },
+    { ConcatFn,     PARSED_CONCAT,   2, 2 },
+    { EqualityFn,   PARSED_EQ,       2, 2 },
+    { InequalityFn, PARSED_NE,       2, 2 },
+    { LogicalAndFn, PARSED_AND,      2, 2 },
+    { LogicalOrFn,  PARSED_OR,       2, 2 },
+    { LogicalNotFn, PARSED_NOT,      1, 1 },
+    { IfElseFn,     PARSED_IFELSE,   2, 3 },
+};
+#define OPERATOR_COUNT (int)(sizeof(operators) / sizeof(operators[0]))
+
+// The name Build() gives operator nodes.
+static const char operator_name[] = "(operator)";
+
+// -----------------------------------------------------------------
+//   saving
+// -----------------------------------------------------------------
+
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t alloc;
+    bool failed;
+} Buffer;
+
+static void put(Buffer* b, const void* data, size_t len) {
+    if (b->failed) return;
+    if (b->size + len > b->alloc) {
+        size_t n = b->alloc * 2 + 4096;
+        if (n < b->size + len) n = b->size + len;
+        unsigned char* p = realloc(b->data, n);
+        if (p == NULL) {
+            b->failed = true;
+            return;
+        }
+        b->data = p;
+        b->alloc = n;
+    }
+    memcpy(b->data + b->size, data, len);
+    b->size += len;
+}
+
+static void put_u32(Buffer* b, uint32_t v) {
+    unsigned char le[4] = { v, v >> 8, v >> 16, v >> 24 };
+    put(b, le, sizeof(le));
+}
+
+static uint32_t put_string(Buffer* pool, const char* s) {
+    uint32_t offset = pool->size;
+    put(pool, s, strlen(s) + 1);
+    return offset;
+}
+
+unsigned char* SaveParsedScript(Expr* root, const char* script, size_t* size) {
+    Buffer out = { NULL, 0, 0, false };
+    Buffer pool = { NULL, 0, 0, false };
+    Buffer nodes = { NULL, 0, 0, false };
+    Buffer args = { NULL, 0, 0, false };
+
+    // Number the nodes breadth-first, which puts every argument after
+    // its parent.  'queue' holds them in that order.
+    Expr** queue = malloc(sizeof(Expr*));
+    size_t queue_count = 1, queue_alloc = 1;
+    const char** fn_names = NULL;
+    uint32_t* fn_offsets = NULL;
+    uint32_t fn_count = 0, fn_alloc = 0;
+    uint32_t arg_count = 0;
+    bool ok = (queue != NULL);
+    if (ok) queue[0] = root;
+
+    size_t i;
+    for (i = 0; ok && i < queue_count; ++i) {
+        Expr* e = queue[i];
+        uint32_t kind, value = 0;
+
+        if (e->fn == Literal) {
+            kind = PARSED_LITERAL;
+            value = put_string(&pool, e->name);
+        } else if (e->is_operator) {
+            int k;
+            for (k = 0; k < OPERATOR_COUNT && operators[k].fn != e->fn; ++k) ;
+            if (k == OPERATOR_COUNT) {
+                printf("can't save operator at %d\n", e->start);
+                ok = false;
+                break;
+            }
+            kind = operators[k].kind;
+        } else {
+            kind = PARSED_CALL;
+            for (value = 0; value < fn_count; ++value) {
+                if (strcmp(fn_names[value], e->name) == 0) break;
+            }
+            if (value == fn_count) {
+                if (fn_count == fn_alloc) {
+                    fn_alloc = fn_alloc * 2 + 16;
+                    const char** n = realloc(fn_names, fn_alloc * sizeof(char*));
+                    uint32_t* o = realloc(fn_offsets, fn_alloc * sizeof(uint32_t));
+                    if (n != NULL) fn_names = n;
+                    if (o != NULL) fn_offsets = o;
+                    if (n == NULL || o == NULL) {
+                        ok = false;
+                        break;
+                    }
+                }
+                fn_names[fn_count] = e->name;
+                fn_offsets[fn_count] = put_string(&pool, e->name);
+                ++fn_count;
+            }
+        }
+
+        put_u32(&nodes, kind);
+        put_u32(&nodes, value);
+        put_u32(&nodes, e->argc);
+        put_u32(&nodes, arg_count);
+        put_u32(&nodes, e->start);
+        put_u32(&nodes, e->end);
+
+        if (queue_count + e->argc > queue_alloc) {
+            size_t n = queue_alloc * 2 + e->argc;
+            Expr** q = realloc(queue, n * sizeof(Expr*));
+            if (q == NULL) {
+                ok = false;
+                break;
+            }
+            queue = q;
+            queue_alloc = n;
+        }
+        int a;
+        for (a = 0; a < e->argc; ++a) {
+            put_u32(&args, queue_count);
+            queue[queue_count++] = e->argv[a];
+        }
+        arg_count += e->argc;
+    }
+
+    if (ok) {
+        size_t source_size = strlen(script);
+        put(&out, PARSED_MAGIC, 4);
+        put_u32(&out, PARSED_VERSION);
+        put_u32(&out, source_size);
+        put(&out, script, source_size);
+        put_u32(&out, pool.size);
+        put(&out, pool.data, pool.size);
+        put_u32(&out, fn_count);
+        for (i = 0; i < fn_count; ++i) put_u32(&out, fn_offsets[i]);
+        put_u32(&out, queue_count);
+        put(&out, nodes.data, nodes.size);
+        put_u32(&out, arg_count);
+        put(&out, args.data, args.size);
+        ok = !(out.failed || pool.failed || nodes.failed || args.failed);
+    }
+
+    free(queue);
+    free(fn_names);
+    free(fn_offsets);
+    free(pool.data);
+    free(nodes.data);
+    free(args.data);
+    if (!ok) {
+        free(out.data);
+        return NULL;
+    }
+    *size = out.size;
+    return out.data;
+}
+
+// -----------------------------------------------------------------
+//   loading
+// -----------------------------------------------------------------
+
+typedef struct {
+    const unsigned char* p;
+    const unsigned char* end;
+} Reader;
+
+static bool get_u32(Reader* r, uint32_t* v) {
+    if (r->end - r->p < 4) return false;
+    *v = r->p[0] | (r->p[1] << 8) | (r->p[2] << 16) | ((uint32_t)r->p[3] << 24);
+    r->p += 4;
+    return true;
+}
+
+// Take 'count' items of 'size' bytes from r, if there are that many.
+static const unsigned char* get_items(Reader* r, uint32_t count, size_t size) {
+    if ((size_t)(r->end - r->p) / size < count) return NULL;
+    const unsigned char* p = r->p;
+    r->p += (size_t)count * size;
+    return p;
+}
+
+static uint32_t word(const unsigned char* p, size_t i) {
+    p += i * 4;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int LoadParsedScript(const unsigned char* data, size_t size,
+                     Expr** root, char** script) {
+    Reader r = { data, data + size };
+    uint32_t version, source_size, pool_size, fn_count, node_count, arg_count;
+    const unsigned char *source, *pool, *fn_data, *node_data, *arg_data;
+
+    if (size < 4 || memcmp(data, PARSED_MAGIC, 4) != 0) {
+        printf("parsed script: bad magic\n");
+        return -1;
+    }
+    r.p += 4;
+    if (!get_u32(&r, &version) || version != PARSED_VERSION) {
+        printf("parsed script: unsupported version\n");
+        return -1;
+    }
+    if (!get_u32(&r, &source_size) ||
+        (source = get_items(&r, source_size, 1)) == NULL ||
+        !get_u32(&r, &pool_size) ||
+        (pool = get_items(&r, pool_size, 1)) == NULL ||
+        !get_u32(&r, &fn_count) ||
+        (fn_data = get_items(&r, fn_count, 4)) == NULL ||
+        !get_u32(&r, &node_count) ||
+        (node_data = get_items(&r, node_count, NODE_WORDS * 4)) == NULL ||
+        !get_u32(&r, &arg_count) ||
+        (arg_data = get_items(&r, arg_count, 4)) == NULL ||
+        r.p != r.end) {
+        printf("parsed script: truncated or has trailing data\n");
+        return -1;
+    }
+    if (node_count == 0 || (pool_size > 0 && pool[pool_size-1] != '\0')) {
+        printf("parsed script: malformed\n");
+        return -1;
+    }
+
+    // Resolve each function once.
+    Function* fns = malloc((fn_count ? fn_count : 1) * sizeof(Function));
+    if (fns == NULL) {
+        printf("parsed script: out of memory\n");
+        return -1;
+    }
+    uint32_t i;
+    for (i = 0; i < fn_count; ++i) {
+        uint32_t offset = word(fn_data, i);
+        if (offset >= pool_size) {
+            printf("parsed script: malformed\n");
+            free(fns);
+            return -1;
+        }
+        fns[i] = FindFunction((const char*)pool + offset);
+        if (fns[i] == NULL) {
+            printf("parsed script: unknown function \"%s\"\n", (const char*)pool + offset);
+            free(fns);
+            return -1;
+        }
+    }
+
+    // Check every node before building anything.
+    for (i = 0; i < node_count; ++i) {
+        const unsigned char* n = node_data + (size_t)i * NODE_WORDS * 4;
+        uint32_t kind = word(n, 0), value = word(n, 1), argc = word(n, 2);
+        uint32_t first = word(n, 3), start = word(n, 4), end = word(n, 5);
+        bool ok = start <= end && end <= source_size &&
+                  argc <= arg_count && first <= arg_count - argc;
+        if (kind == PARSED_LITERAL) {
+            ok = ok && argc == 0 && value < pool_size;
+        } else if (kind == PARSED_CALL) {
+            ok = ok && value < fn_count;
+        } else {
+            int k;
+            for (k = 0; k < OPERATOR_COUNT && operators[k].kind != (int)kind; ++k) ;
+            ok = ok && k < OPERATOR_COUNT &&
+                 argc >= (uint32_t)operators[k].min_args &&
+                 argc <= (uint32_t)operators[k].max_args;
+        }
+        uint32_t a;
+        for (a = 0; ok && a < argc; ++a) {
+            uint32_t child = word(arg_data, first + a);
+            ok = child > i && child < node_count;
+        }
+        if (!ok) {
+            printf("parsed script: malformed node %u\n", i);
+            free(fns);
+            return -1;
+        }
+    }
+
+    char* copy = malloc(source_size + 1);
+    if (copy == NULL) {
+        printf("parsed script: out of memory\n");
+        free(fns);
+        return -1;
+    }
+    memcpy(copy, source, source_size);
+    copy[source_size] = '\0';
+
+    char* strings = ParseAlloc(pool_size ? pool_size : 1);
+    memcpy(strings, pool, pool_size);
+    Expr* nodes = ParseAlloc(node_count * sizeof(Expr));
+    Expr** argv = ParseAlloc((arg_count ? arg_count : 1) * sizeof(Expr*));
+    for (i = 0; i < arg_count; ++i) {
+        argv[i] = &nodes[word(arg_data, i)];
+    }
+
+    for (i = 0; i < node_count; ++i) {
+        const unsigned char* n = node_data + (size_t)i * NODE_WORDS * 4;
+        Expr* e = &nodes[i];
+        uint32_t kind = word(n, 0), value = word(n, 1);
+        e->argc = word(n, 2);
+        e->argv = e->argc ? argv + word(n, 3) : NULL;
+        e->start = word(n, 4);
+        e->end = word(n, 5);
+        e->is_operator = (kind != PARSED_LITERAL && kind != PARSED_CALL);
+        if (kind == PARSED_LITERAL) {
+            e->fn = Literal;
+            e->name = strings + value;
+        } else if (kind == PARSED_CALL) {
+            e->fn = fns[value];
+            e->name = strings + word(fn_data, value);
+        } else {
+            int k;
+            for (k = 0; operators[k].kind != (int)kind; ++k) ;
+            e->fn = operators[k].fn;
+            e->name = (char*)operator_name;
+        }
+    }
+
+    free(fns);
+    *root = &nodes[0];
+    *script = copy;
+    return 0;
+}
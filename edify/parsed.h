@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _EDIFY_PARSED_H
+#define _EDIFY_PARSED_H
+
+#include <stddef.h>
+
+#include "expr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A parsed script is a parse tree written out by the host-side edify
+// tool once the script has parsed cleanly and every function it calls
+// has been found.  Loading one builds the tree directly, without
+// lexing or parsing, and looks up each distinct function name once
+// rather than once per call.
+//
+// All numbers are 32-bit little-endian:
+//
+//   "EDFY" version(1)
+//   source_size   source text (not NUL-terminated)
+//   pool_size     string pool: literals and names, each NUL-terminated
+//   fn_count      fn_count pool offsets, one per distinct function name
+//   node_count    node_count nodes of six numbers:
+//                     kind, value, argc, first_arg, start, end
+//   arg_count     arg_count node indices
+//
+// Node 0 is the root.  'kind' is one of PARSED_* below; 'value' is a
+// pool offset for a literal, a function index for a call and unused
+// for an operator.  A node's arguments are arg_count entries starting
+// at 'first_arg', and every argument has a higher index than the node
+// itself, so the tree can't loop.  'start' and 'end' are offsets in
+// the source, as in Expr.
+
+#define PARSED_MAGIC "EDFY"
+#define PARSED_VERSION 1
+
+#define PARSED_LITERAL      0
+#define PARSED_CALL         1
+#define PARSED_SEQUENCE     2   // ;
+#define PARSED_CONCAT       3   // +
+#define PARSED_EQ           4   // ==
+#define PARSED_NE           5   // !=
+#define PARSED_AND          6   // &&
+#define PARSED_OR           7   // ||
+#define PARSED_NOT          8   // !
+#define PARSED_IFELSE       9   // if ... then ... [else ...] endif
+
+// Serialize the tree 'root', parsed from 'script'.  Returns a
+// malloc'd buffer of *size bytes, or NULL on failure.
+unsigned char* SaveParsedScript(Expr* root, const char* script, size_t* size);
+
+// Rebuild a tree saved by SaveParsedScript(), resolving its function
+// names against the registered functions.  The tree is allocated like
+// one from the parser (and freed by FreeParseTrees()).  On success,
+// sets *root and *script (a malloc'd copy of the source, for use as
+// State.script) and returns 0.  Returns -1 if the data is malformed
+// or calls a function that isn't registered, printing why.
+int LoadParsedScript(const unsigned char* data, size_t size,
+                     Expr** root, char** script);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // _EDIFY_PARSED_H
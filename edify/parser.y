@@ -66,11 +66,12 @@ input:  expr           { *root = $1; }
 ;
 
 expr:  STRING {
-    $$ = malloc(sizeof(Expr));
+    $$ = ParseAlloc(sizeof(Expr));
     $$->fn = Literal;
     $$->name = $1;
     $$->argc = 0;
     $$->argv = NULL;
+    $$->is_operator = 0;
     $$->start = @$.start;
     $$->end = @$.end;
 }
@@ -87,7 +88,7 @@ expr:  STRING {
 |  IF expr THEN expr ENDIF           { $$ = Build(IfElseFn, @$, 2, $2, $4); }
 |  IF expr THEN expr ELSE expr ENDIF { $$ = Build(IfElseFn, @$, 3, $2, $4, $6); }
 | STRING '(' arglist ')' {
-    $$ = malloc(sizeof(Expr));
+    $$ = ParseAlloc(sizeof(Expr));
     $$->fn = FindFunction($1);
     if ($$->fn == NULL) {
         char buffer[256];
@@ -98,6 +99,7 @@ expr:  STRING {
     $$->name = $1;
     $$->argc = $3.argc;
     $$->argv = $3.argv;
+    $$->is_operator = 0;
     $$->start = @$.start;
     $$->end = @$.end;
 }
@@ -109,12 +111,19 @@ arglist:    /* empty */ {
 }
 | expr {
     $$.argc = 1;
-    $$.argv = malloc(sizeof(Expr*));
+    $$.argv = ParseAlloc(sizeof(Expr*));
     $$.argv[0] = $1;
 }
 | arglist ',' expr {
+    // The array's capacity is the smallest power of two that holds
+    // argc entries, so it's full exactly when argc is a power of two
+    // (or zero, for "f(, a)", which has no array yet).
     $$.argc = $1.argc + 1;
-    $$.argv = realloc($$.argv, $$.argc * sizeof(Expr*));
+    $$.argv = $1.argv;
+    if (($1.argc & ($1.argc - 1)) == 0) {
+        $$.argv = ParseAlloc(($1.argc ? 2 * $1.argc : 1) * sizeof(Expr*));
+        memcpy($$.argv, $1.argv, $1.argc * sizeof(Expr*));
+    }
     $$.argv[$$.argc-1] = $3;
 }
 ;
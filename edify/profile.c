@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "expr.h"
+#include "profile.h"
+
+int gProfiling = 0;
+
+// One entry per calling Expr.  Entries live in a dense array (so a
+// running call can hold on to an index) with an open-addressed hash
+// of indices beside it.
+typedef struct {
+    const Expr* expr;
+    // The entry of the innermost call of the same name this one is an
+    // argument of, or -1.  Edify has no user-defined functions, so
+    // calls nest only as the script does and this never changes.
+    int outer;
+    unsigned calls;
+    uint64_t total_ns;
+    uint64_t self_ns;
+    uint64_t bytes;
+} Entry;
+
+// One per call in progress.
+typedef struct {
+    int entry;
+    uint64_t start_ns;
+    uint64_t child_ns;      // time spent in calls nested inside this one
+} Frame;
+
+static Entry* entries = NULL;
+static int entry_count = 0;
+static int entry_alloc = 0;
+
+static int* hash = NULL;        // entry index + 1, or 0 if empty
+static int hash_size = 0;       // power of two
+
+static Frame* frames = NULL;
+static int frame_count = 0;
+static int frame_alloc = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned hash_pointer(const void* p) {
+    uintptr_t v = (uintptr_t)p;
+    v ^= v >> 17;
+    v *= 0x9e3779b1U;
+    return (unsigned)(v ^ (v >> 15));
+}
+
+static int rehash(int size) {
+    int* h = calloc(size, sizeof(int));
+    if (h == NULL) return -1;
+    int i;
+    for (i = 0; i < entry_count; ++i) {
+        unsigned j = hash_pointer(entries[i].expr) & (size - 1);
+        while (h[j] != 0) j = (j + 1) & (size - 1);
+        h[j] = i + 1;
+    }
+    free(hash);
+    hash = h;
+    hash_size = size;
+    return 0;
+}
+
+// Return the index of e's entry, adding one if need be, or -1 if out
+// of memory.
+static int find_entry(const Expr* e) {
+    if (hash_size > 0) {
+        unsigned j = hash_pointer(e) & (hash_size - 1);
+        while (hash[j] != 0) {
+            if (entries[hash[j]-1].expr == e) return hash[j] - 1;
+            j = (j + 1) & (hash_size - 1);
+        }
+    }
+
+    // Keep the table at most half full.
+    if ((entry_count + 1) * 2 > hash_size &&
+        rehash(hash_size ? hash_size * 2 : 256) < 0) {
+        return -1;
+    }
+    if (entry_count == entry_alloc) {
+        int n = entry_alloc ? entry_alloc * 2 : 128;
+        Entry* bigger = realloc(entries, n * sizeof(Entry));
+        if (bigger == NULL) return -1;
+        entries = bigger;
+        entry_alloc = n;
+    }
+
+    Entry* en = &entries[entry_count];
+    memset(en, 0, sizeof(*en));
+    en->expr = e;
+    en->outer = -1;
+    int i;
+    for (i = frame_count - 1; i >= 0; --i) {
+        if (strcmp(entries[frames[i].entry].expr->name, e->name) == 0) {
+            en->outer = frames[i].entry;
+            break;
+        }
+    }
+
+    unsigned j = hash_pointer(e) & (hash_size - 1);
+    while (hash[j] != 0) j = (j + 1) & (hash_size - 1);
+    hash[j] = entry_count + 1;
+    return entry_count++;
+}
+
+void SetProfiling(int enabled) {
+    if (enabled) {
+        entry_count = 0;
+        if (hash != NULL) memset(hash, 0, hash_size * sizeof(int));
+    }
+    gProfiling = enabled;
+}
+
+void RecordBytesProcessed(uint64_t bytes) {
+    if (gProfiling && frame_count > 0) {
+        entries[frames[frame_count-1].entry].bytes += bytes;
+    }
+}
+
+Value* ProfiledCall(State* state, Expr* e) {
+    if (e->is_operator) return e->fn(e->name, state, e->argc, e->argv);
+
+    int index = find_entry(e);
+    if (index < 0 || frame_count == frame_alloc) {
+        int n = frame_alloc ? frame_alloc * 2 : 32;
+        Frame* bigger = (index < 0) ? NULL : realloc(frames, n * sizeof(Frame));
+        if (bigger == NULL) {
+            // Lose this call from the profile rather than fail it.
+            return e->fn(e->name, state, e->argc, e->argv);
+        }
+        frames = bigger;
+        frame_alloc = n;
+    }
+
+    Frame* f = &frames[frame_count++];
+    f->entry = index;
+    f->child_ns = 0;
+    f->start_ns = now_ns();
+
+    Value* v = e->fn(e->name, state, e->argc, e->argv);
+
+    // 'frames' may have moved during the call.
+    f = &frames[--frame_count];
+    uint64_t elapsed = now_ns() - f->start_ns;
+    Entry* en = &entries[index];
+    en->calls++;
+    en->total_ns += elapsed;
+    en->self_ns += elapsed - f->child_ns;
+    if (frame_count > 0) frames[frame_count-1].child_ns += elapsed;
+    return v;
+}
+
+// -----------------------------------------------------------------
+//   reporting
+// -----------------------------------------------------------------
+
+static int compare_entry_start(const void* a, const void* b) {
+    return entries[*(const int*)a].expr->start - entries[*(const int*)b].expr->start;
+}
+
+// Return a malloc'd array of each entry's 1-based line in 'script',
+// found with one pass over it, or NULL if out of memory.
+static int* entry_lines(const char* script) {
+    int* order = malloc(entry_count * sizeof(int));
+    int* lines = malloc(entry_count * sizeof(int));
+    if (order == NULL || lines == NULL) {
+        free(order);
+        free(lines);
+        return NULL;
+    }
+
+    int i;
+    for (i = 0; i < entry_count; ++i) order[i] = i;
+    qsort(order, entry_count, sizeof(int), compare_entry_start);
+    int pos = 0, line = 1;
+    for (i = 0; i < entry_count; ++i) {
+        int start = entries[order[i]].expr->start;
+        for (; pos < start && script[pos] != '\0'; ++pos) {
+            if (script[pos] == '\n') ++line;
+        }
+        lines[order[i]] = line;
+    }
+    free(order);
+    return lines;
+}
+
+static int compare_name_line(const void* a, const void* b) {
+    const ProfileStat* sa = (const ProfileStat*)a;
+    const ProfileStat* sb = (const ProfileStat*)b;
+    int c = strcmp(sa->name, sb->name);
+    return c ? c : sa->line - sb->line;
+}
+
+static int compare_self(const void* a, const void* b) {
+    const ProfileStat* sa = (const ProfileStat*)a;
+    const ProfileStat* sb = (const ProfileStat*)b;
+    if (sa->self_ns != sb->self_ns) return (sa->self_ns > sb->self_ns) ? -1 : 1;
+    return compare_name_line(a, b);
+}
+
+ProfileStat* GetProfile(const char* script, int* count) {
+    *count = 0;
+    if (entry_count == 0) return NULL;
+
+    ProfileStat* stats = malloc(entry_count * sizeof(ProfileStat));
+    if (stats == NULL) return NULL;
+    int* lines = NULL;
+    if (script != NULL && (lines = entry_lines(script)) == NULL) {
+        free(stats);
+        return NULL;
+    }
+
+    int i, n = 0;
+    for (i = 0; i < entry_count; ++i) {
+        const Entry* en = &entries[i];
+        if (en->calls == 0) continue;
+        // A call made inside another of the same name (on the same
+        // line, when going by line) is already in that one's total.
+        bool nested = en->outer >= 0 &&
+                      (lines == NULL || lines[en->outer] == lines[i]);
+        stats[n].name = en->expr->name;
+        stats[n].line = lines ? lines[i] : 0;
+        stats[n].calls = en->calls;
+        stats[n].total_ns = nested ? 0 : en->total_ns;
+        stats[n].self_ns = en->self_ns;
+        stats[n].bytes = en->bytes;
+        ++n;
+    }
+    free(lines);
+
+    // Merge entries with the same name and line.
+    qsort(stats, n, sizeof(ProfileStat), compare_name_line);
+    int out = 0;
+    for (i = 0; i < n; ++i) {
+        if (out > 0 && compare_name_line(&stats[out-1], &stats[i]) == 0) {
+            stats[out-1].calls += stats[i].calls;
+            stats[out-1].total_ns += stats[i].total_ns;
+            stats[out-1].self_ns += stats[i].self_ns;
+            stats[out-1].bytes += stats[i].bytes;
+        } else {
+            stats[out++] = stats[i];
+        }
+    }
+
+    qsort(stats, out, sizeof(ProfileStat), compare_self);
+    *count = out;
+    return stats;
+}
+
+static void print_stat(FILE* out, const ProfileStat* s) {
+    fprintf(out, "%10u %10.1f %10.1f", s->calls,
+            s->total_ns / 1e6, s->self_ns / 1e6);
+    if (s->bytes > 0) {
+        fprintf(out, " %12llu %8.1f", (unsigned long long)s->bytes,
+                s->self_ns ? s->bytes / 1048576.0 / (s->self_ns / 1e9) : 0.0);
+    } else {
+        fprintf(out, " %12s %8s", "-", "-");
+    }
+    fprintf(out, "  %s", s->name);
+    if (s->line > 0) fprintf(out, " (line %d)", s->line);
+    fprintf(out, "\n");
+}
+
+void DumpProfile(FILE* out, const char* script, int max_lines) {
+    int count, i;
+    ProfileStat* stats = GetProfile(NULL, &count);
+    if (stats == NULL) return;
+
+    fprintf(out, "%10s %10s %10s %12s %8s  %s\n",
+            "calls", "total ms", "self ms", "bytes", "MB/s", "function");
+    for (i = 0; i < count; ++i) print_stat(out, &stats[i]);
+    free(stats);
+
+    if (script == NULL || max_lines <= 0) return;
+    stats = GetProfile(script, &count);
+    if (stats == NULL) return;
+    if (count > max_lines) count = max_lines;
+    fprintf(out, "costliest lines:\n");
+    for (i = 0; i < count; ++i) print_stat(out, &stats[i]);
+    free(stats);
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _EDIFY_PROFILE_H
+#define _EDIFY_PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "expr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Function call profiling.  While it is on, every call that goes
+// through Evaluate(), EvaluateValue() or a compiled Program records
+// its call count, wall time and bytes processed against the calling
+// Expr.  The cost is two clock reads and a hash lookup per call, so
+// it can be left on for real installs.
+//
+// Literals and operators ("&&", "==", ";", if/then/else ...) aren't
+// function calls and aren't counted; their time is charged to the
+// function whose argument they are.
+
+// Turn profiling on or off.  Turning it on clears any earlier results.
+void SetProfiling(int enabled);
+
+// Add 'bytes' to the function call currently running.  Functions that
+// move data (extracting files, writing images) call this so their
+// throughput shows up in the profile; it does nothing when profiling
+// is off.
+void RecordBytesProcessed(uint64_t bytes);
+
+typedef struct {
+    const char* name;     // function name (owned by the parse tree)
+    int line;             // 1-based script line, or 0 for a per-function total
+    unsigned calls;
+    uint64_t total_ns;    // wall time, including calls made by the arguments;
+                          // a call nested in one of the same name counts once
+    uint64_t self_ns;     // wall time less that of nested calls
+    uint64_t bytes;
+} ProfileStat;
+
+// Return the profile gathered so far, as a malloc'd array (of *count
+// entries) sorted by decreasing self time.  With 'script' NULL there
+// is one entry per function name; otherwise one per function name and
+// line of 'script' (which must be the text the trees were parsed
+// from).  Returns NULL if there is nothing to report.
+ProfileStat* GetProfile(const char* script, int* count);
+
+// Print a summary of the profile: per-function totals followed by
+// the 'max_lines' costliest script lines.
+void DumpProfile(FILE* out, const char* script, int max_lines);
+
+// --- used by the evaluators ---
+
+extern int gProfiling;
+
+// Call e->fn, recording it in the profile.
+Value* ProfiledCall(State* state, Expr* e);
+
+static inline Value* CallExpr(State* state, Expr* e) {
+    if (gProfiling && e->fn != Literal) return ProfiledCall(state, e);
+    return e->fn(e->name, state, e->argc, e->argv);
+}
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // _EDIFY_PROFILE_H
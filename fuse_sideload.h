@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __FUSE_SIDELOAD_H
+#define __FUSE_SIDELOAD_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// define the filenames created by the sideload FUSE filesystem
+#define FUSE_SIDELOAD_HOST_MOUNTPOINT "/sideload"
+#define FUSE_SIDELOAD_HOST_FILENAME "package.zip"
+#define FUSE_SIDELOAD_HOST_PATHNAME (FUSE_SIDELOAD_HOST_MOUNTPOINT "/" FUSE_SIDELOAD_HOST_FILENAME)
+#define FUSE_SIDELOAD_HOST_EXIT_FLAG "exit"
+#define FUSE_SIDELOAD_HOST_EXIT_PATHNAME (FUSE_SIDELOAD_HOST_MOUNTPOINT "/" FUSE_SIDELOAD_HOST_EXIT_FLAG)
+
+// A provider supplies the contents of the sideloaded file one block
+// at a time.  read_block should fill 'buffer' with 'fetch_size' bytes
+// of block number 'block' (fetch_size is only less than the block
+// size for the last block of the file) and return 0, or return a
+// negative errno value on failure.  close is called once when the
+// filesystem is torn down.
+struct provider_vtab {
+    int (*read_block)(void* cookie, uint32_t block, uint8_t* buffer, uint32_t fetch_size);
+    void (*close)(void* cookie);
+};
+
+// Mount a FUSE filesystem at FUSE_SIDELOAD_HOST_MOUNTPOINT containing
+// a single read-only file of 'file_size' bytes, whose blocks are
+// fetched on demand from 'vtab'.  Blocks are hashed the first time
+// they are read, so a provider that returns different data for the
+// same block on a later read causes that read to fail.  Does not
+// return until something stats FUSE_SIDELOAD_HOST_EXIT_PATHNAME or
+// the filesystem is unmounted.  Returns 0 on a clean exit.
+int run_fuse_sideload(struct provider_vtab* vtab, void* cookie,
+                      uint64_t file_size, uint32_t block_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
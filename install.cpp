@@ -22,6 +22,9 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <string>
+#include <vector>
+
 #include "common.h"
 #include "install.h"
 #include "mincrypt/rsa.h"
@@ -47,7 +50,8 @@ static const float DEFAULT_IMAGE_PROGRESS_FRACTION = 0.1;
 
 // If the package contains an update binary, extract it and run it.
 static int
-try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
+try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache,
+                  std::vector<std::string>* log_buffer) {
     const ZipEntry* binary_entry =
             mzFindZipEntry(zip, ASSUMED_UPDATE_BINARY_NAME);
     if (binary_entry == NULL) {
@@ -106,6 +110,10 @@ try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
     //        ui_print <string>
     //            display <string> on the screen.
     //
+    //        log <string>
+    //            append <string> to the last_install file, after the
+    //            result of the install.
+    //
     //   - the name of the package zip file.
     //
 
@@ -159,6 +167,9 @@ try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
             *wipe_cache = 1;
         } else if (strcmp(command, "clear_display") == 0) {
             ui->SetBackground(RecoveryUI::NONE);
+        } else if (strcmp(command, "log") == 0) {
+            char* str = strtok(NULL, "\n");
+            if (str) log_buffer->push_back(str);
         } else {
             LOGE("unknown command [%s]\n", command);
         }
@@ -176,7 +187,8 @@ try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
 }
 
 static int
-really_install_package(const char *path, int* wipe_cache)
+really_install_package(const char *path, int* wipe_cache, bool needs_mount,
+                       std::vector<std::string>* log_buffer)
 {
     ui->SetBackground(RecoveryUI::INSTALLING_UPDATE);
     ui->Print("Finding update package...\n");
@@ -185,7 +197,7 @@ really_install_package(const char *path, int* wipe_cache)
     ui->ShowProgress(VERIFICATION_PROGRESS_FRACTION, VERIFICATION_PROGRESS_TIME);
     LOGI("Update location: %s\n", path);
 
-    if (ensure_path_mounted(path) != 0) {
+    if (needs_mount && ensure_path_mounted(path) != 0) {
         LOGE("Can't mount %s\n", path);
         return INSTALL_CORRUPT;
     }
@@ -223,11 +235,12 @@ really_install_package(const char *path, int* wipe_cache)
     /* Verify and install the contents of the package.
      */
     ui->Print("Installing update...\n");
-    return try_update_binary(path, &zip, wipe_cache);
+    return try_update_binary(path, &zip, wipe_cache, log_buffer);
 }
 
 int
-install_package(const char* path, int* wipe_cache, const char* install_file)
+install_package(const char* path, int* wipe_cache, const char* install_file,
+                bool needs_mount)
 {
     FILE* install_log = fopen_path(install_file, "w");
     if (install_log) {
@@ -237,15 +250,20 @@ install_package(const char* path, int* wipe_cache, const char* install_file)
         LOGE("failed to open last_install: %s\n", strerror(errno));
     }
     int result;
+    std::vector<std::string> log_buffer;
     if (setup_install_mounts() != 0) {
         LOGE("failed to set up expected mounts for install; aborting\n");
         result = INSTALL_ERROR;
     } else {
-        result = really_install_package(path, wipe_cache);
+        result = really_install_package(path, wipe_cache, needs_mount, &log_buffer);
     }
     if (install_log) {
         fputc(result == INSTALL_SUCCESS ? '1' : '0', install_log);
         fputc('\n', install_log);
+        for (size_t i = 0; i < log_buffer.size(); ++i) {
+            fputs(log_buffer[i].c_str(), install_log);
+            fputc('\n', install_log);
+        }
         fclose(install_log);
     }
     return result;
@@ -26,9 +26,11 @@ extern "C" {
 enum { INSTALL_SUCCESS, INSTALL_ERROR, INSTALL_CORRUPT, INSTALL_NONE };
 // Install the package specified by root_path.  If INSTALL_SUCCESS is
 // returned and *wipe_cache is true on exit, caller should wipe the
-// cache partition.
+// cache partition.  If needs_mount is false, root_path is assumed to
+// be accessible already (e.g. it lives on the sideload filesystem,
+// which isn't in the volume table).
 int install_package(const char *root_path, int* wipe_cache,
-                    const char* install_file);
+                    const char* install_file, bool needs_mount);
 
 #ifdef __cplusplus
 }
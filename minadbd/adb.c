@@ -21,6 +21,7 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <stddef.h>
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
@@ -28,12 +29,12 @@
 #include "sysdeps.h"
 #include "adb.h"
 
-#include <private/android_filesystem_config.h>
-
 #if ADB_TRACE
 ADB_MUTEX_DEFINE( D_lock );
 #endif
 
+ADB_MUTEX_DEFINE( apacket_lock );
+
 int HOST = 0;
 
 static const char *adb_device_banner = "sideload";
@@ -126,16 +127,60 @@ void  adb_trace_init(void)
 }
 
 
+/* Every apacket carries a MAX_PAYLOAD buffer, and one is needed for
+** each message in either direction, so rather than malloc() and
+** free() them per message we keep released packets on a free list.
+** APACKET_POOL_PREALLOC of them are allocated up front (enough for a
+** sideload to stream without allocating at all); the pool grows on
+** demand and retains at most APACKET_POOL_MAX.
+*/
+#define APACKET_POOL_PREALLOC  8
+#define APACKET_POOL_MAX       16
+
+static apacket *apacket_free_list = NULL;
+static unsigned apacket_free_count = 0;
+
+void init_apacket_pool(void)
+{
+    int i;
+    for (i = 0; i < APACKET_POOL_PREALLOC; ++i) {
+        apacket *p = malloc(sizeof(apacket));
+        if(p == 0) fatal("failed to allocate an apacket");
+        put_apacket(p);
+    }
+}
+
 apacket *get_apacket(void)
 {
-    apacket *p = malloc(sizeof(apacket));
-    if(p == 0) fatal("failed to allocate an apacket");
-    memset(p, 0, sizeof(apacket) - MAX_PAYLOAD);
+    apacket *p;
+
+    adb_mutex_lock(&apacket_lock);
+    p = apacket_free_list;
+    if (p != NULL) {
+        apacket_free_list = p->next;
+        apacket_free_count--;
+    }
+    adb_mutex_unlock(&apacket_lock);
+
+    if (p == NULL) {
+        p = malloc(sizeof(apacket));
+        if(p == 0) fatal("failed to allocate an apacket");
+    }
+    memset(p, 0, offsetof(apacket, data));
     return p;
 }
 
 void put_apacket(apacket *p)
 {
+    adb_mutex_lock(&apacket_lock);
+    if (apacket_free_count < APACKET_POOL_MAX) {
+        p->next = apacket_free_list;
+        apacket_free_list = p;
+        apacket_free_count++;
+        p = NULL;
+    }
+    adb_mutex_unlock(&apacket_lock);
+
     free(p);
 }
 
@@ -216,9 +261,9 @@ static void send_connect(atransport *t)
     D("Calling send_connect \n");
     apacket *cp = get_apacket();
     cp->msg.command = A_CNXN;
-    cp->msg.arg0 = A_VERSION;
-    cp->msg.arg1 = MAX_PAYLOAD;
-    snprintf((char*) cp->data, sizeof cp->data, "%s::",
+    cp->msg.arg0 = t->protocol_version;
+    cp->msg.arg1 = t->max_payload;
+    snprintf((char*) cp->data, MAX_PAYLOAD_V1, "%s::",
             HOST ? "host" : adb_device_banner);
     cp->msg.data_length = strlen((char*) cp->data) + 1;
     send_packet(cp, t);
@@ -303,11 +348,17 @@ void handle_packet(apacket *p, atransport *t)
         return;
 
     case A_CNXN: /* CONNECT(version, maxdata, "system-id-string") */
-            /* XXX verify version, etc */
         if(t->connection_state != CS_OFFLINE) {
             t->connection_state = CS_OFFLINE;
             handle_offline(t);
         }
+
+            /* talk the older of the two protocol versions, and never
+            ** send more than the host said it can take */
+        t->protocol_version = p->msg.arg0 < A_VERSION ? p->msg.arg0 : A_VERSION;
+        t->max_payload = p->msg.arg1 < MAX_PAYLOAD ? p->msg.arg1 : MAX_PAYLOAD;
+        D("adb: protocol version %08x, max payload %d\n",
+          t->protocol_version, t->max_payload);
         parse_banner((char*) p->data, t);
         handle_online();
         if(!HOST) send_connect(t);
@@ -379,6 +430,7 @@ static void adb_cleanup(void)
 int adb_main()
 {
     atexit(adb_cleanup);
+    init_apacket_pool();
 #if defined(HAVE_FORKEXEC)
     // No SIGCHLD. Let the service subproc handle its children.
     signal(SIGPIPE, SIG_IGN);
@@ -392,14 +444,9 @@ int adb_main()
         usb_init();
     }
 
-    if (setgid(AID_SHELL) != 0) {
-        fprintf(stderr, "failed to setgid to shell\n");
-        exit(1);
-    }
-    if (setuid(AID_SHELL) != 0) {
-        fprintf(stderr, "failed to setuid to shell\n");
-        exit(1);
-    }
+    // Don't drop privileges: the sideload-host service mounts the
+    // FUSE filesystem that serves the package, which needs root.
+    // Only the sideload services are reachable through this adbd.
     fprintf(stderr, "userid is %d\n", getuid());
 
     D("Event loop starting\n");
@@ -18,11 +18,18 @@
 #define __ADB_H
 
 #include <limits.h>
+#include <stdint.h>
 
 #include "transport.h"  /* readx(), writex() */
 #include "fdevent.h"
 
-#define MAX_PAYLOAD 4096
+/* Hosts older than A_VERSION_SKIP_CHECKSUM only accept packets of
+** up to MAX_PAYLOAD_V1 bytes.  Newer ones tell us in their CNXN how
+** much they can take, and we use the smaller of that and MAX_PAYLOAD
+** (see atransport.max_payload).
+*/
+#define MAX_PAYLOAD_V1  (4*1024)
+#define MAX_PAYLOAD     (256*1024)
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -31,7 +38,9 @@
 #define A_CLSE 0x45534c43
 #define A_WRTE 0x45545257
 
-#define A_VERSION 0x01000000        // ADB protocol version
+#define A_VERSION_MIN           0x01000000  // original protocol
+#define A_VERSION_SKIP_CHECKSUM 0x01000001  // data_check is neither sent nor verified
+#define A_VERSION               0x01000001  // ADB protocol version
 
 #define ADB_VERSION_MAJOR 1         // Used for help/version information
 #define ADB_VERSION_MINOR 0         // Used for help/version information
@@ -187,6 +196,11 @@ struct atransport
     char *product;
     int adb_port; // Use for emulators (local transport)
 
+        /* negotiated from the CNXN messages; until the host's CNXN
+        ** arrives these are A_VERSION_MIN and MAX_PAYLOAD */
+    unsigned protocol_version;
+    unsigned max_payload;
+
         /* a list of adisconnect callbacks called when the transport is kicked */
     int          kicked;
     adisconnect  disconnects;
@@ -280,12 +294,15 @@ void remount_service(int fd, void *cookie);
 char * get_log_file_path(const char * log_name);
 #endif
 
-/* packet allocator */
+/* packet allocator.  Packets are recycled through a free list, so
+** init_apacket_pool() should be called once before any are needed.
+*/
+void init_apacket_pool(void);
 apacket *get_apacket(void);
 void put_apacket(apacket *p);
 
-int check_header(apacket *p);
-int check_data(apacket *p);
+int check_header(apacket *p, atransport *t);
+int check_data(apacket *p, atransport *t);
 
 /* define ADB_TRACE to 1 to enable tracing support, or 0 to disable it */
 
@@ -382,6 +399,16 @@ int usb_read(usb_handle *h, void *data, int len);
 int usb_close(usb_handle *h);
 void usb_kick(usb_handle *h);
 
+#if !ADB_HOST
+/* Wrap an already-open pair of FunctionFS bulk endpoints -- or
+** anything that behaves like them, such as one end of each of two
+** socketpairs -- in a usb_handle, using the AIO backend if 'use_aio'
+** is set and the kernel supports it.  Lets the tests drive both
+** backends without USB hardware.
+*/
+usb_handle *usb_ffs_open_fds(int bulk_out, int bulk_in, int use_aio);
+#endif
+
 /* used for USB device detection */
 #if ADB_HOST
 int is_adb_interface(int vid, int pid, int usb_class, int usb_subclass, int usb_protocol);
@@ -422,4 +449,33 @@ int handle_host_request(char *service, transport_type ttype, char* serial, int r
 
 #define ADB_SIDELOAD_FILENAME "/tmp/update.zip"
 
+/* Bytes moved per step when receiving a legacy "sideload:" package,
+** unless overridden (in bytes) by the ADB_SIDELOAD_CHUNK_PROPERTY
+** system property.
+*/
+#define ADB_SIDELOAD_CHUNK_DEFAULT (256*1024)
+#define ADB_SIDELOAD_CHUNK_MIN     (4*1024)
+#define ADB_SIDELOAD_CHUNK_MAX     (4*1024*1024)
+#define ADB_SIDELOAD_CHUNK_PROPERTY "recovery.sideload.chunk_size"
+
+/* While a "sideload:" package is being received, one of these is
+** written to the progress fd (if there is one) after each chunk.  For
+** "sideload-host", 'received' counts the blocks the host has sent at
+** least once, and a record follows each new one.  Records are much
+** smaller than PIPE_BUF, so they arrive whole.
+*/
+typedef struct sideload_progress {
+    uint64_t received;
+    uint64_t total;
+} sideload_progress;
+
+/* Report sideload progress to 'fd', normally the write end of a pipe
+** from recovery.  Records that don't fit in the pipe are dropped
+** rather than stalling the transfer.
+*/
+void set_sideload_progress_fd(int fd);
+
+/* Write a progress record, if there's a progress fd. */
+void report_sideload_progress(uint64_t received, uint64_t total);
+
 #endif
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Pumps apackets through a loopback transport (a socketpair standing
+ * in for the USB endpoints) the way the transport threads do --
+ * get_apacket(), checksum, header and payload write on one side;
+ * header read, check_header(), payload read, check_data(),
+ * put_apacket() on the other -- and reports the throughput for the
+ * original protocol (4k payloads, checksummed) and the negotiated one
+ * (MAX_PAYLOAD, no checksums).
+ *
+ * usage: adb_packet_benchmark [megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "sysdeps.h"
+
+#define  TRACE_TAG  TRACE_ADB
+#include "adb.h"
+
+typedef struct {
+    int fd;
+    atransport *t;
+    unsigned long long total;
+} pump;
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void *writer_thread(void *arg)
+{
+    pump *w = arg;
+    unsigned long long left = w->total;
+
+    while (left > 0) {
+        apacket *p = get_apacket();
+        unsigned len = (left > w->t->max_payload) ? w->t->max_payload : left;
+        unsigned sum = 0;
+
+        p->msg.command = A_WRTE;
+        p->msg.data_length = len;
+        p->msg.magic = A_WRTE ^ 0xffffffff;
+        if (w->t->protocol_version < A_VERSION_SKIP_CHECKSUM) {
+            unsigned i;
+            for (i = 0; i < len; ++i) sum += p->data[i];
+        }
+        p->msg.data_check = sum;
+
+        if (writex(w->fd, &p->msg, sizeof(amessage)) ||
+            writex(w->fd, p->data, len)) {
+            fatal_errno("loopback write failed");
+        }
+        put_apacket(p);
+        left -= len;
+    }
+    return 0;
+}
+
+static void run(const char *name, unsigned version, unsigned max_payload,
+                unsigned long long total)
+{
+    atransport t;
+    pump w;
+    adb_thread_t thr;
+    int s[2];
+    unsigned long long got = 0;
+    unsigned long long packets = 0;
+
+    memset(&t, 0, sizeof(t));
+    t.protocol_version = version;
+    t.max_payload = max_payload;
+
+    if (adb_socketpair(s)) fatal_errno("cannot create loopback socketpair");
+    w.fd = s[0];
+    w.t = &t;
+    w.total = total;
+
+    double start = now();
+    if (adb_thread_create(&thr, writer_thread, &w)) {
+        fatal_errno("cannot create writer thread");
+    }
+
+    while (got < total) {
+        apacket *p = get_apacket();
+        if (readx(s[1], &p->msg, sizeof(amessage))) fatal("loopback read failed (header)");
+        if (check_header(p, &t)) fatal("check_header failed");
+        if (readx(s[1], p->data, p->msg.data_length)) fatal("loopback read failed (data)");
+        if (check_data(p, &t)) fatal("check_data failed");
+        got += p->msg.data_length;
+        packets++;
+        put_apacket(p);
+    }
+    pthread_join(thr, NULL);
+    double elapsed = now() - start;
+
+    adb_close(s[0]);
+    adb_close(s[1]);
+
+    printf("%-10s payload %6u: %llu packets, %.3f s, %.1f MB/s\n",
+           name, max_payload, packets, elapsed,
+           (total / 1048576.0) / elapsed);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long long megabytes = (argc > 1) ? strtoull(argv[1], NULL, 10) : 256;
+    unsigned long long total = megabytes * 1024 * 1024;
+
+    init_apacket_pool();
+
+    run("v1", A_VERSION_MIN, MAX_PAYLOAD_V1, total);
+    run("current", A_VERSION, MAX_PAYLOAD, total);
+    return 0;
+}
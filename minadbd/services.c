@@ -19,12 +19,17 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <cutils/properties.h>
 
 #include "sysdeps.h"
 #include "fdevent.h"
 
 #define  TRACE_TAG  TRACE_SERVICES
 #include "adb.h"
+#include "fuse_adb_provider.h"
 
 typedef struct stinfo stinfo;
 
@@ -43,13 +48,93 @@ void *service_bootstrap_func(void *x)
     return 0;
 }
 
+static int sideload_progress_fd = -1;
+
+void set_sideload_progress_fd(int fd)
+{
+    sideload_progress_fd = fd;
+    if (fd >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        close_on_exec(fd);
+    }
+}
+
+void report_sideload_progress(uint64_t received, uint64_t total)
+{
+    sideload_progress p;
+
+    if (sideload_progress_fd < 0) return;
+    p.received = received;
+    p.total = total;
+    /* nonblocking: if recovery is behind, it gets the next one */
+    if (adb_write(sideload_progress_fd, &p, sizeof(p)) < 0 &&
+        errno != EAGAIN && errno != EINTR) {
+        adb_close(sideload_progress_fd);
+        sideload_progress_fd = -1;
+    }
+}
+
+static unsigned sideload_chunk_size(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+    unsigned chunk = ADB_SIDELOAD_CHUNK_DEFAULT;
+
+    if (property_get(ADB_SIDELOAD_CHUNK_PROPERTY, value, NULL) > 0) {
+        chunk = strtoul(value, NULL, 0);
+        if (chunk < ADB_SIDELOAD_CHUNK_MIN) chunk = ADB_SIDELOAD_CHUNK_MIN;
+        if (chunk > ADB_SIDELOAD_CHUNK_MAX) chunk = ADB_SIDELOAD_CHUNK_MAX;
+    }
+    return chunk;
+}
+
+/* Move up to 'xfer' bytes from the socket to the file through a pipe,
+ * without copying them through userspace.  Returns the number of
+ * bytes moved, 0 at EOF, or -1 with errno set.  EINVAL from the first
+ * splice means the kernel can't splice from this socket.
+ */
+static int splice_chunk(int s, int pipefd[2], int fd, unsigned xfer)
+{
+    ssize_t n, left;
+
+    do {
+        n = splice(s, NULL, pipefd[1], NULL, xfer, SPLICE_F_MOVE | SPLICE_F_MORE);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return n;
+
+    for (left = n; left > 0; ) {
+        ssize_t w = splice(pipefd[0], NULL, fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        left -= w;
+    }
+    return n;
+}
+
+static int copy_chunk(int s, char *buf, int fd, unsigned xfer)
+{
+    int n;
+
+    do {
+        n = adb_read(s, buf, xfer);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return n;
+    if (writex(fd, buf, n)) return -1;
+    return n;
+}
+
 static void sideload_service(int s, void *cookie)
 {
-    unsigned char buf[4096];
-    unsigned count = (unsigned)(uintptr_t)cookie;
+    unsigned total = (unsigned)(uintptr_t)cookie;
+    unsigned count = total;
+    unsigned chunk = sideload_chunk_size();
+    int pipefd[2] = { -1, -1 };
+    char *buf = NULL;
+    struct timespec start, end;
+    double elapsed;
     int fd;
 
-    fprintf(stderr, "sideload_service invoked\n");
+    fprintf(stderr, "sideload_service invoked (chunk size %u)\n", chunk);
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     fd = adb_creat(ADB_SIDELOAD_FILENAME, 0644);
     if(fd < 0) {
@@ -58,11 +143,49 @@ static void sideload_service(int s, void *cookie)
         return;
     }
 
+    if (pipe(pipefd) == 0) {
+#ifdef F_SETPIPE_SZ
+        /* let a whole chunk sit in the pipe; best effort */
+        fcntl(pipefd[1], F_SETPIPE_SZ, chunk);
+#endif
+    } else {
+        pipefd[0] = pipefd[1] = -1;
+    }
+
+    report_sideload_progress(0, total);
     while(count > 0) {
-        unsigned xfer = (count > 4096) ? 4096 : count;
-        if(readx(s, buf, xfer)) break;
-        if(writex(fd, buf, xfer)) break;
-        count -= xfer;
+        unsigned xfer = (count > chunk) ? chunk : count;
+        int n;
+
+        if (pipefd[0] >= 0) {
+            n = splice_chunk(s, pipefd, fd, xfer);
+            if (n < 0 && errno == EINVAL && count == total) {
+                fprintf(stderr, "can't splice from adb socket; copying\n");
+                adb_close(pipefd[0]);
+                adb_close(pipefd[1]);
+                pipefd[0] = pipefd[1] = -1;
+                continue;
+            }
+        } else {
+            if (buf == NULL && (buf = malloc(chunk)) == NULL) break;
+            n = copy_chunk(s, buf, fd, xfer);
+        }
+        if (n <= 0) break;
+
+        count -= n;
+        report_sideload_progress(total - count, total);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "sideload received %u of %u bytes in %.3f s (%.0f KB/s)\n",
+            total - count, total, elapsed,
+            elapsed > 0 ? (total - count) / elapsed / 1024 : 0.0);
+
+    free(buf);
+    if (pipefd[0] >= 0) {
+        adb_close(pipefd[0]);
+        adb_close(pipefd[1]);
     }
 
     if(count == 0) {
@@ -81,6 +204,28 @@ static void sideload_service(int s, void *cookie)
 }
 
 
+static void sideload_host_service(int sfd, void* cookie)
+{
+    char* args = cookie;
+    unsigned long long file_size;
+    unsigned block_size;
+    int result = -1;
+
+    if (sscanf(args, "%llu:%u", &file_size, &block_size) != 2) {
+        fprintf(stderr, "bad sideload-host arguments \"%s\"\n", args);
+    } else {
+        fprintf(stderr, "sideload-host file size %llu block size %u\n",
+                file_size, block_size);
+        result = run_adb_fuse(sfd, file_size, block_size);
+    }
+    free(args);
+    adb_close(sfd);
+
+    fprintf(stderr, "sideload-host finished (%d)\n", result);
+    sleep(1);
+    exit(result == 0 ? 0 : 1);
+}
+
 #if 0
 static void echo_service(int fd, void *cookie)
 {
@@ -150,6 +295,9 @@ int service_to_fd(const char *name)
 
     if (!strncmp(name, "sideload:", 9)) {
         ret = create_service_thread(sideload_service, (void*)(uintptr_t)atoi(name + 9));
+    } else if (!strncmp(name, "sideload-host:", 14)) {
+        char* arg = strdup(name + 14);
+        ret = create_service_thread(sideload_host_service, arg);
 #if 0
     } else if(!strncmp(name, "echo:", 5)){
         ret = create_service_thread(echo_service, 0);
@@ -217,16 +217,6 @@ void send_packet(apacket *p, atransport *t)
 
     p->msg.magic = p->msg.command ^ 0xffffffff;
 
-    count = p->msg.data_length;
-    x = (unsigned char *) p->data;
-    sum = 0;
-    while(count-- > 0){
-        sum += *x++;
-    }
-    p->msg.data_check = sum;
-
-    print_packet("send", p);
-
     if (t == NULL) {
         D("Transport is null \n");
         // Zap errno because print_packet() and other stuff have errno effect.
@@ -234,6 +224,18 @@ void send_packet(apacket *p, atransport *t)
         fatal_errno("Transport is null");
     }
 
+    sum = 0;
+    if (t->protocol_version < A_VERSION_SKIP_CHECKSUM) {
+        count = p->msg.data_length;
+        x = (unsigned char *) p->data;
+        while(count-- > 0){
+            sum += *x++;
+        }
+    }
+    p->msg.data_check = sum;
+
+    print_packet("send", p);
+
     if(write_packet(t->transport_socket, t->serial, &p)){
         fatal_errno("cannot enqueue packet on transport socket");
     }
@@ -768,26 +770,30 @@ int writex(int fd, const void *ptr, size_t len)
     return 0;
 }
 
-int check_header(apacket *p)
+int check_header(apacket *p, atransport *t)
 {
     if(p->msg.magic != (p->msg.command ^ 0xffffffff)) {
         D("check_header(): invalid magic\n");
         return -1;
     }
 
-    if(p->msg.data_length > MAX_PAYLOAD) {
-        D("check_header(): %d > MAX_PAYLOAD\n", p->msg.data_length);
+    if(p->msg.data_length > t->max_payload) {
+        D("check_header(): %d > max_payload %d\n", p->msg.data_length, t->max_payload);
         return -1;
     }
 
     return 0;
 }
 
-int check_data(apacket *p)
+int check_data(apacket *p, atransport *t)
 {
     unsigned count, sum;
     unsigned char *x;
 
+    if (t->protocol_version >= A_VERSION_SKIP_CHECKSUM) {
+        return 0;
+    }
+
     count = p->msg.data_length;
     x = p->data;
     sum = 0;
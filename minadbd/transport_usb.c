@@ -55,7 +55,7 @@ static int remote_read(apacket *p, atransport *t)
 
     fix_endians(p);
 
-    if(check_header(p)) {
+    if(check_header(p, t)) {
         D("remote usb: check_header failed\n");
         return -1;
     }
@@ -67,7 +67,7 @@ static int remote_read(apacket *p, atransport *t)
         }
     }
 
-    if(check_data(p)) {
+    if(check_data(p, t)) {
         D("remote usb: check_data failed\n");
         return -1;
     }
@@ -114,6 +114,8 @@ void init_usb_transport(atransport *t, usb_handle *h, int state)
     t->write_to_remote = remote_write;
     t->sync_token = 1;
     t->connection_state = state;
+    t->protocol_version = A_VERSION_MIN;
+    t->max_payload = MAX_PAYLOAD;
     t->type = kTransportUsb;
     t->usb = h;
 
@@ -19,9 +19,12 @@
 #include <unistd.h>
 #include <string.h>
 
+#include <linux/aio_abi.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb/functionfs.h>
+#include <stdint.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <errno.h>
@@ -34,9 +37,47 @@
 #define MAX_PACKET_SIZE_FS	64
 #define MAX_PACKET_SIZE_HS	512
 
+/* The legacy f_adb driver rejects reads larger than its 4096-byte
+ * bulk buffer, and some FunctionFS kernels fail transfers larger than
+ * 16k, so payloads bigger than that are split into several syscalls.
+ */
+#define USB_ADB_MAX_READ	4096
+#define USB_FFS_MAX_XFER	16384
+
+/* Number of USB_FFS_MAX_XFER transfers the AIO backend keeps queued
+ * on each FunctionFS bulk endpoint.
+ */
+#define USB_FFS_AIO_DEPTH	8
+
 #define cpu_to_le16(x)  htole16(x)
 #define cpu_to_le32(x)  htole32(x)
 
+enum { AIO_IDLE, AIO_SUBMITTED, AIO_DONE };
+
+struct usb_aio_block
+{
+    struct iocb iocb;
+    char *buf;
+    int state;        /* AIO_IDLE, AIO_SUBMITTED or AIO_DONE */
+    long res;         /* once AIO_DONE: bytes transferred, or -errno */
+    long consumed;    /* bytes of a completed read already returned */
+};
+
+/* A ring of transfers on one endpoint.  Transfers on a bulk endpoint
+ * complete in the order they were queued, so 'next' always names the
+ * oldest one: the next to be consumed (reads) or reused (writes).
+ * 'ctx' and 'users' are guarded by the handle's lock; ctx is 0 once
+ * usb_ffs_kick() has torn the ring down, and 'users' counts the reads
+ * or writes still working on it.
+ */
+struct usb_aio_ep
+{
+    aio_context_t ctx;
+    int users;
+    int next;
+    struct usb_aio_block blocks[USB_FFS_AIO_DEPTH];
+};
+
 struct usb_handle
 {
     int fd;
@@ -50,8 +91,14 @@ struct usb_handle
     int control;
     int bulk_out; /* "out" from the host's perspective => source for adbd */
     int bulk_in;  /* "in" from the host's perspective => sink for adbd */
+
+    /* asynchronous backend state; NULL when using blocking I/O */
+    struct usb_aio_ep *aio_out;
+    struct usb_aio_ep *aio_in;
 };
 
+static void usb_ffs_select_backend(usb_handle *h);
+
 static const struct {
     struct usb_functionfs_descs_head header;
     struct {
@@ -201,14 +248,20 @@ static int usb_adb_write(usb_handle *h, const void *data, int len)
 
 static int usb_adb_read(usb_handle *h, void *data, int len)
 {
+    char *buf = data;
     int n;
 
     D("about to read (fd=%d, len=%d)\n", h->fd, len);
-    n = adb_read(h->fd, data, len);
-    if(n != len) {
-        D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
-            h->fd, n, errno, strerror(errno));
-        return -1;
+    while (len > 0) {
+        int xfer = (len > USB_ADB_MAX_READ) ? USB_ADB_MAX_READ : len;
+        n = adb_read(h->fd, buf, xfer);
+        if(n != xfer) {
+            D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
+                h->fd, n, errno, strerror(errno));
+            return -1;
+        }
+        buf += n;
+        len -= n;
     }
     D("[ done fd=%d ]\n", h->fd);
     return 0;
@@ -336,6 +389,7 @@ static void *usb_ffs_open_thread(void *x)
 
             adb_sleep_ms(1000);
         }
+        usb_ffs_select_backend(usb);
 
         D("[ usb_thread - registering device ]\n");
         register_usb_transport(usb, 0, 1);
@@ -351,7 +405,9 @@ static int bulk_write(int bulk_in, const char *buf, size_t length)
     int ret;
 
     do {
-        ret = adb_write(bulk_in, buf + count, length - count);
+        size_t xfer = length - count;
+        if (xfer > USB_FFS_MAX_XFER) xfer = USB_FFS_MAX_XFER;
+        ret = adb_write(bulk_in, buf + count, xfer);
         if (ret < 0) {
             if (errno != EINTR)
                 return ret;
@@ -385,7 +441,9 @@ static int bulk_read(int bulk_out, char *buf, size_t length)
     int ret;
 
     do {
-        ret = adb_read(bulk_out, buf + count, length - count);
+        size_t xfer = length - count;
+        if (xfer > USB_FFS_MAX_XFER) xfer = USB_FFS_MAX_XFER;
+        ret = adb_read(bulk_out, buf + count, xfer);
         if (ret < 0) {
             if (errno != EINTR) {
                 D("[ bulk_read failed fd=%d length=%zu count=%zu ]\n",
@@ -415,6 +473,354 @@ static int usb_ffs_read(usb_handle *h, void *data, int len)
     return 0;
 }
 
+/* Asynchronous FunctionFS backend.  Rather than one blocking
+ * read()/write() at a time, keep USB_FFS_AIO_DEPTH transfers queued on
+ * each endpoint with io_submit(), so the controller always has a
+ * buffer to fill (or drain) while adbd is busy with the last one.
+ * Kernels whose FunctionFS doesn't support AIO fail the first
+ * io_submit() with EINVAL, and we drop back to usb_ffs_read() and
+ * usb_ffs_write() for good.
+ */
+
+static int sys_io_setup(unsigned nr, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+static int sys_io_destroy(aio_context_t ctx)
+{
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static int sys_io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static int sys_io_getevents(aio_context_t ctx, long min_nr, long max_nr,
+                            struct io_event *events)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, max_nr, events, NULL);
+}
+
+static struct usb_aio_ep *aio_ep_alloc(unsigned opcode)
+{
+    struct usb_aio_ep *ep = calloc(1, sizeof(struct usb_aio_ep));
+    int i;
+
+    if (ep == NULL) return NULL;
+    for (i = 0; i < USB_FFS_AIO_DEPTH; ++i) {
+        struct usb_aio_block *b = &ep->blocks[i];
+        b->buf = malloc(USB_FFS_MAX_XFER);
+        if (b->buf == NULL) {
+            while (--i >= 0) free(ep->blocks[i].buf);
+            free(ep);
+            return NULL;
+        }
+        b->iocb.aio_lio_opcode = opcode;
+        b->iocb.aio_buf = (uint64_t)(uintptr_t)b->buf;
+        b->iocb.aio_data = i;
+    }
+    return ep;
+}
+
+/* (Re)bind the ring to a freshly opened endpoint.  Called with the
+ * handle's lock held and no users left.
+ */
+static int aio_ep_start(struct usb_aio_ep *ep, int fd)
+{
+    int i;
+
+    ep->ctx = 0;
+    if (sys_io_setup(USB_FFS_AIO_DEPTH, &ep->ctx) < 0) {
+        D("[ io_setup failed: errno=%d ]\n", errno);
+        return -1;
+    }
+    ep->next = 0;
+    for (i = 0; i < USB_FFS_AIO_DEPTH; ++i) {
+        ep->blocks[i].iocb.aio_fildes = fd;
+        ep->blocks[i].state = AIO_IDLE;
+    }
+    return 0;
+}
+
+/* Cancel everything in flight.  Any thread blocked in
+ * aio_ep_wait() gets an error back.  Called with the handle's lock
+ * held.
+ */
+static void aio_ep_stop(struct usb_aio_ep *ep)
+{
+    if (ep->ctx != 0) {
+        sys_io_destroy(ep->ctx);
+        ep->ctx = 0;
+    }
+}
+
+/* Take the ring's context for one read or write.  Fails once the
+ * ring has been stopped.
+ */
+static int aio_ep_get(usb_handle *h, struct usb_aio_ep *ep, aio_context_t *ctx)
+{
+    int r = -1;
+
+    adb_mutex_lock(&h->lock);
+    if (ep->ctx != 0) {
+        *ctx = ep->ctx;
+        ep->users++;
+        r = 0;
+    }
+    adb_mutex_unlock(&h->lock);
+    return r;
+}
+
+static void aio_ep_put(usb_handle *h, struct usb_aio_ep *ep)
+{
+    adb_mutex_lock(&h->lock);
+    if (--ep->users == 0) {
+        // usb_ffs_select_backend may be waiting to reuse the ring
+        adb_cond_signal(&h->notify);
+    }
+    adb_mutex_unlock(&h->lock);
+}
+
+/* Whether 'ctx' has been torn down by usb_ffs_kick().  An io_submit()
+ * on a destroyed context fails with EINVAL too, which must not be
+ * taken for a kernel without FunctionFS AIO.
+ */
+static int aio_ep_kicked(usb_handle *h, struct usb_aio_ep *ep, aio_context_t ctx)
+{
+    int saved_errno = errno;
+    int kicked;
+
+    adb_mutex_lock(&h->lock);
+    kicked = ep->ctx != ctx;
+    adb_mutex_unlock(&h->lock);
+    errno = saved_errno;
+    return kicked;
+}
+
+static int aio_ep_busy(struct usb_aio_ep *ep)
+{
+    int i;
+    for (i = 0; i < USB_FFS_AIO_DEPTH; ++i) {
+        if (ep->blocks[i].state == AIO_SUBMITTED) return 1;
+    }
+    return 0;
+}
+
+/* Reap completions until block 'b' has finished. */
+static int aio_ep_wait(aio_context_t ctx, struct usb_aio_ep *ep,
+                       struct usb_aio_block *b)
+{
+    struct io_event events[USB_FFS_AIO_DEPTH];
+    int i, n;
+
+    while (b->state == AIO_SUBMITTED) {
+        n = sys_io_getevents(ctx, 1, USB_FFS_AIO_DEPTH, events);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            D("[ io_getevents failed: errno=%d ]\n", errno);
+            return -1;
+        }
+        for (i = 0; i < n; ++i) {
+            struct usb_aio_block *done = &ep->blocks[events[i].data];
+            done->res = events[i].res;
+            done->consumed = 0;
+            done->state = AIO_DONE;
+        }
+    }
+    return 0;
+}
+
+/* Queue a read on every idle block.  Idle blocks are always the
+ * newest ones in the ring, so walking from 'next' keeps submission
+ * order equal to ring order.
+ */
+static int aio_ep_fill(aio_context_t ctx, struct usb_aio_ep *ep)
+{
+    struct iocb *iocbs[USB_FFS_AIO_DEPTH];
+    struct usb_aio_block *blocks[USB_FFS_AIO_DEPTH];
+    int i, n = 0, r;
+
+    for (i = 0; i < USB_FFS_AIO_DEPTH; ++i) {
+        struct usb_aio_block *b = &ep->blocks[(ep->next + i) % USB_FFS_AIO_DEPTH];
+        if (b->state != AIO_IDLE) continue;
+        b->iocb.aio_nbytes = USB_FFS_MAX_XFER;
+        blocks[n] = b;
+        iocbs[n++] = &b->iocb;
+    }
+    if (n == 0) return 0;
+
+    r = sys_io_submit(ctx, n, iocbs);
+    if (r < 0) {
+        D("[ io_submit failed: errno=%d ]\n", errno);
+        return -1;
+    }
+    for (i = 0; i < r; ++i) {
+        blocks[i]->state = AIO_SUBMITTED;
+    }
+    return 0;
+}
+
+static int usb_ffs_aio_read(usb_handle *h, void *data, int len)
+{
+    struct usb_aio_ep *ep = h->aio_out;
+    aio_context_t ctx;
+    char *buf = data;
+    int r = 0;
+
+    D("about to aio read (fd=%d, len=%d)\n", h->bulk_out, len);
+    if (aio_ep_get(h, ep, &ctx) < 0) {
+        D("ERROR: fd = %d, aio read after kick\n", h->bulk_out);
+        return -1;
+    }
+    while (len > 0) {
+        struct usb_aio_block *b = &ep->blocks[ep->next];
+        long n;
+
+        if (aio_ep_fill(ctx, ep) < 0) {
+            if (errno == EINVAL && !aio_ep_busy(ep) && b->state == AIO_IDLE &&
+                !aio_ep_kicked(h, ep, ctx)) {
+                D("[ FunctionFS AIO not supported; using blocking reads ]\n");
+                aio_ep_put(h, ep);
+                h->read = usb_ffs_read;
+                return usb_ffs_read(h, buf, len);
+            }
+            if (b->state == AIO_IDLE) {
+                r = -1;
+                break;
+            }
+        }
+        if (aio_ep_wait(ctx, ep, b) < 0) {
+            r = -1;
+            break;
+        }
+        if (b->res < 0) {
+            D("ERROR: fd = %d, aio read failed (%ld)\n", h->bulk_out, b->res);
+            b->state = AIO_IDLE;
+            r = -1;
+            break;
+        }
+
+        n = b->res - b->consumed;
+        if (n > len) n = len;
+        memcpy(buf, b->buf + b->consumed, n);
+        b->consumed += n;
+        buf += n;
+        len -= n;
+
+        if (b->consumed == b->res) {
+            b->state = AIO_IDLE;
+            ep->next = (ep->next + 1) % USB_FFS_AIO_DEPTH;
+        }
+    }
+    aio_ep_put(h, ep);
+    if (r == 0) D("[ done fd=%d ]\n", h->bulk_out);
+    return r;
+}
+
+/* Retire a finished write, failing if it didn't send everything. */
+static int aio_write_done(int fd, struct usb_aio_block *b)
+{
+    b->state = AIO_IDLE;
+    if (b->res != (long)b->iocb.aio_nbytes) {
+        D("ERROR: fd = %d, aio write failed (%ld)\n", fd, b->res);
+        return -1;
+    }
+    return 0;
+}
+
+static int usb_ffs_aio_write(usb_handle *h, const void *data, int len)
+{
+    struct usb_aio_ep *ep = h->aio_in;
+    aio_context_t ctx;
+    const char *buf = data;
+    int i, r = 0;
+
+    D("about to aio write (fd=%d, len=%d)\n", h->bulk_in, len);
+    if (aio_ep_get(h, ep, &ctx) < 0) {
+        D("ERROR: fd = %d, aio write after kick\n", h->bulk_in);
+        return -1;
+    }
+    while (len > 0) {
+        struct usb_aio_block *b = &ep->blocks[ep->next];
+        struct iocb *iocb = &b->iocb;
+        int xfer = (len > USB_FFS_MAX_XFER) ? USB_FFS_MAX_XFER : len;
+
+        // with the ring full, reuse the oldest block once it's sent
+        if (b->state != AIO_IDLE) {
+            if (aio_ep_wait(ctx, ep, b) < 0 || aio_write_done(h->bulk_in, b) < 0) {
+                r = -1;
+                break;
+            }
+        }
+
+        memcpy(b->buf, buf, xfer);
+        b->iocb.aio_nbytes = xfer;
+        if (sys_io_submit(ctx, 1, &iocb) != 1) {
+            if (errno == EINVAL && !aio_ep_busy(ep) && !aio_ep_kicked(h, ep, ctx)) {
+                D("[ FunctionFS AIO not supported; using blocking writes ]\n");
+                aio_ep_put(h, ep);
+                h->write = usb_ffs_write;
+                return usb_ffs_write(h, buf, len);
+            }
+            D("ERROR: fd = %d, io_submit failed: errno=%d\n", h->bulk_in, errno);
+            r = -1;
+            break;
+        }
+        b->state = AIO_SUBMITTED;
+        ep->next = (ep->next + 1) % USB_FFS_AIO_DEPTH;
+
+        buf += xfer;
+        len -= xfer;
+    }
+
+    /* Don't return until everything queued here has gone out, so a
+     * failed transfer is reported by the write it belongs to.  Its
+     * transfers still overlap each other.
+     */
+    for (i = 0; i < USB_FFS_AIO_DEPTH; ++i) {
+        struct usb_aio_block *b = &ep->blocks[(ep->next + i) % USB_FFS_AIO_DEPTH];
+        if (b->state == AIO_IDLE) continue;
+        if (aio_ep_wait(ctx, ep, b) < 0) {
+            r = -1;
+            break;
+        }
+        if (aio_write_done(h->bulk_in, b) < 0) r = -1;
+    }
+    aio_ep_put(h, ep);
+    if (r == 0) D("[ done fd=%d ]\n", h->bulk_in);
+    return r;
+}
+
+/* Pick the backend for a newly opened pair of endpoints: AIO if the
+ * handle was set up for it and the kernel gives us contexts, the
+ * blocking calls otherwise.
+ */
+static void usb_ffs_select_backend(usb_handle *h)
+{
+    h->read = usb_ffs_read;
+    h->write = usb_ffs_write;
+
+    if (h->aio_out == NULL || h->aio_in == NULL) return;
+
+    adb_mutex_lock(&h->lock);
+    // let reads and writes still failing on the last connection finish
+    while (h->aio_out->users > 0 || h->aio_in->users > 0)
+        adb_cond_wait(&h->notify, &h->lock);
+
+    if (aio_ep_start(h->aio_out, h->bulk_out) == 0) {
+        if (aio_ep_start(h->aio_in, h->bulk_in) == 0) {
+            D("[ usb - using FunctionFS AIO ]\n");
+            h->read = usb_ffs_aio_read;
+            h->write = usb_ffs_aio_write;
+        } else {
+            aio_ep_stop(h->aio_out);
+        }
+    }
+    adb_mutex_unlock(&h->lock);
+}
+
 static void usb_ffs_kick(usb_handle *h)
 {
     int err;
@@ -428,6 +834,10 @@ static void usb_ffs_kick(usb_handle *h)
         D("[ kick: sink (fd=%d) clear halt failed (%d) ]", h->bulk_out, errno);
 
     adb_mutex_lock(&h->lock);
+    // cancel queued transfers before their endpoints go away
+    if (h->aio_out) aio_ep_stop(h->aio_out);
+    if (h->aio_in) aio_ep_stop(h->aio_in);
+
     adb_close(h->control);
     adb_close(h->bulk_out);
     adb_close(h->bulk_in);
@@ -438,14 +848,12 @@ static void usb_ffs_kick(usb_handle *h)
     adb_mutex_unlock(&h->lock);
 }
 
-static void usb_ffs_init()
+static usb_handle *usb_ffs_alloc(int use_aio)
 {
     usb_handle *h;
-    adb_thread_t tid;
-
-    D("[ usb_init - using FunctionFS ]\n");
 
     h = calloc(1, sizeof(usb_handle));
+    if (h == NULL) fatal("cannot allocate usb handle");
 
     h->write = usb_ffs_write;
     h->read = usb_ffs_read;
@@ -453,11 +861,38 @@ static void usb_ffs_init()
 
     h->control  = -1;
     h->bulk_out = -1;
-    h->bulk_out = -1;
+    h->bulk_in  = -1;
+
+    if (use_aio) {
+        h->aio_out = aio_ep_alloc(IOCB_CMD_PREAD);
+        h->aio_in = aio_ep_alloc(IOCB_CMD_PWRITE);
+    }
 
     adb_cond_init(&h->notify, 0);
     adb_mutex_init(&h->lock, 0);
 
+    return h;
+}
+
+usb_handle *usb_ffs_open_fds(int bulk_out, int bulk_in, int use_aio)
+{
+    usb_handle *h = usb_ffs_alloc(use_aio);
+
+    h->bulk_out = bulk_out;
+    h->bulk_in = bulk_in;
+    usb_ffs_select_backend(h);
+    return h;
+}
+
+static void usb_ffs_init()
+{
+    usb_handle *h;
+    adb_thread_t tid;
+
+    D("[ usb_init - using FunctionFS ]\n");
+
+    h = usb_ffs_alloc(1);
+
     D("[ usb_init - starting thread ]\n");
     if (adb_thread_create(&tid, usb_ffs_open_thread, h)){
         fatal_errno("[ cannot create usb thread ]\n");
@@ -19,6 +19,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <stddef.h>
 #include <string.h>
 #include <strings.h>
 #include "Retouch.h"
@@ -32,78 +33,57 @@ typedef struct {
 #define false 0
 #define true 1
 
-static int32_t offs_prev;
-static uint32_t cont_prev;
-
-static void init_compression_state(void) {
-    offs_prev = 0;
-    cont_prev = 0;
-}
+// Decoder state: where we are in the encoded relocation list, and the
+// previous entry, from which the compact forms are deltas.  Kept per
+// call rather than in statics so that several threads can mask at once.
+typedef struct {
+    const uint8_t *next;
+    const uint8_t *end;
+    int32_t offs_prev;
+    uint32_t cont_prev;
+} decoder_state_t;
 
 // For details on the encoding used for relocation lists, please
 // refer to build/tools/retouch/retouch-prepare.c. The intent is to
 // save space by removing most of the inherent redundancy.
-
-static void decode_bytes(uint8_t *encoded_bytes, int encoded_size,
-                         int32_t *dst_offset, uint32_t *dst_contents) {
-    if (encoded_size == 2) {
-        *dst_offset = offs_prev + (((encoded_bytes[0]&0x60)>>5)+1)*4;
+//
+// Decode the next entry straight out of the list.  Returns -1 if it
+// runs past the end.
+static inline int decode_next(decoder_state_t *state,
+                              int32_t *dst_offset, uint32_t *dst_contents) {
+    const uint8_t *p = state->next;
+    ptrdiff_t left = state->end - p;
+
+    if (p[0] & 0x80) {
+        if (left < 2) return -1;
+        *dst_offset = state->offs_prev + (((p[0]&0x60)>>5)+1)*4;
 
         // if the original was negative, we need to 1-pad before applying delta
-        int32_t tmp = (((encoded_bytes[0] & 0x0000001f) << 8) |
-                       encoded_bytes[1]);
+        int32_t tmp = (((p[0] & 0x0000001f) << 8) | p[1]);
         if (tmp & 0x1000) tmp = 0xffffe000 | tmp;
-        *dst_contents = cont_prev + tmp;
-    } else if (encoded_size == 3) {
-        *dst_offset = offs_prev + (((encoded_bytes[0]&0x30)>>4)+1)*4;
+        *dst_contents = state->cont_prev + tmp;
+        p += 2;
+    } else if (p[0] & 0x40) {
+        if (left < 3) return -1;
+        *dst_offset = state->offs_prev + (((p[0]&0x30)>>4)+1)*4;
 
         // if the original was negative, we need to 1-pad before applying delta
-        int32_t tmp = (((encoded_bytes[0] & 0x0000000f) << 16) |
-                       (encoded_bytes[1] << 8) |
-                       encoded_bytes[2]);
+        int32_t tmp = (((p[0] & 0x0000000f) << 16) | (p[1] << 8) | p[2]);
         if (tmp & 0x80000) tmp = 0xfff00000 | tmp;
-        *dst_contents = cont_prev + tmp;
+        *dst_contents = state->cont_prev + tmp;
+        p += 3;
     } else {
-        *dst_offset =
-          (encoded_bytes[0]<<24) |
-          (encoded_bytes[1]<<16) |
-          (encoded_bytes[2]<<8) |
-          encoded_bytes[3];
+        if (left < 8) return -1;
+        *dst_offset = (p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3];
         if (*dst_offset == 0x3fffffff) *dst_offset = -1;
-        *dst_contents =
-          (encoded_bytes[4]<<24) |
-          (encoded_bytes[5]<<16) |
-          (encoded_bytes[6]<<8) |
-          encoded_bytes[7];
-    }
-}
-
-static uint8_t *decode_in_memory(uint8_t *encoded_bytes,
-                                 int32_t *offset, uint32_t *contents) {
-    int input_size, charIx;
-    uint8_t input[8];
-
-    input[0] = *(encoded_bytes++);
-    if (input[0] & 0x80)
-        input_size = 2;
-    else if (input[0] & 0x40)
-        input_size = 3;
-    else
-        input_size = 8;
-
-    // we already read one byte..
-    charIx = 1;
-    while (charIx < input_size) {
-        input[charIx++] = *(encoded_bytes++);
+        *dst_contents = (p[4]<<24) | (p[5]<<16) | (p[6]<<8) | p[7];
+        p += 8;
     }
 
-    // depends on the decoder state!
-    decode_bytes(input, input_size, offset, contents);
-
-    offs_prev = *offset;
-    cont_prev = *contents;
-
-    return encoded_bytes;
+    state->next = p;
+    state->offs_prev = *dst_offset;
+    state->cont_prev = *dst_contents;
+    return 0;
 }
 
 int retouch_mask_data(uint8_t *binary_object,
@@ -138,20 +118,26 @@ int retouch_mask_data(uint8_t *binary_object,
                b_offs, r_offs, r_info->blob_size);
         return RETOUCH_DATA_ERROR;
     }
-    uint8_t *b_ptr = binary_object+b_offs;
+    decoder_state_t state;
+    state.next = binary_object+b_offs;
+    state.end = (const uint8_t *)r_info;
+    state.offs_prev = 0;
+    state.cont_prev = 0;
 
     // Retouched: let's go through the work then.
     int32_t offset_candidate = target_offset;
     bool offset_set = false, offset_mismatch = false;
-    init_compression_state();
-    while (b_ptr < (uint8_t *)r_info) {
+    while (state.next < state.end) {
         int32_t retouch_entry_offset;
         uint32_t *retouch_entry;
         uint32_t retouch_original_value;
 
-        b_ptr = decode_in_memory(b_ptr,
-                                 &retouch_entry_offset,
-                                 &retouch_original_value);
+        if (decode_next(&state, &retouch_entry_offset,
+                        &retouch_original_value) < 0) {
+            printf("b_ptr went too far: %p, while r_info is %p",
+                   state.next, r_info);
+            return RETOUCH_DATA_ERROR;
+        }
         if (retouch_entry_offset < (-1) ||
             retouch_entry_offset >= b_offs) {
             printf("bad retouch_entry_offset: %d", retouch_entry_offset);
@@ -165,8 +151,12 @@ int retouch_mask_data(uint8_t *binary_object,
         else
             retouch_entry = (uint32_t *)(binary_object+retouch_entry_offset);
 
-        if (desired_offset)
+        if (desired_offset) {
+            // Every entry then shifts by exactly target_offset; there's
+            // nothing to infer.
             *retouch_entry = retouch_original_value + target_offset;
+            continue;
+        }
 
         // Infer the randomization shift, compare to previously inferred.
         int32_t offset_of_this_entry = (int32_t)(*retouch_entry-
@@ -184,11 +174,6 @@ int retouch_mask_data(uint8_t *binary_object,
             }
         }
     }
-    if (b_ptr > (uint8_t *)r_info) {
-        printf("b_ptr went too far: %p, while r_info is %p",
-               b_ptr, r_info);
-        return RETOUCH_DATA_ERROR;
-    }
 
     if (offset_mismatch) return RETOUCH_DATA_MISMATCHED;
     if (retouch_offset != NULL) *retouch_offset = offset_candidate;
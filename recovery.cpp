@@ -709,7 +709,7 @@ update_directory(const char* path, const char* unmount_when_done,
                 ensure_path_unmounted(unmount_when_done);
             }
             if (copy) {
-                result = install_package(copy, wipe_cache, TEMPORARY_INSTALL_FILE);
+                result = install_package(copy, wipe_cache, TEMPORARY_INSTALL_FILE, true);
                 free(copy);
             } else {
                 result = INSTALL_ERROR;
@@ -930,8 +930,10 @@ main(int argc, char **argv) {
     // 'sideload' command.  Note this must be a real argument, not
     // anything in the command file or bootloader control block; the
     // only way recovery should be run with this argument is when it
-    // starts a copy of itself from the apply_from_adb() function.
-    if (argc == 2 && strcmp(argv[1], "--adbd") == 0) {
+    // starts a copy of itself from the apply_from_adb() function,
+    // which may pass the fd of a pipe for sideload progress reports.
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "--adbd") == 0) {
+        if (argc == 3) set_sideload_progress_fd(atoi(argv[2]));
         adb_main();
         return 0;
     }
@@ -1021,7 +1023,7 @@ main(int argc, char **argv) {
     int status = INSTALL_SUCCESS;
 
     if (update_package != NULL) {
-        status = install_package(update_package, &wipe_cache, TEMPORARY_INSTALL_FILE);
+        status = install_package(update_package, &wipe_cache, TEMPORARY_INSTALL_FILE, true);
         if (status == INSTALL_SUCCESS && wipe_cache) {
             if (erase_volume("/cache")) {
                 LOGE("Cache wipe (requested by package) failed.");
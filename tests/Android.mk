@@ -23,4 +23,86 @@ $(foreach file,$(test_src_files), \
     $(eval LOCAL_MODULE := $(notdir $(file:%.cpp=%))) \
     $(eval LOCAL_C_INCLUDES := $(LOCAL_PATH)/..) \
     $(eval include $(BUILD_NATIVE_TEST)) \
-)
\ No newline at end of file
+)
+# The minadbd USB transport, driven over socketpairs.
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := usb_ffs_test.cpp
+LOCAL_MODULE := usb_ffs_test
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_SHARED_LIBRARIES := $(shared_libraries)
+LOCAL_STATIC_LIBRARIES := \
+    libgtest \
+    libgtest_main \
+    libminadbd \
+    libfusesideload \
+    libmincrypt
+include $(BUILD_NATIVE_TEST)
+
+# RangeSet parsing, set operations and scatter/gather I/O.
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := rangeset_test.cpp
+LOCAL_MODULE := rangeset_test
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_SHARED_LIBRARIES := $(shared_libraries)
+LOCAL_STATIC_LIBRARIES := \
+    libgtest \
+    libgtest_main \
+    libapplypatch
+include $(BUILD_NATIVE_TEST)
+
+# Direct, queued writes to EMMC partitions and hashed readback.
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := emmcio_test.cpp
+LOCAL_MODULE := emmcio_test
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_SHARED_LIBRARIES := $(shared_libraries)
+LOCAL_STATIC_LIBRARIES := \
+    libgtest \
+    libgtest_main \
+    libapplypatch \
+    libmincrypt
+include $(BUILD_NATIVE_TEST)
+
+# The cache of file and partition contents shared by applypatch calls.
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := contentcache_test.cpp
+LOCAL_MODULE := contentcache_test
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_SHARED_LIBRARIES := $(shared_libraries)
+LOCAL_STATIC_LIBRARIES := \
+    libgtest \
+    libgtest_main \
+    libapplypatch
+include $(BUILD_NATIVE_TEST)
+
+# Parsing, planning and running applypatch_batch() lists.
+batch_test_data := old.file new.file patch.bsdiff
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := batch_test.cpp
+LOCAL_MODULE := batch_test
+LOCAL_REQUIRED_MODULES := $(addprefix batch_test_,$(batch_test_data))
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_SHARED_LIBRARIES := $(shared_libraries)
+LOCAL_STATIC_LIBRARIES := \
+    libgtest \
+    libgtest_main \
+    libapplypatch \
+    libminelf \
+    libmtdutils \
+    libmincrypt \
+    libbz \
+    libz
+include $(BUILD_NATIVE_TEST)
+
+# The bsdiff pair batch_test patches with, installed beside it.
+$(foreach file,$(batch_test_data), \
+    $(eval include $(CLEAR_VARS)) \
+    $(eval LOCAL_MODULE := batch_test_$(file)) \
+    $(eval LOCAL_MODULE_STEM := $(file)) \
+    $(eval LOCAL_MODULE_CLASS := DATA) \
+    $(eval LOCAL_MODULE_TAGS := tests) \
+    $(eval LOCAL_SRC_FILES := ../applypatch/testdata/$(file)) \
+    $(eval LOCAL_MODULE_PATH := $(TARGET_OUT_DATA_NATIVE_TESTS)/batch_test/testdata) \
+    $(eval include $(BUILD_PREBUILT)) \
+)
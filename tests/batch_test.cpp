@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "applypatch/applypatch.h"
+}
+
+namespace android {
+
+static const char* kSha1A = "0123456789abcdef0123456789abcdef01234567";
+static const char* kSha1B = "89abcdef0123456789abcdef0123456789abcdef";
+
+// applypatch/testdata, installed beside the test; BATCH_TESTDATA
+// overrides it.
+static const char* kTestData = "/data/nativetest/batch_test/testdata";
+
+static std::string TestData(const char* name) {
+    const char* dir = getenv("BATCH_TESTDATA");
+    return std::string(dir ? dir : kTestData) + "/" + name;
+}
+
+static bool ReadFile(const std::string& path, std::string* contents) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f == NULL) return false;
+    char buf[65536];
+    size_t n;
+    contents->clear();
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) contents->append(buf, n);
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+static bool WriteFile(const std::string& path, const std::string& contents) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (f == NULL) return false;
+    bool ok = fwrite(contents.data(), 1, contents.size(), f) == contents.size();
+    return fclose(f) == 0 && ok;
+}
+
+static std::string Sha1Hex(const std::string& data) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    SHA_hash(data.data(), data.size(), digest);
+    char hex[SHA_DIGEST_SIZE * 2 + 1];
+    for (int i = 0; i < SHA_DIGEST_SIZE; ++i) sprintf(hex + i * 2, "%02x", digest[i]);
+    return hex;
+}
+
+// A PatchLoaderFn reading patches from the testdata directory.
+static Value* LoadTestPatch(const char* name, void* cookie) {
+    std::string data;
+    if (!ReadFile(TestData(name), &data)) return NULL;
+    Value* v = reinterpret_cast<Value*>(malloc(sizeof(Value)));
+    v->type = VAL_BLOB;
+    v->size = data.size();
+    v->data = reinterpret_cast<char*>(malloc(data.size()));
+    memcpy(v->data, data.data(), data.size());
+    return v;
+}
+
+class BatchTest : public testing::Test {
+  protected:
+    virtual void SetUp() {
+        strcpy(dir_, "/data/local/tmp/batch_test_XXXXXX");
+        ASSERT_TRUE(mkdtemp(dir_) != NULL);
+        patches_ = NULL;
+        count_ = 0;
+    }
+
+    virtual void TearDown() {
+        FreeBatchList(patches_, count_);
+        for (size_t i = 0; i < files_.size(); ++i) unlink(files_[i].c_str());
+        rmdir(dir_);
+    }
+
+    // Create <dir>/name holding 'contents', to be removed at the end.
+    std::string Create(const char* name, const std::string& contents) {
+        std::string path = std::string(dir_) + "/" + name;
+        files_.push_back(path);
+        EXPECT_TRUE(WriteFile(path, contents));
+        return path;
+    }
+
+    // A batch list line patching <dir>/src to <dir>/tgt ("-" is left
+    // alone), with a target of 'size' bytes.
+    std::string Line(const char* src, const char* tgt, size_t size = 100) {
+        char line[256];
+        std::string s = src[0] == '/' || strchr(src, ':') ? src :
+            std::string(dir_) + "/" + src;
+        std::string t = strcmp(tgt, "-") == 0 ? tgt : std::string(dir_) + "/" + tgt;
+        snprintf(line, sizeof(line), "%s %s %s %zu %s:p\n",
+                 s.c_str(), t.c_str(), kSha1B, size, kSha1A);
+        return line;
+    }
+
+    int Parse(const std::string& text) {
+        FreeBatchList(patches_, count_);
+        patches_ = NULL;
+        count_ = 0;
+        std::vector<char> buffer(text.begin(), text.end());
+        buffer.push_back('\0');
+        return ParseBatchList(&buffer[0], &patches_, &count_);
+    }
+
+    std::vector<int> Plan() {
+        std::vector<int> plan(count_ + 1);
+        EXPECT_EQ(0, PlanBatch(patches_, count_, &plan[0]));
+        plan.resize(count_);
+        return plan;
+    }
+
+    char dir_[64];
+    BatchPatch* patches_;
+    int count_;
+    std::vector<std::string> files_;
+};
+
+TEST_F(BatchTest, ParseList) {
+    std::string text = "# comment\n\n";
+    text += "/system/a /system/b ";
+    text += kSha1B;
+    text += " 1234 ";
+    text += kSha1A;
+    text += ":patch/a.p ";
+    text += kSha1B;
+    text += ":patch/b.p\r\n";
+    text += "  \t/system/c - ";
+    text += kSha1A;
+    text += " 0 ";
+    text += kSha1B;
+    text += ":c.p";
+    ASSERT_EQ(0, Parse(text));
+    ASSERT_EQ(2, count_);
+
+    EXPECT_STREQ("/system/a", patches_[0].source_filename);
+    EXPECT_STREQ("/system/b", patches_[0].target_filename);
+    EXPECT_STREQ(kSha1B, patches_[0].target_sha1_str);
+    EXPECT_EQ(1234U, patches_[0].target_size);
+    ASSERT_EQ(2, patches_[0].num_patches);
+    EXPECT_STREQ(kSha1A, patches_[0].patch_sha1_str[0]);
+    EXPECT_STREQ("patch/a.p", patches_[0].patch_names[0]);
+    EXPECT_STREQ(kSha1B, patches_[0].patch_sha1_str[1]);
+    EXPECT_STREQ("patch/b.p", patches_[0].patch_names[1]);
+
+    EXPECT_STREQ("/system/c", patches_[1].source_filename);
+    EXPECT_STREQ("-", patches_[1].target_filename);
+    EXPECT_EQ(0U, patches_[1].target_size);
+    ASSERT_EQ(1, patches_[1].num_patches);
+    EXPECT_STREQ("c.p", patches_[1].patch_names[0]);
+}
+
+TEST_F(BatchTest, ParseErrors) {
+    std::string sha1b = kSha1B, sha1a = kSha1A;
+    EXPECT_EQ(-1, Parse("a b " + sha1b + " 10\n"));                // no patches
+    EXPECT_EQ(-1, Parse("a b " + sha1b + " 10 " + sha1a + "\n"));  // no ':'
+    EXPECT_EQ(-1, Parse("a b " + sha1b + " 10 xyz:p\n"));          // bad patch sha1
+    EXPECT_EQ(-1, Parse("a b xyz 10 " + sha1a + ":p\n"));          // bad target sha1
+    EXPECT_EQ(-1, Parse("a b " + sha1b + " 10k " + sha1a + ":p\n"));
+    EXPECT_EQ(-1, Parse("a b\n"));
+    EXPECT_EQ(0, count_);
+    EXPECT_TRUE(patches_ == NULL);
+
+    EXPECT_EQ(0, Parse("# nothing\n"));
+    EXPECT_EQ(0, count_);
+}
+
+TEST_F(BatchTest, IndependentPatchesRunInParallel) {
+    ASSERT_EQ(0, Parse(Line("a", "-") + Line("e", "f") + Line("e", "g")));
+    std::vector<int> plan = Plan();
+    EXPECT_EQ(BATCH_PARALLEL, plan[0]);
+    // Sharing a source is fine; neither writes it.
+    EXPECT_EQ(BATCH_PARALLEL, plan[1]);
+    EXPECT_EQ(BATCH_PARALLEL, plan[2]);
+}
+
+TEST_F(BatchTest, ConflictsAreSerial) {
+    ASSERT_EQ(0, Parse(Line("a", "-") +
+                       Line("b", "c") +          // c is written here...
+                       Line("c", "d") +          // ... and read here
+                       Line("x", "y") +
+                       Line("z", "y") +          // two writers of y
+                       Line("s", "-") +
+                       Line("s", "t")));         // s patched in place and read
+    std::vector<int> plan = Plan();
+    EXPECT_EQ(BATCH_PARALLEL, plan[0]);
+    EXPECT_EQ(BATCH_SERIAL, plan[1]);
+    EXPECT_EQ(BATCH_SERIAL, plan[2]);
+    EXPECT_EQ(BATCH_SERIAL, plan[3]);
+    EXPECT_EQ(BATCH_SERIAL, plan[4]);
+    EXPECT_EQ(BATCH_SERIAL, plan[5]);
+    EXPECT_EQ(BATCH_SERIAL, plan[6]);
+}
+
+TEST_F(BatchTest, PartitionsAndOddNamesAreSerial) {
+    std::string partition = std::string("EMMC:/dev/block/boot:100:") + kSha1A;
+    std::string text = Line(partition.c_str(), "-");
+    text += Line("a", "-");
+    text += Line("b", "no_such_dir/b");
+    ASSERT_EQ(0, Parse(text));
+    std::vector<int> plan = Plan();
+    EXPECT_EQ(BATCH_SERIAL, plan[0]);
+    EXPECT_EQ(BATCH_PARALLEL, plan[1]);
+    EXPECT_EQ(BATCH_SERIAL, plan[2]);
+}
+
+TEST_F(BatchTest, FullFilesystemIsSerial) {
+    // Together the targets can't fit, so every patch on the
+    // filesystem goes one at a time, even the small one.
+    size_t huge = SIZE_MAX / 4;
+    ASSERT_EQ(0, Parse(Line("a", "-", 10) + Line("b", "-", huge)));
+    std::vector<int> plan = Plan();
+    EXPECT_EQ(BATCH_SERIAL, plan[0]);
+    EXPECT_EQ(BATCH_SERIAL, plan[1]);
+
+    ASSERT_EQ(0, Parse(Line("a", "-", 10) + Line("b", "-", 10)));
+    plan = Plan();
+    EXPECT_EQ(BATCH_PARALLEL, plan[0]);
+    EXPECT_EQ(BATCH_PARALLEL, plan[1]);
+}
+
+TEST_F(BatchTest, PatchesFiles) {
+    std::string old_data, new_data;
+    ASSERT_TRUE(ReadFile(TestData("old.file"), &old_data));
+    ASSERT_TRUE(ReadFile(TestData("new.file"), &new_data));
+    std::string old_sha1 = Sha1Hex(old_data), new_sha1 = Sha1Hex(new_data);
+
+    // Two independent in-place patches, one into a new file, and one
+    // whose target is already right.
+    const char* targets[] = { "a", "b", "d", "e" };
+    std::string paths[4];
+    paths[0] = Create("a", old_data);
+    paths[1] = Create("b", old_data);
+    std::string source = Create("c", old_data);
+    paths[2] = std::string(dir_) + "/d";
+    files_.push_back(paths[2]);
+    paths[3] = Create("e", new_data);
+
+    std::string text;
+    for (int i = 0; i < 4; ++i) {
+        char size[32];
+        snprintf(size, sizeof(size), "%zu", new_data.size());
+        std::string src = (i == 2) ? source : paths[i];
+        text += src + " " + (i == 2 ? paths[i] : std::string("-")) + " " +
+                new_sha1 + " " + size + " " + old_sha1 + ":patch.bsdiff\n";
+    }
+    ASSERT_EQ(0, Parse(text));
+    ASSERT_EQ(4, count_);
+    ASSERT_EQ(0, applypatch_batch(patches_, count_, LoadTestPatch, NULL, 2,
+                                  BATCH_MEMORY_BUDGET));
+
+    for (int i = 0; i < 4; ++i) {
+        std::string data;
+        ASSERT_TRUE(ReadFile(paths[i], &data)) << targets[i];
+        EXPECT_TRUE(data == new_data) << targets[i];
+    }
+    std::string data;
+    ASSERT_TRUE(ReadFile(source, &data));
+    EXPECT_TRUE(data == old_data);
+}
+
+}  // namespace android
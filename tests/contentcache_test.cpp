@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "applypatch/contentcache.h"
+
+namespace android {
+
+class ContentCacheTest : public testing::Test {
+  protected:
+    virtual void SetUp() {
+        ContentCacheSetBudget(1000);
+    }
+
+    virtual void TearDown() {
+        ContentCacheSetBudget(0);
+    }
+
+    // A FileContents of 'size' bytes of 'fill', with a made-up hash.
+    FileContents Make(size_t size, int fill) {
+        FileContents fc;
+        memset(&fc, 0, sizeof(fc));
+        fc.size = size;
+        fc.data = (unsigned char*)malloc(size);
+        memset(fc.data, fill, size);
+        memset(fc.sha1, fill, SHA_DIGEST_SIZE);
+        return fc;
+    }
+
+    bool HasPartition(const char* partition, size_t size, int fill,
+                      int need_data) {
+        uint8_t sha1[SHA_DIGEST_SIZE];
+        memset(sha1, fill, SHA_DIGEST_SIZE);
+        FileContents fc;
+        if (ContentCacheFindPartition(partition, size, sha1, need_data, &fc) != 0) {
+            return false;
+        }
+        EXPECT_EQ((ssize_t)size, fc.size);
+        if (need_data) {
+            EXPECT_TRUE(fc.data != NULL);
+            for (size_t i = 0; i < size; ++i) EXPECT_EQ(fill, fc.data[i]);
+        } else {
+            EXPECT_TRUE(fc.data == NULL);
+        }
+        free(fc.data);
+        return true;
+    }
+};
+
+TEST_F(ContentCacheTest, Partition) {
+    FileContents fc = Make(100, 1);
+    ContentCacheAddPartition("/dev/block/boot", &fc);
+    free(fc.data);
+
+    EXPECT_TRUE(HasPartition("/dev/block/boot", 100, 1, 1));
+    EXPECT_TRUE(HasPartition("/dev/block/boot", 100, 1, 0));
+    EXPECT_FALSE(HasPartition("/dev/block/boot", 99, 1, 0));
+    EXPECT_FALSE(HasPartition("/dev/block/boot", 100, 2, 0));
+    EXPECT_FALSE(HasPartition("/dev/block/recovery", 100, 1, 0));
+
+    ContentCacheDrop("/dev/block/boot");
+    EXPECT_FALSE(HasPartition("/dev/block/boot", 100, 1, 0));
+}
+
+TEST_F(ContentCacheTest, HashOnly) {
+    FileContents fc = Make(100, 3);
+    free(fc.data);
+    fc.data = NULL;
+    ContentCacheAddPartition("/dev/block/boot", &fc);
+
+    EXPECT_TRUE(HasPartition("/dev/block/boot", 100, 3, 0));
+    EXPECT_FALSE(HasPartition("/dev/block/boot", 100, 3, 1));
+
+    // Learning the data later upgrades the entry.
+    fc = Make(100, 3);
+    ContentCacheAddPartition("/dev/block/boot", &fc);
+    free(fc.data);
+    EXPECT_TRUE(HasPartition("/dev/block/boot", 100, 3, 1));
+}
+
+TEST_F(ContentCacheTest, EvictsLeastRecentlyUsed) {
+    for (int i = 1; i <= 3; ++i) {
+        FileContents fc = Make(400, i);
+        ContentCacheAddPartition("/dev/block/system", &fc);
+        free(fc.data);
+        if (i == 2) {
+            // Touch the first, so the second is the oldest.
+            EXPECT_TRUE(HasPartition("/dev/block/system", 400, 1, 1));
+        }
+    }
+    EXPECT_TRUE(HasPartition("/dev/block/system", 400, 1, 1));
+    EXPECT_FALSE(HasPartition("/dev/block/system", 400, 2, 0));
+    EXPECT_TRUE(HasPartition("/dev/block/system", 400, 3, 1));
+
+    // Too big to keep at all.
+    FileContents fc = Make(1001, 4);
+    ContentCacheAddPartition("/dev/block/system", &fc);
+    free(fc.data);
+    EXPECT_FALSE(HasPartition("/dev/block/system", 1001, 4, 0));
+}
+
+TEST_F(ContentCacheTest, File) {
+    FileContents fc = Make(10, 5);
+    fc.st.st_dev = 1;
+    fc.st.st_ino = 2;
+    fc.st.st_size = 10;
+    fc.st.st_mtime = 1000;
+    ContentCacheAddFile("/system/app/Foo.apk", 1, &fc);
+    free(fc.data);
+
+    struct stat st = fc.st;
+    FileContents out;
+    EXPECT_EQ(-1, ContentCacheFindFile("/system/app/Foo.apk", &st, 0, &out));
+    ASSERT_EQ(0, ContentCacheFindFile("/system/app/Foo.apk", &st, 1, &out));
+    EXPECT_EQ(10, out.size);
+    EXPECT_EQ(5, out.data[9]);
+    free(out.data);
+
+    // Once it's changed, the entry is gone for good.
+    st.st_mtime = 1001;
+    EXPECT_EQ(-1, ContentCacheFindFile("/system/app/Foo.apk", &st, 1, &out));
+    st.st_mtime = 1000;
+    EXPECT_EQ(-1, ContentCacheFindFile("/system/app/Foo.apk", &st, 1, &out));
+}
+
+TEST_F(ContentCacheTest, EmptyFile) {
+    FileContents fc = Make(0, 8);
+    ContentCacheAddFile("/system/etc/empty", 0, &fc);
+    free(fc.data);
+
+    FileContents out;
+    ASSERT_EQ(0, ContentCacheFindFile("/system/etc/empty", &fc.st, 0, &out));
+    EXPECT_EQ(0, out.size);
+    EXPECT_TRUE(out.data != NULL);
+    free(out.data);
+
+    fc = Make(0, 8);
+    ContentCacheAddPartition("/dev/block/misc", &fc);
+    free(fc.data);
+    EXPECT_TRUE(HasPartition("/dev/block/misc", 0, 8, 1));
+}
+
+TEST_F(ContentCacheTest, DropPartitionsKeepsFiles) {
+    FileContents fc = Make(10, 6);
+    ContentCacheAddPartition("/dev/block/boot", &fc);
+    ContentCacheAddFile("/cache/saved.file", 0, &fc);
+    free(fc.data);
+
+    ContentCacheDropPartitions();
+    EXPECT_FALSE(HasPartition("/dev/block/boot", 10, 6, 0));
+    FileContents out;
+    ASSERT_EQ(0, ContentCacheFindFile("/cache/saved.file", &fc.st, 0, &out));
+    free(out.data);
+}
+
+TEST_F(ContentCacheTest, Disabled) {
+    ContentCacheSetBudget(0);
+    FileContents fc = Make(10, 7);
+    ContentCacheAddPartition("/dev/block/boot", &fc);
+    free(fc.data);
+    EXPECT_FALSE(HasPartition("/dev/block/boot", 10, 7, 0));
+}
+
+}  // namespace android
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "applypatch/emmcio.h"
+#include "mincrypt/sha.h"
+
+namespace android {
+
+// Bytes of old contents the target file starts with, so we can check
+// nothing past the end of what's written is touched.
+static const size_t kOldSize = 3 * EMMC_IO_SIZE * EMMC_QUEUE_DEPTH / 2 + 8192;
+
+class EmmcIoTest : public testing::Test {
+  protected:
+    virtual void SetUp() {
+        strcpy(path_, "/data/local/tmp/emmcio_test_XXXXXX");
+        int fd = mkstemp(path_);
+        if (fd < 0) {
+            // host runs
+            strcpy(path_, "/tmp/emmcio_test_XXXXXX");
+            fd = mkstemp(path_);
+        }
+        ASSERT_GE(fd, 0);
+        std::vector<uint8_t> old(kOldSize, 0xee);
+        ASSERT_EQ((ssize_t)kOldSize, write(fd, &old[0], kOldSize));
+        close(fd);
+    }
+
+    virtual void TearDown() {
+        unlink(path_);
+    }
+
+    std::vector<uint8_t> Contents() {
+        std::vector<uint8_t> data(kOldSize + 1);
+        FILE* f = fopen(path_, "rb");
+        size_t n = fread(&data[0], 1, data.size(), f);
+        fclose(f);
+        data.resize(n);
+        return data;
+    }
+
+    // Write 'size' bytes of a pattern, 'piece' bytes at a time, and
+    // check the result.
+    void WriteAndCheck(size_t size, size_t piece) {
+        std::vector<uint8_t> data(size + 1);
+        for (size_t i = 0; i < size; ++i) data[i] = (uint8_t)(i * 7 + i / 4096);
+
+        EmmcWriter* w = EmmcWriterOpen(path_);
+        ASSERT_TRUE(w != NULL);
+        for (size_t p = 0; p < size; p += piece) {
+            size_t n = (size - p < piece) ? size - p : piece;
+            ASSERT_EQ(0, EmmcWriterWrite(w, &data[p], n));
+        }
+        uint8_t sha1[SHA_DIGEST_SIZE];
+        size_t written;
+        ASSERT_EQ(0, EmmcWriterFinish(w, sha1, &written));
+        EXPECT_EQ(size, written);
+
+        uint8_t expected[SHA_DIGEST_SIZE];
+        SHA_hash(&data[0], size, expected);
+        EXPECT_EQ(0, memcmp(sha1, expected, SHA_DIGEST_SIZE));
+
+        std::vector<uint8_t> contents = Contents();
+        ASSERT_EQ(kOldSize > size ? kOldSize : size, contents.size());
+        EXPECT_EQ(0, memcmp(&contents[0], &data[0], size));
+        for (size_t i = size; i < contents.size(); ++i) {
+            ASSERT_EQ(0xee, contents[i]) << "at " << i;
+        }
+
+        EXPECT_EQ(0, EmmcVerify(path_, size, sha1));
+    }
+
+    char path_[64];
+};
+
+TEST_F(EmmcIoTest, Empty) {
+    WriteAndCheck(0, 1);
+}
+
+TEST_F(EmmcIoTest, PartialBlock) {
+    WriteAndCheck(100, 7);
+}
+
+TEST_F(EmmcIoTest, WholeBlocks) {
+    WriteAndCheck(3 * 4096, 4096);
+}
+
+// More than all the buffers hold, so they're reused while writes may
+// still be in flight, in pieces that don't line up with them.
+TEST_F(EmmcIoTest, ManyBuffers) {
+    WriteAndCheck(EMMC_IO_SIZE * EMMC_QUEUE_DEPTH + 12345, 100003);
+}
+
+TEST_F(EmmcIoTest, OneBigWrite) {
+    WriteAndCheck(EMMC_IO_SIZE * 2 + 4096, EMMC_IO_SIZE * 2 + 4096);
+}
+
+TEST_F(EmmcIoTest, Sink) {
+    EmmcWriter* w = EmmcWriterOpen(path_);
+    ASSERT_TRUE(w != NULL);
+    unsigned char data[] = "abc";
+    EXPECT_EQ(3, EmmcWriterSink(data, 3, w));
+    ASSERT_EQ(0, EmmcWriterFinish(w, NULL, NULL));
+    EXPECT_EQ(0, memcmp(&Contents()[0], "abc", 3));
+}
+
+TEST_F(EmmcIoTest, VerifyMismatch) {
+    WriteAndCheck(5000, 5000);
+
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    std::vector<uint8_t> contents = Contents();
+    SHA_hash(&contents[0], 5000, sha1);
+    sha1[0] ^= 1;
+    EXPECT_EQ(1, EmmcVerify(path_, 5000, sha1));
+
+    // Asking for more than there is can't be read.
+    EXPECT_EQ(-1, EmmcVerify(path_, kOldSize + 4096, sha1));
+}
+
+TEST_F(EmmcIoTest, OpenFails) {
+    EXPECT_TRUE(EmmcWriterOpen("/nonexistent/emmcio_test") == NULL);
+}
+
+}  // namespace android
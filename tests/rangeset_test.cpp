@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "applypatch/rangeset.h"
+
+namespace android {
+
+static const size_t kBlock = 16;
+
+class RangeSetTest : public testing::Test {
+  protected:
+    virtual void TearDown() {
+        for (size_t i = 0; i < owned_.size(); ++i) free(owned_[i]);
+    }
+
+    // Parse and keep for freeing at the end of the test.
+    RangeSet* Parse(const char* text) {
+        RangeSet* rs = ParseRangeSet(text);
+        if (rs != NULL) owned_.push_back(rs);
+        return rs;
+    }
+
+    RangeSet* Keep(RangeSet* rs) {
+        if (rs != NULL) owned_.push_back(rs);
+        return rs;
+    }
+
+    std::string Format(const RangeSet* rs) {
+        char* s = RangeSetToString(rs);
+        std::string result(s);
+        free(s);
+        return result;
+    }
+
+    std::vector<RangeSet*> owned_;
+};
+
+TEST_F(RangeSetTest, Parse) {
+    RangeSet* rs = Parse("4,10,20,2,3");
+    ASSERT_TRUE(rs != NULL);
+    EXPECT_EQ(2U, rs->count);
+    EXPECT_EQ(11U, rs->size);
+    // order is kept as written
+    EXPECT_EQ(10U, rs->pos[0]);
+    EXPECT_EQ(2U, rs->pos[2]);
+    EXPECT_EQ("4,10,20,2,3", Format(rs));
+}
+
+TEST_F(RangeSetTest, Parse_Malformed) {
+    EXPECT_TRUE(Parse("") == NULL);
+    EXPECT_TRUE(Parse("0") == NULL);
+    EXPECT_TRUE(Parse("3,1,2,3") == NULL);    // odd count
+    EXPECT_TRUE(Parse("4,1,2,3") == NULL);    // too few numbers
+    EXPECT_TRUE(Parse("2,5,5") == NULL);      // empty range
+    EXPECT_TRUE(Parse("2,6,5") == NULL);      // backwards range
+    EXPECT_TRUE(Parse("2,1,x") == NULL);
+    EXPECT_TRUE(Parse("2,1,2junk") == NULL);
+    EXPECT_TRUE(Parse("2,1,2 next") != NULL); // stops at a space
+
+    // counts far beyond the text, or that don't fit a long
+    EXPECT_TRUE(Parse("4611686018427387904,1,2") == NULL);
+    EXPECT_TRUE(Parse("9223372036854775806,1,2") == NULL);
+    EXPECT_TRUE(Parse("99999999999999999999999,1,2") == NULL);
+    EXPECT_TRUE(Parse("-2,1,2") == NULL);
+}
+
+TEST_F(RangeSetTest, Merge) {
+    RangeSet* a = Parse("6,20,30,0,5,40,41");
+    RangeSet* b = Parse("4,5,10,25,35");
+    RangeSet* m = Keep(MergeRangeSets(a, b));
+    ASSERT_TRUE(m != NULL);
+    EXPECT_EQ("6,0,10,20,35,40,41", Format(m));
+    EXPECT_EQ(26U, m->size);
+
+    RangeSet* self = Keep(MergeRangeSets(a, a));
+    EXPECT_EQ("6,0,5,20,30,40,41", Format(self));
+}
+
+TEST_F(RangeSetTest, Intersect) {
+    RangeSet* a = Parse("6,20,30,0,5,40,50");
+    RangeSet* b = Parse("6,3,25,28,45,100,200");
+    RangeSet* i = Keep(IntersectRangeSets(a, b));
+    ASSERT_TRUE(i != NULL);
+    EXPECT_EQ("8,3,5,20,25,28,30,40,45", Format(i));
+    EXPECT_EQ(14U, i->size);
+
+    RangeSet* none = Keep(IntersectRangeSets(a, Parse("2,5,20")));
+    ASSERT_TRUE(none != NULL);
+    EXPECT_EQ(0U, none->count);
+    EXPECT_EQ(0U, none->size);
+}
+
+TEST_F(RangeSetTest, Overlap) {
+    RangeSet* a = Parse("4,10,20,30,40");
+    EXPECT_TRUE(RangeSetsOverlap(a, Parse("2,19,21")));
+    EXPECT_TRUE(RangeSetsOverlap(a, Parse("2,0,100")));
+    EXPECT_FALSE(RangeSetsOverlap(a, Parse("2,20,30")));
+    EXPECT_FALSE(RangeSetsOverlap(a, Parse("4,0,10,40,50")));
+}
+
+TEST_F(RangeSetTest, Iterate) {
+    RangeSet* rs = Parse("4,10,15,3,4");
+    RangeSetIterator it;
+    size_t start, len;
+
+    RangeSetIteratorInit(&it, rs);
+    ASSERT_TRUE(RangeSetNext(&it, &start, &len, 0));
+    EXPECT_EQ(10U, start);
+    EXPECT_EQ(5U, len);
+    ASSERT_TRUE(RangeSetNext(&it, &start, &len, 0));
+    EXPECT_EQ(3U, start);
+    EXPECT_EQ(1U, len);
+    EXPECT_FALSE(RangeSetNext(&it, &start, &len, 0));
+
+    // runs capped at 2 blocks
+    RangeSetIteratorInit(&it, rs);
+    size_t expected[][2] = { {10, 2}, {12, 2}, {14, 1}, {3, 1} };
+    for (size_t i = 0; i < 4; ++i) {
+        ASSERT_TRUE(RangeSetNext(&it, &start, &len, 2));
+        EXPECT_EQ(expected[i][0], start);
+        EXPECT_EQ(expected[i][1], len);
+    }
+    EXPECT_FALSE(RangeSetNext(&it, &start, &len, 2));
+}
+
+class RangeSetIoTest : public RangeSetTest {
+  protected:
+    virtual void SetUp() {
+        char path[] = "/data/local/tmp/rangeset_test_XXXXXX";
+        fd_ = mkstemp(path);
+        if (fd_ < 0) {
+            // host runs
+            strcpy(path, "/tmp/rangeset_test_XXXXXX");
+            fd_ = mkstemp(path);
+        }
+        ASSERT_GE(fd_, 0);
+        unlink(path);
+
+        uint8_t block[kBlock];
+        for (size_t b = 0; b < 64; ++b) {
+            memset(block, (int)b, sizeof(block));
+            ASSERT_EQ((ssize_t)kBlock, write(fd_, block, kBlock));
+        }
+    }
+
+    virtual void TearDown() {
+        close(fd_);
+        RangeSetTest::TearDown();
+    }
+
+    int fd_;
+};
+
+TEST_F(RangeSetIoTest, ReadBuffer) {
+    RangeSet* rs = Parse("4,40,42,3,4");
+    uint8_t buf[3 * kBlock];
+    ASSERT_EQ(0, ReadRangeSetBuffer(fd_, rs, kBlock, buf));
+    EXPECT_EQ(40, buf[0]);
+    EXPECT_EQ(41, buf[kBlock]);
+    EXPECT_EQ(3, buf[2 * kBlock]);
+    EXPECT_EQ(3, buf[3 * kBlock - 1]);
+}
+
+TEST_F(RangeSetIoTest, ReadPastEnd) {
+    RangeSet* rs = Parse("2,63,65");
+    uint8_t buf[2 * kBlock];
+    EXPECT_EQ(-1, ReadRangeSetBuffer(fd_, rs, kBlock, buf));
+    EXPECT_EQ(EIO, errno);
+}
+
+TEST_F(RangeSetIoTest, SizeMismatch) {
+    RangeSet* rs = Parse("2,0,2");
+    uint8_t buf[kBlock];
+    struct iovec iov = { buf, sizeof(buf) };
+    EXPECT_EQ(-1, ReadRangeSet(fd_, rs, kBlock, &iov, 1));
+    EXPECT_EQ(EINVAL, errno);
+}
+
+// Memory split at places that don't line up with the ranges, and
+// into more pieces than fit in one call.
+TEST_F(RangeSetIoTest, ScatterGather) {
+    RangeSet* rs = Parse("6,50,58,10,11,20,28");
+    const size_t total = rs->size * kBlock;
+
+    std::vector<uint8_t> data(total);
+    for (size_t i = 0; i < total; ++i) data[i] = (uint8_t)(i * 13 + 1);
+
+    std::vector<struct iovec> iov;
+    size_t p = 0;
+    for (size_t n = 0; p < total; ++n) {
+        size_t len = (n % 5) + 1;
+        if (n % 7 == 3) len = 0;        // empty pieces are skipped
+        if (len > total - p) len = total - p;
+        struct iovec v = { &data[p], len };
+        iov.push_back(v);
+        p += len;
+    }
+    ASSERT_GT(iov.size(), 64U);
+    ASSERT_EQ(0, WriteRangeSet(fd_, rs, kBlock, &iov[0], iov.size()));
+
+    std::vector<uint8_t> back(total);
+    ASSERT_EQ(0, ReadRangeSetBuffer(fd_, rs, kBlock, &back[0]));
+    EXPECT_TRUE(data == back);
+
+    // blocks outside the set are untouched
+    uint8_t block[kBlock];
+    ASSERT_EQ((ssize_t)kBlock, pread(fd_, block, kBlock, 11 * kBlock));
+    EXPECT_EQ(11, block[0]);
+
+    std::vector<uint8_t> scattered(total);
+    for (size_t i = 0; i < iov.size(); ++i) {
+        iov[i].iov_base = &scattered[(uint8_t*)iov[i].iov_base - &data[0]];
+    }
+    ASSERT_EQ(0, ReadRangeSet(fd_, rs, kBlock, &iov[0], iov.size()));
+    EXPECT_TRUE(data == scattered);
+}
+
+}  // namespace android
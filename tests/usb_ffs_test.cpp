@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <vector>
+
+// adb.h doesn't build as C++; these are the pieces of the minadbd
+// USB interface the test drives.
+extern "C" {
+typedef struct usb_handle usb_handle;
+usb_handle* usb_ffs_open_fds(int bulk_out, int bulk_in, int use_aio);
+int usb_read(usb_handle* h, void* data, int len);
+int usb_write(usb_handle* h, const void* data, int len);
+}
+
+namespace android {
+
+// An adb header followed by payloads of the sizes the transport
+// actually sees: small, exactly one transfer, spanning transfers, and
+// a full MAX_PAYLOAD.
+static const int kSizes[] = { 24, 1, 4096, 16384, 16385, 65536 + 7, 256 * 1024 };
+
+static uint8_t Pattern(size_t message, size_t offset) {
+    return static_cast<uint8_t>(message * 31 + offset * 7 + (offset >> 8));
+}
+
+// Plays the host end of the endpoints: one thread sends every message
+// and closes its end, another reads the echoes back.  Sockets finish
+// AIO requests synchronously inside io_submit(), so the host side has
+// to run concurrently with the device or the device would block.
+struct Host {
+    int out_fd;   // host -> device
+    int in_fd;    // device -> host
+    bool echo_ok;
+};
+
+static bool WriteFully(int fd, const uint8_t* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = TEMP_FAILURE_RETRY(write(fd, buf, len));
+        if (n <= 0) return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool ReadFully(int fd, uint8_t* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = TEMP_FAILURE_RETRY(read(fd, buf, len));
+        if (n <= 0) return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void* HostWriter(void* cookie) {
+    Host* host = reinterpret_cast<Host*>(cookie);
+    for (size_t m = 0; m < sizeof(kSizes) / sizeof(kSizes[0]); ++m) {
+        std::vector<uint8_t> buf(kSizes[m]);
+        for (size_t i = 0; i < buf.size(); ++i) buf[i] = Pattern(m, i);
+        if (!WriteFully(host->out_fd, buf.data(), buf.size())) break;
+    }
+    shutdown(host->out_fd, SHUT_WR);
+    return NULL;
+}
+
+static void* HostReader(void* cookie) {
+    Host* host = reinterpret_cast<Host*>(cookie);
+    host->echo_ok = true;
+    for (size_t m = 0; m < sizeof(kSizes) / sizeof(kSizes[0]); ++m) {
+        std::vector<uint8_t> buf(kSizes[m]);
+        if (!ReadFully(host->in_fd, buf.data(), buf.size())) {
+            host->echo_ok = false;
+            break;
+        }
+        for (size_t i = 0; i < buf.size(); ++i) {
+            if (buf[i] != Pattern(m, i)) {
+                host->echo_ok = false;
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void RoundTrip(int use_aio) {
+    int out_pair[2], in_pair[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, out_pair));
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, in_pair));
+
+    usb_handle* h = usb_ffs_open_fds(out_pair[1], in_pair[1], use_aio);
+    ASSERT_TRUE(h != NULL);
+
+    Host host = { out_pair[0], in_pair[0], false };
+    pthread_t writer, reader;
+    ASSERT_EQ(0, pthread_create(&writer, NULL, HostWriter, &host));
+    ASSERT_EQ(0, pthread_create(&reader, NULL, HostReader, &host));
+
+    for (size_t m = 0; m < sizeof(kSizes) / sizeof(kSizes[0]); ++m) {
+        std::vector<uint8_t> buf(kSizes[m]);
+        ASSERT_EQ(0, usb_read(h, buf.data(), buf.size())) << "message " << m;
+        for (size_t i = 0; i < buf.size(); ++i) {
+            ASSERT_EQ(Pattern(m, i), buf[i]) << "message " << m << " offset " << i;
+        }
+        ASSERT_EQ(0, usb_write(h, buf.data(), buf.size())) << "message " << m;
+    }
+
+    pthread_join(writer, NULL);
+    pthread_join(reader, NULL);
+    EXPECT_TRUE(host.echo_ok);
+
+    close(out_pair[0]);
+    close(in_pair[0]);
+}
+
+TEST(UsbFfsTest, BlockingRoundTrip) {
+    RoundTrip(0);
+}
+
+TEST(UsbFfsTest, AioRoundTrip) {
+    RoundTrip(1);
+}
+
+// A write that fails is reported by that write, not a later one.
+static void WriteToClosedHost(int use_aio) {
+    int out_pair[2], in_pair[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, out_pair));
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, in_pair));
+    signal(SIGPIPE, SIG_IGN);
+
+    usb_handle* h = usb_ffs_open_fds(out_pair[1], in_pair[1], use_aio);
+    ASSERT_TRUE(h != NULL);
+    close(in_pair[0]);
+
+    std::vector<uint8_t> buf(16384 * 3);
+    EXPECT_EQ(-1, usb_write(h, buf.data(), buf.size()));
+
+    close(out_pair[0]);
+}
+
+TEST(UsbFfsTest, BlockingWriteError) {
+    WriteToClosedHost(0);
+}
+
+TEST(UsbFfsTest, AioWriteError) {
+    WriteToClosedHost(1);
+}
+
+}  // namespace android
@@ -3,7 +3,10 @@
 LOCAL_PATH := $(call my-dir)
 
 updater_src_files := \
+	blockimg.c \
 	install.c \
+	metadata.c \
+	pkgstream.c \
 	updater.c
 
 #
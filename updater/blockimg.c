@@ -0,0 +1,1025 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "applypatch/applypatch.h"
+#include "applypatch/contentcache.h"
+#include "applypatch/rangeset.h"
+#include "edify/expr.h"
+#include "edify/profile.h"
+#include "mincrypt/sha.h"
+#include "minzip/Zip.h"
+#include "updater.h"
+#include "blockimg.h"
+
+#define BLOCKSIZE 4096
+
+// zero writes runs of up to this many blocks at a time
+#define ZERO_BLOCKS 256
+
+#ifndef STASH_DIRECTORY_BASE
+#define STASH_DIRECTORY_BASE "/cache/recovery"
+#endif
+#define CHECKPOINT_FILE "checkpoint"
+#define AUTO_STASH_PREFIX "auto-"
+
+// length of a SHA-1 in hex, plus the NUL
+#define HASH_HEX_SIZE (SHA_DIGEST_SIZE * 2 + 1)
+
+// The transfer list is a text file:
+//
+//   <version>            always 1
+//   <total blocks>       blocks written by the commands below, for
+//                        the progress bar
+//   <command> ...        one per line, executed in order
+//
+// A rangeset is written "N,a1,b1,a2,b2,...": N numbers giving the
+// half-open block ranges [a1,b1), [a2,b2), ...  The commands are:
+//
+//   erase <rangeset>     discard the blocks
+//   zero <rangeset>      fill the blocks with zeros
+//   new <rangeset>       fill the blocks with the next bytes of the
+//                        new data stream
+//   move <src> <tgt>     copy the src blocks to the tgt blocks
+//   bsdiff <offset> <length> <src> <tgt>
+//   imgdiff <offset> <length> <src> <tgt>
+//                        apply the patch stored at [offset,
+//                        offset+length) of the patch data to the src
+//                        blocks, and write the result to the tgt
+//                        blocks
+//
+// Sources are read in full before their target is written, so a
+// command's src and tgt may overlap.  Across commands it's up to the
+// package generator to order things so that no block is overwritten
+// before every command that reads it has run.
+//
+// Version 2 lists make the update resumable.  move, bsdiff and imgdiff
+// name their source and target data by SHA-1:
+//
+//   move <src sha1> <tgt sha1> <src> <tgt>
+//   bsdiff <offset> <length> <src sha1> <tgt sha1> <src> <tgt>
+//   imgdiff <offset> <length> <src sha1> <tgt sha1> <src> <tgt>
+//
+// and two more commands save blocks that a later command will need
+// after they've been overwritten:
+//
+//   stash <sha1> <rangeset>   save the blocks (whose SHA-1 is given)
+//   free <sha1>               drop a stash
+//
+// <src> may be "-" to take the source from the stash <src sha1>.
+// Stashes live on /cache, under STASH_DIRECTORY_BASE in a directory
+// named for the transfer list's SHA-1, along with a checkpoint: the
+// number of the last command whose writes are known to be on disk.
+// Only commands that write blocks move the checkpoint; the stashes
+// and frees in between are recorded with the next one, and are simply
+// redone on a resume.  If the update is interrupted, running the same
+// package again skips everything up to the checkpoint.  The one
+// command that may have been cut off part way is then redone, or
+// skipped if its target already has the right hash.  A command whose target overlaps its
+// own source can't simply be redone, so the source of such a command
+// is stashed (as "auto-<sha1>") until it has been checkpointed.
+
+static int read_all(int fd, uint8_t* data, size_t size, off64_t offset) {
+    size_t so_far = 0;
+    while (so_far < size) {
+        ssize_t r = pread64(fd, data + so_far, size - so_far, offset + so_far);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            printf("read failed: %s\n", r < 0 ? strerror(errno) : "unexpected EOF");
+            return -1;
+        }
+        so_far += r;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t* data, size_t size, off64_t offset) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t w = pwrite64(fd, data + written, size - written, offset + written);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            printf("write failed: %s\n", strerror(errno));
+            return -1;
+        }
+        written += w;
+    }
+    return 0;
+}
+
+static int read_blocks(int fd, const RangeSet* rs, uint8_t* buffer) {
+    if (ReadRangeSetBuffer(fd, rs, BLOCKSIZE, buffer) < 0) {
+        printf("failed to read %zu blocks: %s\n", rs->size, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int write_blocks(int fd, const RangeSet* rs, const uint8_t* buffer) {
+    if (WriteRangeSetBuffer(fd, rs, BLOCKSIZE, buffer) < 0) {
+        printf("failed to write %zu blocks: %s\n", rs->size, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Make sure *buffer holds at least 'size' bytes.
+static int allocate(size_t size, uint8_t** buffer, size_t* buffer_alloc) {
+    if (size <= *buffer_alloc) return 0;
+
+    free(*buffer);
+    *buffer = malloc(size);
+    if (*buffer == NULL) {
+        printf("failed to allocate %zu bytes\n", size);
+        *buffer_alloc = 0;
+        return -1;
+    }
+    *buffer_alloc = size;
+    return 0;
+}
+
+// A SinkFn that writes a stream of bytes across the blocks of a
+// RangeSet, in order.  With an fd of -1 the bytes are consumed but
+// not written, which is how resuming skips over new data that's
+// already in place.
+typedef struct {
+    int fd;
+    const RangeSet* tgt;
+    size_t p_block;     // next range to start on
+    size_t p_remain;    // bytes left in the current range
+    off64_t p_offset;   // where the next byte of the current range goes
+    size_t left;        // bytes left in the whole set
+} RangeSinkState;
+
+static void init_range_sink(RangeSinkState* rss, int fd, const RangeSet* tgt) {
+    rss->fd = fd;
+    rss->tgt = tgt;
+    rss->p_block = 0;
+    rss->p_remain = 0;
+    rss->p_offset = 0;
+    rss->left = tgt->size * BLOCKSIZE;
+}
+
+static ssize_t RangeSinkWrite(unsigned char* data, ssize_t size, void* token) {
+    RangeSinkState* rss = (RangeSinkState*) token;
+    ssize_t written = 0;
+
+    while (size > 0) {
+        if (rss->p_remain == 0) {
+            if (rss->p_block >= rss->tgt->count) {
+                printf("data overruns target range set\n");
+                break;
+            }
+            const size_t* r = rss->tgt->pos + rss->p_block * 2;
+            rss->p_offset = (off64_t)r[0] * BLOCKSIZE;
+            rss->p_remain = (r[1] - r[0]) * BLOCKSIZE;
+            rss->p_block++;
+        }
+
+        size_t chunk = rss->p_remain;
+        if ((size_t)size < chunk) chunk = size;
+        if (rss->fd >= 0 && write_all(rss->fd, data, chunk, rss->p_offset) < 0) {
+            break;
+        }
+        data += chunk;
+        size -= chunk;
+        written += chunk;
+        rss->p_offset += chunk;
+        rss->p_remain -= chunk;
+        rss->left -= chunk;
+    }
+    return written;
+}
+
+// The new data is (normally compressed) in one zip entry, which can
+// only be inflated front to back in one go.  A separate thread does
+// that, handing the output to each "new" command's RangeSinkState in
+// turn.  'rss' is non-NULL while a "new" command is waiting for data.
+
+typedef struct {
+    ZipArchive* za;
+    const ZipEntry* entry;
+
+    RangeSinkState* rss;
+    bool finished;      // the main thread won't ask for more data
+    bool done;          // the thread has stopped producing
+    bool failed;
+
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+} NewThreadInfo;
+
+static bool receive_new_data(const unsigned char* data, int size, void* cookie) {
+    NewThreadInfo* nti = (NewThreadInfo*) cookie;
+
+    while (size > 0) {
+        pthread_mutex_lock(&nti->mu);
+        while (nti->rss == NULL && !nti->finished) {
+            pthread_cond_wait(&nti->cv, &nti->mu);
+        }
+        RangeSinkState* rss = nti->rss;
+        pthread_mutex_unlock(&nti->mu);
+        if (rss == NULL) {
+            printf("more new data than \"new\" commands need\n");
+            return false;
+        }
+
+        ssize_t chunk = size;
+        if ((size_t)chunk > rss->left) chunk = rss->left;
+        ssize_t written = RangeSinkWrite((unsigned char*) data, chunk, rss);
+        data += written;
+        size -= written;
+
+        if (written != chunk || rss->left == 0) {
+            pthread_mutex_lock(&nti->mu);
+            nti->rss = NULL;
+            if (written != chunk) nti->failed = true;
+            pthread_cond_broadcast(&nti->cv);
+            pthread_mutex_unlock(&nti->mu);
+            if (written != chunk) return false;
+        }
+    }
+    return true;
+}
+
+static void* unzip_new_data(void* cookie) {
+    NewThreadInfo* nti = (NewThreadInfo*) cookie;
+    mzProcessZipEntryContents(nti->za, nti->entry, receive_new_data, nti);
+
+    pthread_mutex_lock(&nti->mu);
+    nti->done = true;
+    pthread_cond_broadcast(&nti->cv);
+    pthread_mutex_unlock(&nti->mu);
+    return NULL;
+}
+
+typedef struct {
+    char* cpos;             // strtok_r state for the current line
+    int fd;
+    uint8_t* buffer;
+    size_t buffer_alloc;
+    NewThreadInfo* nti;
+    const uint8_t* patch_start;
+    size_t patch_len;
+    size_t written;         // blocks written so far
+
+    int version;
+    char* stash_dir;        // version 2 only
+    bool skip;              // command is before the checkpoint
+    char auto_stash[HASH_HEX_SIZE];  // to free once checkpointed
+} CommandParameters;
+
+static RangeSet* next_range(CommandParameters* params, const char* cmd) {
+    char* word = strtok_r(NULL, " ", &params->cpos);
+    RangeSet* rs = (word == NULL) ? NULL : ParseRangeSet(word);
+    if (rs == NULL) {
+        printf("%s: missing or bad range set\n", cmd);
+    }
+    return rs;
+}
+
+static char* next_hash(CommandParameters* params, const char* cmd) {
+    char* word = strtok_r(NULL, " ", &params->cpos);
+    if (word == NULL || strlen(word) != HASH_HEX_SIZE - 1) {
+        printf("%s: missing or bad sha1\n", cmd);
+        return NULL;
+    }
+    return word;
+}
+
+static void hash_blocks(const uint8_t* data, size_t blocks, char* hex) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    SHA_hash(data, blocks * BLOCKSIZE, digest);
+
+    int i;
+    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    }
+}
+
+// --- stashes and the checkpoint ---
+
+static char* stash_path(const CommandParameters* params, const char* prefix,
+                        const char* name) {
+    size_t len = strlen(params->stash_dir) + strlen(prefix) + strlen(name) + 2;
+    char* path = malloc(len);
+    if (path != NULL) {
+        snprintf(path, len, "%s/%s%s", params->stash_dir, prefix, name);
+    }
+    return path;
+}
+
+// Write 'size' bytes to <stash_dir>/<prefix><name> so that the file
+// either doesn't exist or is complete, even across a power cut.
+static int write_stash_file(const CommandParameters* params, const char* prefix,
+                            const char* name, const uint8_t* data, size_t size) {
+    char* path = stash_path(params, prefix, name);
+    char* tmp = stash_path(params, prefix, "partial");
+    int result = -1;
+    int fd = -1;
+
+    if (path == NULL || tmp == NULL) goto done;
+
+    struct statfs sf;
+    if (statfs(params->stash_dir, &sf) == 0 &&
+        (uint64_t)sf.f_bavail * sf.f_bsize < size) {
+        printf("not enough space on %s to stash %zu bytes\n", params->stash_dir, size);
+        goto done;
+    }
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        printf("failed to create %s: %s\n", tmp, strerror(errno));
+        goto done;
+    }
+    if (write_all(fd, data, size, 0) < 0) goto done;
+    if (fsync(fd) < 0) {
+        printf("fsync of %s failed: %s\n", tmp, strerror(errno));
+        goto done;
+    }
+    close(fd);
+    fd = -1;
+
+    if (rename(tmp, path) < 0) {
+        printf("failed to rename %s to %s: %s\n", tmp, path, strerror(errno));
+        goto done;
+    }
+    int dfd = open(params->stash_dir, O_RDONLY | O_DIRECTORY);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+    result = 0;
+
+  done:
+    if (fd >= 0) close(fd);
+    free(path);
+    free(tmp);
+    return result;
+}
+
+static int write_stash(const CommandParameters* params, const char* prefix,
+                       const char* hash, const uint8_t* data, size_t blocks) {
+    return write_stash_file(params, prefix, hash, data, blocks * BLOCKSIZE);
+}
+
+// Load the stash <prefix><hash> into params->buffer, checking its
+// contents still match the hash.  Returns the number of blocks, or -1
+// if it's missing or bad.
+static ssize_t load_stash(CommandParameters* params, const char* prefix,
+                          const char* hash) {
+    char* path = stash_path(params, prefix, hash);
+    ssize_t result = -1;
+    int fd = -1;
+
+    if (path == NULL) return -1;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) goto done;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size % BLOCKSIZE != 0) {
+        printf("stash %s is damaged\n", path);
+        goto done;
+    }
+    size_t blocks = st.st_size / BLOCKSIZE;
+    if (allocate(st.st_size, &params->buffer, &params->buffer_alloc) < 0 ||
+        read_all(fd, params->buffer, st.st_size, 0) < 0) {
+        goto done;
+    }
+
+    char actual[HASH_HEX_SIZE];
+    hash_blocks(params->buffer, blocks, actual);
+    if (strcmp(actual, hash) != 0) {
+        printf("stash %s has sha1 %s\n", path, actual);
+        goto done;
+    }
+    result = blocks;
+
+  done:
+    if (fd >= 0) close(fd);
+    free(path);
+    return result;
+}
+
+static void free_stash(const CommandParameters* params, const char* prefix,
+                       const char* hash) {
+    char* path = stash_path(params, prefix, hash);
+    if (path != NULL && unlink(path) < 0 && errno != ENOENT) {
+        printf("failed to remove %s: %s\n", path, strerror(errno));
+    }
+    free(path);
+}
+
+// Returns the index of the last command recorded as done, or -1.
+static long read_checkpoint(const CommandParameters* params) {
+    char* path = stash_path(params, "", CHECKPOINT_FILE);
+    long result = -1;
+    if (path == NULL) return -1;
+
+    FILE* f = fopen(path, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%ld", &result) != 1) result = -1;
+        fclose(f);
+    }
+    free(path);
+    return result;
+}
+
+static int write_checkpoint(const CommandParameters* params, long index) {
+    char text[32];
+    int len = snprintf(text, sizeof(text), "%ld\n", index);
+    return write_stash_file(params, "", CHECKPOINT_FILE, (const uint8_t*)text, len);
+}
+
+// Remove the stash directory and everything in it.
+static void remove_stash_dir(const char* dir) {
+    DIR* d = opendir(dir);
+    if (d == NULL) return;
+
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+// --- commands ---
+
+static int PerformCommandErase(CommandParameters* params) {
+    RangeSet* tgt = next_range(params, "erase");
+    if (tgt == NULL) return -1;
+    if (params->skip) goto done;
+
+    struct stat st;
+    if (fstat(params->fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        size_t i;
+        for (i = 0; i < tgt->count; ++i) {
+            uint64_t range[2];
+            range[0] = (uint64_t)tgt->pos[i*2] * BLOCKSIZE;
+            range[1] = (uint64_t)(tgt->pos[i*2+1] - tgt->pos[i*2]) * BLOCKSIZE;
+            // Discard is only a hint; the blocks aren't read again.
+            if (ioctl(params->fd, BLKDISCARD, &range) < 0) {
+                printf("    blkdiscard failed: %s\n", strerror(errno));
+            }
+        }
+    }
+
+  done:
+    free(tgt);
+    return 0;
+}
+
+static int PerformCommandZero(CommandParameters* params) {
+    RangeSet* tgt = next_range(params, "zero");
+    if (tgt == NULL) return -1;
+
+    int result = -1;
+    if (params->skip) goto skip;
+
+    size_t chunk = (tgt->size < ZERO_BLOCKS) ? tgt->size : ZERO_BLOCKS;
+    if (allocate(chunk * BLOCKSIZE, &params->buffer, &params->buffer_alloc) < 0) goto done;
+    memset(params->buffer, 0, chunk * BLOCKSIZE);
+
+    RangeSetIterator it;
+    size_t start, len;
+    RangeSetIteratorInit(&it, tgt);
+    while (RangeSetNext(&it, &start, &len, ZERO_BLOCKS)) {
+        if (write_all(params->fd, params->buffer, len * BLOCKSIZE,
+                      (off64_t)start * BLOCKSIZE) < 0) {
+            goto done;
+        }
+    }
+
+  skip:
+    params->written += tgt->size;
+    result = 0;
+
+  done:
+    free(tgt);
+    return result;
+}
+
+static int PerformCommandNew(CommandParameters* params) {
+    RangeSet* tgt = next_range(params, "new");
+    if (tgt == NULL) return -1;
+
+    // Even when skipping, the new data for these blocks has to be
+    // consumed to keep the stream in step with the commands.
+    NewThreadInfo* nti = params->nti;
+    RangeSinkState rss;
+    init_range_sink(&rss, params->skip ? -1 : params->fd, tgt);
+
+    pthread_mutex_lock(&nti->mu);
+    nti->rss = &rss;
+    pthread_cond_broadcast(&nti->cv);
+    while (nti->rss != NULL && !nti->done) {
+        pthread_cond_wait(&nti->cv, &nti->mu);
+    }
+    nti->rss = NULL;
+    pthread_mutex_unlock(&nti->mu);
+
+    int result = 0;
+    if (rss.left != 0) {
+        printf("new: %s after %zu of %zu blocks\n",
+               nti->failed ? "write failed" : "new data ran out",
+               tgt->size - (rss.left + BLOCKSIZE - 1) / BLOCKSIZE, tgt->size);
+        result = -1;
+    } else {
+        params->written += tgt->size;
+    }
+    free(tgt);
+    return result;
+}
+
+static int PerformCommandStash(CommandParameters* params) {
+    if (params->stash_dir == NULL) {
+        printf("stash: needs a version 2 transfer list\n");
+        return -1;
+    }
+    char* hash = next_hash(params, "stash");
+    if (hash == NULL) return -1;
+    RangeSet* src = next_range(params, "stash");
+    if (src == NULL) return -1;
+
+    int result = -1;
+    if (params->skip) {
+        result = 0;
+        goto done;
+    }
+
+    char actual[HASH_HEX_SIZE];
+    if (allocate(src->size * BLOCKSIZE, &params->buffer, &params->buffer_alloc) < 0 ||
+        read_blocks(params->fd, src, params->buffer) < 0) {
+        goto done;
+    }
+    hash_blocks(params->buffer, src->size, actual);
+    if (strcmp(actual, hash) != 0) {
+        // Interrupted after a later command overwrote these blocks?
+        // Then the stash is already saved.
+        if (load_stash(params, "", hash) >= 0) {
+            result = 0;
+        } else {
+            printf("stash: blocks have sha1 %s, expected %s\n", actual, hash);
+        }
+        goto done;
+    }
+    result = write_stash(params, "", hash, params->buffer, src->size);
+
+  done:
+    free(src);
+    return result;
+}
+
+static int PerformCommandFree(CommandParameters* params) {
+    if (params->stash_dir == NULL) {
+        printf("free: needs a version 2 transfer list\n");
+        return -1;
+    }
+    char* hash = next_hash(params, "free");
+    if (hash == NULL) return -1;
+    if (!params->skip) free_stash(params, "", hash);
+    return 0;
+}
+
+// Get the source of a move/bsdiff/imgdiff into params->buffer.
+// Returns the number of source blocks, 0 if the command doesn't need
+// to run (its target is already in place, or it's being skipped), or
+// -1 on error.  *tgt is set on any non-error return.
+static ssize_t load_source(CommandParameters* params, const char* cmd,
+                           RangeSet** tgt) {
+    RangeSet* src = NULL;
+    char* src_hash = NULL;
+    char* tgt_hash = NULL;
+    ssize_t blocks = -1;
+
+    *tgt = NULL;
+    if (params->version >= 2) {
+        src_hash = next_hash(params, cmd);
+        if (src_hash == NULL) return -1;
+        tgt_hash = next_hash(params, cmd);
+        if (tgt_hash == NULL) return -1;
+    }
+    char* src_word = strtok_r(NULL, " ", &params->cpos);
+    if (src_word == NULL) {
+        printf("%s: missing source\n", cmd);
+        return -1;
+    }
+    bool from_stash = (src_hash != NULL && strcmp(src_word, "-") == 0);
+    if (!from_stash) {
+        src = ParseRangeSet(src_word);
+        if (src == NULL) {
+            printf("%s: bad source range set\n", cmd);
+            return -1;
+        }
+    }
+    *tgt = next_range(params, cmd);
+    if (*tgt == NULL) goto fail;
+
+    if (params->skip) {
+        blocks = 0;
+        goto done;
+    }
+
+    if (from_stash) {
+        blocks = load_stash(params, "", src_hash);
+        if (blocks < 0) printf("%s: no usable stash %s\n", cmd, src_hash);
+    } else {
+        if (allocate(src->size * BLOCKSIZE, &params->buffer, &params->buffer_alloc) < 0 ||
+            read_blocks(params->fd, src, params->buffer) < 0) {
+            goto fail;
+        }
+        blocks = src->size;
+
+        char actual[HASH_HEX_SIZE];
+        if (src_hash != NULL) {
+            hash_blocks(params->buffer, blocks, actual);
+            if (strcmp(actual, src_hash) != 0) {
+                // Overwritten by an interrupted run of this command?
+                blocks = load_stash(params, AUTO_STASH_PREFIX, src_hash);
+                if (blocks < 0) {
+                    printf("%s: source has sha1 %s, expected %s\n", cmd, actual, src_hash);
+                }
+            } else if (params->stash_dir != NULL && RangeSetsOverlap(src, *tgt)) {
+                // Writing the target destroys the source; keep a copy
+                // until this command is checkpointed.
+                if (write_stash(params, AUTO_STASH_PREFIX, src_hash,
+                                params->buffer, blocks) < 0) {
+                    goto fail;
+                }
+                strcpy(params->auto_stash, src_hash);
+            }
+        }
+    }
+
+    if (blocks < 0 && tgt_hash != NULL) {
+        // No source, but if the target is already right there's
+        // nothing to do.
+        size_t size = (*tgt)->size * BLOCKSIZE;
+        char actual[HASH_HEX_SIZE];
+        if (allocate(size, &params->buffer, &params->buffer_alloc) == 0 &&
+            read_blocks(params->fd, *tgt, params->buffer) == 0) {
+            hash_blocks(params->buffer, (*tgt)->size, actual);
+            if (strcmp(actual, tgt_hash) == 0) {
+                printf("%s: target already in place\n", cmd);
+                blocks = 0;
+            }
+        }
+    }
+    if (blocks < 0) goto fail;
+
+  done:
+    free(src);
+    return blocks;
+
+  fail:
+    free(src);
+    free(*tgt);
+    *tgt = NULL;
+    return -1;
+}
+
+static int PerformCommandMove(CommandParameters* params) {
+    RangeSet* tgt;
+    ssize_t blocks = load_source(params, "move", &tgt);
+    int result = -1;
+    if (blocks < 0) return -1;
+    if (blocks == 0) goto skip;
+
+    if ((size_t)blocks != tgt->size) {
+        printf("move: source is %zd blocks but target is %zu\n", blocks, tgt->size);
+        goto done;
+    }
+    if (write_blocks(params->fd, tgt, params->buffer) < 0) {
+        goto done;
+    }
+
+  skip:
+    params->written += tgt->size;
+    result = 0;
+
+  done:
+    free(tgt);
+    return result;
+}
+
+// bsdiff and imgdiff
+static int PerformCommandDiff(CommandParameters* params, bool imgdiff) {
+    const char* cmd = imgdiff ? "imgdiff" : "bsdiff";
+    char* offset_str = strtok_r(NULL, " ", &params->cpos);
+    char* len_str = strtok_r(NULL, " ", &params->cpos);
+    RangeSet* tgt = NULL;
+    int result = -1;
+
+    if (offset_str == NULL || len_str == NULL) {
+        printf("%s: missing patch offset or length\n", cmd);
+        return -1;
+    }
+    size_t offset = strtoul(offset_str, NULL, 0);
+    size_t len = strtoul(len_str, NULL, 0);
+    if (offset > params->patch_len || len > params->patch_len - offset) {
+        printf("%s: patch [%zu, %zu) is outside the patch data\n", cmd, offset, offset + len);
+        return -1;
+    }
+
+    ssize_t blocks = load_source(params, cmd, &tgt);
+    if (blocks < 0) return -1;
+    if (blocks == 0) goto skip;
+
+    Value patch_value;
+    patch_value.type = VAL_BLOB;
+    patch_value.size = len;
+    patch_value.data = (char*)(params->patch_start + offset);
+
+    RangeSinkState rss;
+    init_range_sink(&rss, params->fd, tgt);
+
+    int status;
+    if (imgdiff) {
+        status = ApplyImagePatch(params->buffer, blocks * BLOCKSIZE,
+                                 &patch_value, RangeSinkWrite, &rss, NULL, NULL);
+    } else {
+        status = ApplyBSDiffPatch(params->buffer, blocks * BLOCKSIZE,
+                                  &patch_value, 0, RangeSinkWrite, &rss, NULL);
+    }
+    if (status != 0) {
+        printf("%s: failed to apply patch\n", cmd);
+        goto done;
+    }
+    if (rss.left != 0) {
+        printf("%s: patch output is %zu bytes short of the target\n", cmd, rss.left);
+        goto done;
+    }
+
+  skip:
+    params->written += tgt->size;
+    result = 0;
+
+  done:
+    free(tgt);
+    return result;
+}
+
+static int PerformCommandBsdiff(CommandParameters* params) {
+    return PerformCommandDiff(params, false);
+}
+
+static int PerformCommandImgdiff(CommandParameters* params) {
+    return PerformCommandDiff(params, true);
+}
+
+typedef struct {
+    const char* name;
+    int (*fn)(CommandParameters* params);
+    bool writes;            // writes blocks, so needs a checkpoint
+} Command;
+
+static const Command commands[] = {
+    { "bsdiff",  PerformCommandBsdiff,  true },
+    { "erase",   PerformCommandErase,   false },
+    { "free",    PerformCommandFree,    false },
+    { "imgdiff", PerformCommandImgdiff, true },
+    { "move",    PerformCommandMove,    true },
+    { "new",     PerformCommandNew,     true },
+    { "stash",   PerformCommandStash,   false },
+    { "zero",    PerformCommandZero,    true },
+};
+
+Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]) {
+    Value* blockdev_filename;
+    Value* transfer_list_value;
+    Value* new_data_fn;
+    Value* patch_data_fn;
+    char* transfer_list = NULL;
+    bool success = false;
+    bool thread_started = false;
+    pthread_t new_data_thread;
+    NewThreadInfo nti;
+    CommandParameters params;
+
+    memset(&params, 0, sizeof(params));
+    params.fd = -1;
+
+    if (argc != 4) {
+        return ErrorAbort(state, "%s() expects 4 args, got %d", name, argc);
+    }
+    ContentCacheDropPartitions();
+    if (ReadValueArgs(state, argv, 4, &blockdev_filename, &transfer_list_value,
+                      &new_data_fn, &patch_data_fn) < 0) {
+        return NULL;
+    }
+
+    if (blockdev_filename->type != VAL_STRING) {
+        ErrorAbort(state, "blockdev_filename argument to %s must be string", name);
+        goto done;
+    }
+    if (transfer_list_value->type != VAL_BLOB && transfer_list_value->type != VAL_STRING) {
+        ErrorAbort(state, "transfer_list argument to %s must be blob or string", name);
+        goto done;
+    }
+    if (new_data_fn->type != VAL_STRING) {
+        ErrorAbort(state, "new_data_fn argument to %s must be string", name);
+        goto done;
+    }
+    if (patch_data_fn->type != VAL_STRING) {
+        ErrorAbort(state, "patch_data_fn argument to %s must be string", name);
+        goto done;
+    }
+
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    FILE* cmd_pipe = ui->cmd_pipe;
+    ZipArchive* za = ui->package_zip;
+
+    // The patches are applied straight out of the mapped package, so
+    // they have to be stored uncompressed.
+    const ZipEntry* patch_entry = mzFindZipEntry(za, patch_data_fn->data);
+    if (patch_entry == NULL) {
+        ErrorAbort(state, "%s(): no file \"%s\" in package", name, patch_data_fn->data);
+        goto done;
+    }
+    if (patch_entry->compression != 0) {
+        ErrorAbort(state, "%s(): \"%s\" must be stored, not compressed",
+                   name, patch_data_fn->data);
+        goto done;
+    }
+    params.patch_start = (const uint8_t*)za->map.addr + mzGetZipEntryOffset(patch_entry);
+    params.patch_len = mzGetZipEntryUncompLen(patch_entry);
+
+    const ZipEntry* new_entry = mzFindZipEntry(za, new_data_fn->data);
+    if (new_entry == NULL) {
+        ErrorAbort(state, "%s(): no file \"%s\" in package", name, new_data_fn->data);
+        goto done;
+    }
+
+    params.fd = open(blockdev_filename->data, O_RDWR);
+    if (params.fd < 0) {
+        printf("%s: failed to open %s: %s\n", name, blockdev_filename->data, strerror(errno));
+        goto done;
+    }
+
+    transfer_list = malloc(transfer_list_value->size + 1);
+    if (transfer_list == NULL) {
+        printf("%s: failed to allocate %zd bytes for transfer list\n",
+               name, transfer_list_value->size + 1);
+        goto done;
+    }
+    memcpy(transfer_list, transfer_list_value->data, transfer_list_value->size);
+    transfer_list[transfer_list_value->size] = '\0';
+
+    char* line_save;
+    char* line = strtok_r(transfer_list, "\n", &line_save);
+    params.version = (line == NULL) ? 0 : strtol(line, NULL, 0);
+    if (params.version != 1 && params.version != 2) {
+        printf("%s: unsupported transfer list version \"%s\"\n", name, line ? line : "");
+        goto done;
+    }
+
+    long resume_after = -1;
+    if (params.version >= 2) {
+        char hash[HASH_HEX_SIZE];
+        uint8_t digest[SHA_DIGEST_SIZE];
+        int i;
+        SHA_hash(transfer_list_value->data, transfer_list_value->size, digest);
+        for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+            sprintf(hash + i * 2, "%02x", digest[i]);
+        }
+
+        params.stash_dir = malloc(strlen(STASH_DIRECTORY_BASE) + HASH_HEX_SIZE + 1);
+        if (params.stash_dir == NULL) goto done;
+        sprintf(params.stash_dir, "%s/%s", STASH_DIRECTORY_BASE, hash);
+        mkdir(STASH_DIRECTORY_BASE, 0700);
+        if (mkdir(params.stash_dir, 0700) < 0 && errno != EEXIST) {
+            printf("%s: can't create %s: %s\n", name, params.stash_dir, strerror(errno));
+            goto done;
+        }
+
+        resume_after = read_checkpoint(&params);
+        if (resume_after >= 0) {
+            printf("%s: resuming after command %ld\n", name, resume_after);
+        }
+    }
+    line = strtok_r(NULL, "\n", &line_save);
+    if (line == NULL) {
+        printf("%s: transfer list has no block count\n", name);
+        goto done;
+    }
+    size_t total_blocks = strtoul(line, NULL, 0);
+
+    memset(&nti, 0, sizeof(nti));
+    nti.za = za;
+    nti.entry = new_entry;
+    pthread_mutex_init(&nti.mu, NULL);
+    pthread_cond_init(&nti.cv, NULL);
+    params.nti = &nti;
+    if (pthread_create(&new_data_thread, NULL, unzip_new_data, &nti) != 0) {
+        printf("%s: failed to start new data thread: %s\n", name, strerror(errno));
+        goto done;
+    }
+    thread_started = true;
+
+    long cmdindex = 0;
+    while ((line = strtok_r(NULL, "\n", &line_save)) != NULL) {
+        char* cmd = strtok_r(line, " ", &params.cpos);
+        if (cmd == NULL) continue;
+        params.skip = (cmdindex <= resume_after);
+
+        size_t i;
+        for (i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i) {
+            if (strcmp(cmd, commands[i].name) == 0) break;
+        }
+        if (i == sizeof(commands) / sizeof(commands[0])) {
+            printf("%s: unknown command \"%s\"\n", name, cmd);
+            goto done;
+        }
+        if (commands[i].fn(&params) < 0) {
+            printf("%s: \"%s\" failed\n", name, cmd);
+            goto done;
+        }
+
+        if (params.stash_dir != NULL && !params.skip && commands[i].writes) {
+            // The checkpoint may only move past this command once
+            // its writes are on disk.  Any stashes and frees since the
+            // last checkpoint are covered by it too; they're safe to
+            // redo, as a stash whose blocks have since been overwritten
+            // is found already saved.
+            if (fsync(params.fd) < 0) {
+                printf("%s: fsync of %s failed: %s\n", name,
+                       blockdev_filename->data, strerror(errno));
+                goto done;
+            }
+            if (write_checkpoint(&params, cmdindex) < 0) goto done;
+            if (params.auto_stash[0] != '\0') {
+                free_stash(&params, AUTO_STASH_PREFIX, params.auto_stash);
+                params.auto_stash[0] = '\0';
+            }
+        }
+        ++cmdindex;
+
+        if (total_blocks > 0) {
+            fprintf(cmd_pipe, "set_progress %.4f\n", (double)params.written / total_blocks);
+        }
+    }
+
+    if (fsync(params.fd) < 0) {
+        printf("%s: fsync of %s failed: %s\n", name, blockdev_filename->data, strerror(errno));
+        goto done;
+    }
+    printf("wrote %zu blocks; expected %zu\n", params.written, total_blocks);
+    RecordBytesProcessed((uint64_t)params.written * BLOCKSIZE);
+    if (params.stash_dir != NULL) {
+        remove_stash_dir(params.stash_dir);
+    }
+    success = true;
+
+  done:
+    if (thread_started) {
+        pthread_mutex_lock(&nti.mu);
+        nti.finished = true;
+        pthread_cond_broadcast(&nti.cv);
+        pthread_mutex_unlock(&nti.mu);
+        pthread_join(new_data_thread, NULL);
+        pthread_mutex_destroy(&nti.mu);
+        pthread_cond_destroy(&nti.cv);
+    }
+    if (params.fd >= 0) close(params.fd);
+    free(params.buffer);
+    free(params.stash_dir);
+    free(transfer_list);
+    FreeValue(blockdev_filename);
+    FreeValue(transfer_list_value);
+    FreeValue(new_data_fn);
+    FreeValue(patch_data_fn);
+    if (state->errmsg != NULL) return NULL;
+    return StringValue(strdup(success ? "t" : ""));
+}
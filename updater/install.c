@@ -28,21 +28,22 @@
 #include <fcntl.h>
 #include <time.h>
 #include <selinux/selinux.h>
-#include <ftw.h>
-#include <sys/capability.h>
-#include <sys/xattr.h>
-#include <linux/xattr.h>
 #include <inttypes.h>
 
 #include "cutils/misc.h"
 #include "cutils/properties.h"
 #include "edify/expr.h"
+#include "edify/profile.h"
 #include "mincrypt/sha.h"
 #include "minzip/DirUtil.h"
 #include "mtdutils/mounts.h"
 #include "mtdutils/mtdutils.h"
 #include "updater.h"
 #include "applypatch/applypatch.h"
+#include "applypatch/contentcache.h"
+#include "blockimg.h"
+#include "metadata.h"
+#include "pkgstream.h"
 
 #ifdef USE_EXT4
 #include "make_ext4fs.h"
@@ -212,6 +213,8 @@ Value* FormatFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* fs_size;
     char* mount_point;
 
+    ContentCacheDropPartitions();
+
     if (ReadArgs(state, argv, 5, &fs_type, &partition_type, &location, &fs_size, &mount_point) < 0) {
         return NULL;
     }
@@ -412,6 +415,22 @@ Value* PackageExtractDirFn(const char* name, State* state,
 }
 
 
+static bool write_file_cb(const unsigned char* data, int data_len, void* cookie) {
+    int fd = (int)(intptr_t)cookie;
+    RecordBytesProcessed(data_len);
+    while (data_len > 0) {
+        ssize_t w = write(fd, data, data_len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            printf("write failed: %s\n", w < 0 ? strerror(errno) : "wrote nothing");
+            return false;
+        }
+        data += w;
+        data_len -= w;
+    }
+    return true;
+}
+
 // package_extract_file(package_path, destination_path)
 //   or
 // package_extract_file(package_path)
@@ -431,6 +450,9 @@ Value* PackageExtractFileFn(const char* name, State* state,
         char* dest_path;
         if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
 
+        // dest_path may be a block device.
+        ContentCacheDropPartitions();
+
         ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
         const ZipEntry* entry = mzFindZipEntry(za, zip_path);
         if (entry == NULL) {
@@ -444,8 +466,12 @@ Value* PackageExtractFileFn(const char* name, State* state,
                     name, dest_path, strerror(errno));
             goto done2;
         }
-        success = mzExtractZipEntryToFile(za, entry, fileno(f));
-        fclose(f);
+        success = StreamZipEntry(za, entry, ZIP_STREAM_CHUNK_SIZE,
+                                 write_file_cb, (void*)(intptr_t)fileno(f));
+        if (fclose(f) != 0) {
+            printf("%s: error closing %s: %s\n", name, dest_path, strerror(errno));
+            success = false;
+        }
 
       done2:
         free(zip_path);
@@ -480,6 +506,7 @@ Value* PackageExtractFileFn(const char* name, State* state,
 
         success = mzExtractZipEntryToBuffer(za, entry,
                                             (unsigned char *)v->data);
+        if (success) RecordBytesProcessed(v->size);
 
       done1:
         free(zip_path);
@@ -558,23 +585,6 @@ Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
     return StringValue(strdup(""));
 }
 
-struct perm_parsed_args {
-    bool has_uid;
-    uid_t uid;
-    bool has_gid;
-    gid_t gid;
-    bool has_mode;
-    mode_t mode;
-    bool has_fmode;
-    mode_t fmode;
-    bool has_dmode;
-    mode_t dmode;
-    bool has_selabel;
-    char* selabel;
-    bool has_capabilities;
-    uint64_t capabilities;
-};
-
 static struct perm_parsed_args ParsePermArgs(int argc, char** args) {
     int i;
     struct perm_parsed_args parsed;
@@ -671,103 +681,6 @@ static struct perm_parsed_args ParsePermArgs(int argc, char** args) {
     return parsed;
 }
 
-static int ApplyParsedPerms(
-        const char* filename,
-        const struct stat *statptr,
-        struct perm_parsed_args parsed)
-{
-    int bad = 0;
-
-    /* ignore symlinks */
-    if (S_ISLNK(statptr->st_mode)) {
-        return 0;
-    }
-
-    if (parsed.has_uid) {
-        if (chown(filename, parsed.uid, -1) < 0) {
-            printf("ApplyParsedPerms: chown of %s to %d failed: %s\n",
-                   filename, parsed.uid, strerror(errno));
-            bad++;
-        }
-    }
-
-    if (parsed.has_gid) {
-        if (chown(filename, -1, parsed.gid) < 0) {
-            printf("ApplyParsedPerms: chgrp of %s to %d failed: %s\n",
-                   filename, parsed.gid, strerror(errno));
-            bad++;
-        }
-    }
-
-    if (parsed.has_mode) {
-        if (chmod(filename, parsed.mode) < 0) {
-            printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.mode, strerror(errno));
-            bad++;
-        }
-    }
-
-    if (parsed.has_dmode && S_ISDIR(statptr->st_mode)) {
-        if (chmod(filename, parsed.dmode) < 0) {
-            printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.dmode, strerror(errno));
-            bad++;
-        }
-    }
-
-    if (parsed.has_fmode && S_ISREG(statptr->st_mode)) {
-        if (chmod(filename, parsed.fmode) < 0) {
-            printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.fmode, strerror(errno));
-            bad++;
-        }
-    }
-
-    if (parsed.has_selabel) {
-        // TODO: Don't silently ignore ENOTSUP
-        if (lsetfilecon(filename, parsed.selabel) && (errno != ENOTSUP)) {
-            printf("ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n",
-                   filename, parsed.selabel, strerror(errno));
-            bad++;
-        }
-    }
-
-    if (parsed.has_capabilities && S_ISREG(statptr->st_mode)) {
-        if (parsed.capabilities == 0) {
-            if ((removexattr(filename, XATTR_NAME_CAPS) == -1) && (errno != ENODATA)) {
-                // Report failure unless it's ENODATA (attribute not set)
-                printf("ApplyParsedPerms: removexattr of %s to %" PRIx64 " failed: %s\n",
-                       filename, parsed.capabilities, strerror(errno));
-                bad++;
-            }
-        } else {
-            struct vfs_cap_data cap_data;
-            memset(&cap_data, 0, sizeof(cap_data));
-            cap_data.magic_etc = VFS_CAP_REVISION | VFS_CAP_FLAGS_EFFECTIVE;
-            cap_data.data[0].permitted = (uint32_t) (parsed.capabilities & 0xffffffff);
-            cap_data.data[0].inheritable = 0;
-            cap_data.data[1].permitted = (uint32_t) (parsed.capabilities >> 32);
-            cap_data.data[1].inheritable = 0;
-            if (setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0) {
-                printf("ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n",
-                       filename, parsed.capabilities, strerror(errno));
-                bad++;
-            }
-        }
-    }
-
-    return bad;
-}
-
-// nftw doesn't allow us to pass along context, so we need to use
-// global variables.  *sigh*
-static struct perm_parsed_args recursive_parsed_args;
-
-static int do_SetMetadataRecursive(const char* filename, const struct stat *statptr,
-        int fileflags, struct FTW *pfwt) {
-    return ApplyParsedPerms(filename, statptr, recursive_parsed_args);
-}
-
 static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv[]) {
     int i;
     int bad = 0;
@@ -793,11 +706,9 @@ static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv
     struct perm_parsed_args parsed = ParsePermArgs(argc, args);
 
     if (recursive) {
-        recursive_parsed_args = parsed;
-        bad += nftw(args[0], do_SetMetadataRecursive, 30, FTW_CHDIR | FTW_DEPTH | FTW_PHYS);
-        memset(&recursive_parsed_args, 0, sizeof(recursive_parsed_args));
+        bad += ApplyParsedPermsRecursive(args[0], &parsed, 0);
     } else {
-        bad += ApplyParsedPerms(args[0], &sb, parsed);
+        bad += ApplyParsedPermsAt(AT_FDCWD, args[0], args[0], &sb, &parsed);
     }
 
 done:
@@ -817,6 +728,62 @@ done:
     return StringValue(strdup(""));
 }
 
+// set_metadata_manifest(package_path[, threads])
+//   Apply the metadata manifest (see metadata.h) stored in the package
+//   at package_path.
+static Value* SetMetadataManifestFn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc != 1 && argc != 2) {
+        return ErrorAbort(state, "%s() expects 1 or 2 args, got %d", name, argc);
+    }
+
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) return NULL;
+
+    Value* result = NULL;
+    unsigned char* data = NULL;
+    int threads = 0;
+    if (argc == 2) {
+        char* endptr;
+        threads = strtol(args[1], &endptr, 10);
+        if (*endptr != '\0' || threads < 0) {
+            result = ErrorAbort(state, "%s: bad thread count \"%s\"", name, args[1]);
+            goto done;
+        }
+    }
+
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    const ZipEntry* entry = mzFindZipEntry(za, args[0]);
+    if (entry == NULL) {
+        result = ErrorAbort(state, "%s: no %s in package", name, args[0]);
+        goto done;
+    }
+
+    size_t size = mzGetZipEntryUncompLen(entry);
+    data = malloc(size);
+    if (data == NULL || !mzExtractZipEntryToBuffer(za, entry, data)) {
+        result = ErrorAbort(state, "%s: can't extract %s", name, args[0]);
+        goto done;
+    }
+
+    int bad = ApplyMetadataManifest(data, size, threads);
+    if (bad < 0) {
+        result = ErrorAbort(state, "%s: %s is not a valid manifest", name, args[0]);
+    } else if (bad > 0) {
+        result = ErrorAbort(state, "%s: some changes failed", name);
+    } else {
+        result = StringValue(strdup(""));
+    }
+
+done:
+    free(data);
+    int i;
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+    return result;
+}
+
 Value* GetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc != 1) {
         return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
@@ -935,18 +902,39 @@ Value* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
 static bool write_raw_image_cb(const unsigned char* data,
                                int data_len, void* ctx) {
     int r = mtd_write_data((MtdWriteContext*)ctx, (const char *)data, data_len);
+    RecordBytesProcessed(r > 0 ? r : 0);
     if (r == data_len) return true;
     printf("%s\n", strerror(errno));
     return false;
 }
 
 // write_raw_image(filename_or_blob, partition)
+//
+// write_raw_image(package_extract_file(path), partition) is the common
+// case.  Rather than inflating the whole image into a blob and then
+// writing it, the entry is streamed from the package a chunk at a
+// time, overlapping inflation with the writes.
 Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
 
+    if (argc != 2) {
+        return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
+    }
+
+    ContentCacheDropPartitions();
+
     Value* partition_value;
-    Value* contents;
-    if (ReadValueArgs(state, argv, 2, &contents, &partition_value) < 0) {
+    Value* contents = NULL;
+    char* zip_path = NULL;
+    if (argv[0]->fn == PackageExtractFileFn && argv[0]->argc == 1) {
+        zip_path = Evaluate(state, argv[0]->argv[0]);
+        if (zip_path == NULL) return NULL;
+        partition_value = EvaluateValue(state, argv[1]);
+        if (partition_value == NULL) {
+            free(zip_path);
+            return NULL;
+        }
+    } else if (ReadValueArgs(state, argv, 2, &contents, &partition_value) < 0) {
         return NULL;
     }
 
@@ -960,7 +948,8 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
         ErrorAbort(state, "partition argument to %s can't be empty", name);
         goto done;
     }
-    if (contents->type == VAL_STRING && strlen((char*) contents->data) == 0) {
+    if (contents != NULL && contents->type == VAL_STRING &&
+        strlen((char*) contents->data) == 0) {
         ErrorAbort(state, "file argument to %s can't be empty", name);
         goto done;
     }
@@ -983,7 +972,23 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     bool success;
 
-    if (contents->type == VAL_STRING) {
+    if (zip_path != NULL) {
+        ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+        const ZipEntry* entry = mzFindZipEntry(za, zip_path);
+        if (entry == NULL) {
+            printf("%s: no %s in package\n", name, zip_path);
+            success = false;
+        } else {
+            // Whole erase blocks at a time, roughly 1MB of them.
+            size_t chunk = ZIP_STREAM_CHUNK_SIZE;
+            size_t total_size, erase_size, write_size;
+            if (mtd_partition_info(mtd, &total_size, &erase_size, &write_size) == 0 &&
+                erase_size > 0) {
+                chunk = (chunk + erase_size - 1) / erase_size * erase_size;
+            }
+            success = StreamZipEntry(za, entry, chunk, write_raw_image_cb, ctx);
+        }
+    } else if (contents->type == VAL_STRING) {
         // we're given a filename as the contents
         char* filename = contents->data;
         FILE* f = fopen(filename, "rb");
@@ -999,6 +1004,7 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
         int read;
         while (success && (read = fread(buffer, 1, BUFSIZ, f)) > 0) {
             int wrote = mtd_write_data(ctx, buffer, read);
+            RecordBytesProcessed(wrote > 0 ? wrote : 0);
             success = success && (wrote == read);
         }
         free(buffer);
@@ -1006,6 +1012,7 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     } else {
         // we're given a blob as the contents
         ssize_t wrote = mtd_write_data(ctx, contents->data, contents->size);
+        RecordBytesProcessed(wrote > 0 ? wrote : 0);
         success = (wrote == contents->size);
     }
     if (!success) {
@@ -1028,6 +1035,7 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
 done:
     if (result != partition) FreeValue(partition_value);
     FreeValue(contents);
+    free(zip_path);
     return StringValue(result);
 }
 
@@ -1124,6 +1132,75 @@ Value* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
     return StringValue(strdup(result == 0 ? "t" : ""));
 }
 
+// Loads a batch list's <patch>, here an entry in the package.
+static Value* LoadPackagePatch(const char* name, void* cookie) {
+    ZipArchive* za = (ZipArchive*)cookie;
+    const ZipEntry* entry = mzFindZipEntry(za, name);
+    if (entry == NULL) {
+        printf("no %s in package\n", name);
+        return NULL;
+    }
+    Value* v = malloc(sizeof(Value));
+    v->type = VAL_BLOB;
+    v->size = mzGetZipEntryUncompLen(entry);
+    v->data = malloc(v->size);
+    if (v->data == NULL ||
+        !mzExtractZipEntryToBuffer(za, entry, (unsigned char*)v->data)) {
+        printf("failed to extract %s from package\n", name);
+        free(v->data);
+        free(v);
+        return NULL;
+    }
+    return v;
+}
+
+// apply_patch_batch(list_entry)
+//   Applies every patch in the batch list 'list_entry' from the
+//   package (see applypatch_batch()), whose <patch>es are also package
+//   entries.  Independent files are patched in parallel.
+Value* ApplyPatchBatchFn(const char* name, State* state,
+                         int argc, Expr* argv[]) {
+    if (argc != 1) {
+        return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
+    }
+    char* list_entry;
+    if (ReadArgs(state, argv, 1, &list_entry) < 0) {
+        return NULL;
+    }
+
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    Value* list = LoadPackagePatch(list_entry, za);
+    if (list == NULL) {
+        ErrorAbort(state, "%s(): can't read \"%s\"", name, list_entry);
+        free(list_entry);
+        return NULL;
+    }
+    char* text = realloc(list->data, list->size + 1);
+    if (text != NULL) {
+        list->data = text;
+        text[list->size] = '\0';
+    }
+
+    BatchPatch* patches;
+    int count;
+    if (text == NULL || ParseBatchList(text, &patches, &count) != 0) {
+        ErrorAbort(state, "%s(): can't parse \"%s\"", name, list_entry);
+        FreeValue(list);
+        free(list_entry);
+        return NULL;
+    }
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int result = applypatch_batch(patches, count, LoadPackagePatch, za,
+                                  threads > 0 ? threads : 1,
+                                  BATCH_MEMORY_BUDGET);
+
+    FreeBatchList(patches, count);
+    FreeValue(list);
+    free(list_entry);
+    return StringValue(strdup(result == 0 ? "t" : ""));
+}
+
 // apply_patch_check(file, [sha1_1, ...])
 Value* ApplyPatchCheckFn(const char* name, State* state,
                          int argc, Expr* argv[]) {
@@ -1200,6 +1277,9 @@ Value* RunProgramFn(const char* name, State* state, int argc, Expr* argv[]) {
         return NULL;
     }
 
+    // We can't tell what the program will write.
+    ContentCacheDropPartitions();
+
     char** args2 = malloc(sizeof(char*) * (argc+1));
     memcpy(args2, args, sizeof(char*) * argc);
     args2[argc] = NULL;
@@ -1362,14 +1442,27 @@ void RegisterInstallFunctions() {
     //   set_metadata_recursive("/system", "uid", 0, "gid", 0, "fmode", 0644, "dmode", 0755, "selabel", "u:object_r:system_file:s0", "capabilities", 0x0);
     RegisterFunction("set_metadata_recursive", SetMetadataFn);
 
+    // Usage:
+    //   set_metadata_manifest("manifest_in_package"[, threads])
+    // Example:
+    //   set_metadata_manifest("META-INF/com/android/metadata", "4");
+    RegisterFunction("set_metadata_manifest", SetMetadataManifestFn);
+
     RegisterFunction("getprop", GetPropFn);
     RegisterFunction("file_getprop", FileGetPropFn);
     RegisterFunction("write_raw_image", WriteRawImageFn);
 
     RegisterFunction("apply_patch", ApplyPatchFn);
+    RegisterFunction("apply_patch_batch", ApplyPatchBatchFn);
     RegisterFunction("apply_patch_check", ApplyPatchCheckFn);
     RegisterFunction("apply_patch_space", ApplyPatchSpaceFn);
 
+    // Usage:
+    //   block_image_update("/dev/block/platform/msm_sdcc.1/by-name/system",
+    //                      package_extract_file("system.transfer.list"),
+    //                      "system.new.dat", "system.patch.dat")
+    RegisterFunction("block_image_update", BlockImageUpdateFn);
+
     RegisterFunction("read_file", ReadFileFn);
     RegisterFunction("sha1_check", Sha1CheckFn);
     RegisterFunction("rename", RenameFn);
@@ -0,0 +1,492 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/capability.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <linux/xattr.h>
+#include <selinux/selinux.h>
+#include <unistd.h>
+
+#include "metadata.h"
+
+// Upper limit on worker threads; past this the filesystem's locks,
+// not the CPUs, are the bottleneck.
+#define MAX_METADATA_THREADS 8
+
+static int thread_count(int requested) {
+    if (requested <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        requested = (cpus > 0) ? cpus : 1;
+    }
+    return (requested > MAX_METADATA_THREADS) ? MAX_METADATA_THREADS : requested;
+}
+
+int ApplyParsedPermsAt(int dirfd, const char* name, const char* path,
+                       const struct stat* st, const struct perm_parsed_args* parsed) {
+    int bad = 0;
+
+    /* ignore symlinks */
+    if (S_ISLNK(st->st_mode)) {
+        return 0;
+    }
+
+    // Changing the owner clears setuid/setgid bits and file
+    // capabilities, so once it's been done those have to be set
+    // whether or not they looked right beforehand.
+    bool chowned = false;
+    uid_t uid = (parsed->has_uid && st->st_uid != parsed->uid) ? parsed->uid : (uid_t)-1;
+    gid_t gid = (parsed->has_gid && st->st_gid != parsed->gid) ? parsed->gid : (gid_t)-1;
+    if (uid != (uid_t)-1 || gid != (gid_t)-1) {
+        if (fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW) < 0) {
+            printf("ApplyParsedPerms: chown of %s to %d.%d failed: %s\n",
+                   path, (int)uid, (int)gid, strerror(errno));
+            bad++;
+        } else {
+            chowned = true;
+        }
+    }
+
+    // dmode and fmode override mode for directories and regular files.
+    bool has_mode = false;
+    mode_t mode = 0;
+    if (parsed->has_fmode && S_ISREG(st->st_mode)) {
+        has_mode = true;
+        mode = parsed->fmode;
+    } else if (parsed->has_dmode && S_ISDIR(st->st_mode)) {
+        has_mode = true;
+        mode = parsed->dmode;
+    } else if (parsed->has_mode) {
+        has_mode = true;
+        mode = parsed->mode;
+    }
+    if (has_mode && (chowned || (st->st_mode & 07777) != (mode & 07777))) {
+        if (fchmodat(dirfd, name, mode, 0) < 0) {
+            printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
+                   path, mode, strerror(errno));
+            bad++;
+        }
+    }
+
+    if (parsed->has_selabel) {
+        char* current = NULL;
+        bool same = (lgetfilecon(path, &current) > 0 &&
+                     strcmp(current, parsed->selabel) == 0);
+        if (current != NULL) freecon(current);
+
+        // TODO: Don't silently ignore ENOTSUP
+        if (!same && lsetfilecon(path, parsed->selabel) && (errno != ENOTSUP)) {
+            printf("ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n",
+                   path, parsed->selabel, strerror(errno));
+            bad++;
+        }
+    }
+
+    if (parsed->has_capabilities && S_ISREG(st->st_mode)) {
+        struct vfs_cap_data current;
+        ssize_t len = lgetxattr(path, XATTR_NAME_CAPS, &current, sizeof(current));
+
+        if (parsed->capabilities == 0) {
+            if (len >= 0 && (lremovexattr(path, XATTR_NAME_CAPS) == -1) &&
+                (errno != ENODATA)) {
+                // Report failure unless it's ENODATA (attribute not set)
+                printf("ApplyParsedPerms: removexattr of %s to %" PRIx64 " failed: %s\n",
+                       path, parsed->capabilities, strerror(errno));
+                bad++;
+            }
+        } else {
+            struct vfs_cap_data cap_data;
+            memset(&cap_data, 0, sizeof(cap_data));
+            cap_data.magic_etc = VFS_CAP_REVISION | VFS_CAP_FLAGS_EFFECTIVE;
+            cap_data.data[0].permitted = (uint32_t) (parsed->capabilities & 0xffffffff);
+            cap_data.data[0].inheritable = 0;
+            cap_data.data[1].permitted = (uint32_t) (parsed->capabilities >> 32);
+            cap_data.data[1].inheritable = 0;
+            bool same = !chowned && len == (ssize_t)sizeof(cap_data) &&
+                    memcmp(&current, &cap_data, sizeof(cap_data)) == 0;
+            if (!same &&
+                lsetxattr(path, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0) {
+                printf("ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n",
+                       path, parsed->capabilities, strerror(errno));
+                bad++;
+            }
+        }
+    }
+
+    return bad;
+}
+
+// A directory still to be read.  Directories wait as paths rather
+// than open fds so that a wide tree can't run the process out of
+// descriptors.
+typedef struct dir_job {
+    struct dir_job* next;
+    char path[0];
+} dir_job;
+
+typedef struct {
+    const struct perm_parsed_args* parsed;
+    dir_job* jobs;          // stack of directories to read
+    int pending;            // jobs queued or being worked on
+    int bad;
+
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+} tree_walk;
+
+// Called with the lock held.
+static int push_dir(tree_walk* tw, const char* dir, const char* name) {
+    size_t len = strlen(dir) + strlen(name) + 2;
+    dir_job* job = malloc(sizeof(dir_job) + len);
+    if (job == NULL) return -1;
+    if (name[0] == '\0') {
+        strcpy(job->path, dir);
+    } else {
+        snprintf(job->path, len, "%s/%s", dir, name);
+    }
+    job->next = tw->jobs;
+    tw->jobs = job;
+    tw->pending++;
+    pthread_cond_signal(&tw->cv);
+    return 0;
+}
+
+// Apply the perms to everything in one directory, and queue its
+// subdirectories.  Returns the number of failures.
+static int walk_dir(tree_walk* tw, const char* path) {
+    int bad = 0;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* d = (fd < 0) ? NULL : fdopendir(fd);
+    if (d == NULL) {
+        printf("ApplyParsedPerms: can't open directory %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    char child[PATH_MAX];
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+
+        struct stat st;
+        if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            printf("ApplyParsedPerms: lstat of %s failed: %s\n", child, strerror(errno));
+            bad++;
+            continue;
+        }
+        // Directories get their own perms before their contents are
+        // read; recovery runs as root, so a restrictive mode or label
+        // on the directory doesn't stop the walk.
+        bad += ApplyParsedPermsAt(fd, de->d_name, child, &st, tw->parsed);
+
+        if (S_ISDIR(st.st_mode)) {
+            pthread_mutex_lock(&tw->mu);
+            if (push_dir(tw, path, de->d_name) < 0) bad++;
+            pthread_mutex_unlock(&tw->mu);
+        }
+    }
+    closedir(d);
+    return bad;
+}
+
+static void* walk_thread(void* cookie) {
+    tree_walk* tw = (tree_walk*) cookie;
+    int bad = 0;
+
+    pthread_mutex_lock(&tw->mu);
+    for (;;) {
+        while (tw->jobs == NULL && tw->pending > 0) {
+            pthread_cond_wait(&tw->cv, &tw->mu);
+        }
+        if (tw->jobs == NULL) break;
+
+        dir_job* job = tw->jobs;
+        tw->jobs = job->next;
+        pthread_mutex_unlock(&tw->mu);
+
+        bad += walk_dir(tw, job->path);
+        free(job);
+
+        pthread_mutex_lock(&tw->mu);
+        if (--tw->pending == 0) {
+            // Nothing queued or in progress: wake everyone to exit.
+            pthread_cond_broadcast(&tw->cv);
+        }
+    }
+    tw->bad += bad;
+    pthread_mutex_unlock(&tw->mu);
+    return NULL;
+}
+
+int ApplyParsedPermsRecursive(const char* root, const struct perm_parsed_args* parsed,
+                              int threads) {
+    struct stat st;
+    if (lstat(root, &st) < 0) {
+        printf("ApplyParsedPerms: lstat of %s failed: %s\n", root, strerror(errno));
+        return 1;
+    }
+    int bad = ApplyParsedPermsAt(AT_FDCWD, root, root, &st, parsed);
+    if (!S_ISDIR(st.st_mode)) return bad;
+
+    threads = thread_count(threads);
+
+    tree_walk tw;
+    memset(&tw, 0, sizeof(tw));
+    tw.parsed = parsed;
+    pthread_mutex_init(&tw.mu, NULL);
+    pthread_cond_init(&tw.cv, NULL);
+
+    pthread_mutex_lock(&tw.mu);
+    if (push_dir(&tw, root, "") < 0) bad++;
+    pthread_mutex_unlock(&tw.mu);
+
+    // The calling thread is one of the workers.
+    pthread_t* tids = malloc((threads - 1) * sizeof(pthread_t));
+    int started = 0;
+    while (tids != NULL && started < threads - 1 &&
+           pthread_create(&tids[started], NULL, walk_thread, &tw) == 0) {
+        ++started;
+    }
+    walk_thread(&tw);
+
+    int i;
+    for (i = 0; i < started; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    pthread_cond_destroy(&tw.cv);
+    pthread_mutex_destroy(&tw.mu);
+
+    return bad + tw.bad;
+}
+
+// --- metadata manifests ---
+
+#define MANIFEST_HEADER_SIZE 12
+#define MANIFEST_RECORD_SIZE 24
+
+typedef struct {
+    char* path;
+    const char* name;       // last component of path
+    struct perm_parsed_args parsed;
+} manifest_record;
+
+// Records [start, end) share a parent directory.
+typedef struct {
+    size_t start;
+    size_t end;
+} manifest_group;
+
+typedef struct {
+    manifest_record* records;
+    manifest_group* groups;
+    size_t group_count;
+    size_t next_group;
+    int bad;
+    pthread_mutex_t mu;
+} manifest_work;
+
+static uint32_t get_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const unsigned char* p) {
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static bool same_parent(const manifest_record* a, const manifest_record* b) {
+    size_t alen = a->name - a->path;
+    size_t blen = b->name - b->path;
+    return alen == blen && memcmp(a->path, b->path, alen) == 0;
+}
+
+static int apply_group(manifest_work* mw, const manifest_group* g) {
+    manifest_record* first = &mw->records[g->start];
+    size_t dirlen = first->name - first->path;   // includes the '/'
+    char dir[PATH_MAX];
+    if (dirlen >= sizeof(dir)) return g->end - g->start;
+    memcpy(dir, first->path, dirlen);
+    dir[dirlen] = '\0';
+
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) {
+        printf("ApplyMetadataManifest: can't open %s: %s\n", dir, strerror(errno));
+        return g->end - g->start;
+    }
+
+    int bad = 0;
+    size_t i;
+    for (i = g->start; i < g->end; ++i) {
+        manifest_record* r = &mw->records[i];
+        struct stat st;
+        if (fstatat(dfd, r->name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            printf("ApplyMetadataManifest: lstat of %s failed: %s\n", r->path, strerror(errno));
+            bad++;
+            continue;
+        }
+        bad += ApplyParsedPermsAt(dfd, r->name, r->path, &st, &r->parsed);
+    }
+    close(dfd);
+    return bad;
+}
+
+static void* manifest_thread(void* cookie) {
+    manifest_work* mw = (manifest_work*) cookie;
+    int bad = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&mw->mu);
+        size_t g = mw->next_group++;
+        pthread_mutex_unlock(&mw->mu);
+        if (g >= mw->group_count) break;
+        bad += apply_group(mw, &mw->groups[g]);
+    }
+
+    pthread_mutex_lock(&mw->mu);
+    mw->bad += bad;
+    pthread_mutex_unlock(&mw->mu);
+    return NULL;
+}
+
+// Split the manifest into records.  Returns the number of records, or
+// -1 if it's malformed.
+static ssize_t parse_manifest(unsigned char* data, size_t size, manifest_record** out) {
+    if (size < MANIFEST_HEADER_SIZE ||
+        memcmp(data, METADATA_MANIFEST_MAGIC, 4) != 0) {
+        printf("ApplyMetadataManifest: not a metadata manifest\n");
+        return -1;
+    }
+    uint32_t version = get_le32(data + 4);
+    if (version != METADATA_MANIFEST_VERSION) {
+        printf("ApplyMetadataManifest: unsupported version %u\n", version);
+        return -1;
+    }
+    size_t count = get_le32(data + 8);
+    if (count > (size - MANIFEST_HEADER_SIZE) / MANIFEST_RECORD_SIZE) {
+        printf("ApplyMetadataManifest: %zu records can't fit in %zu bytes\n", count, size);
+        return -1;
+    }
+
+    manifest_record* records = calloc(count, sizeof(manifest_record));
+    if (records == NULL && count > 0) return -1;
+
+    size_t pos = MANIFEST_HEADER_SIZE;
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        manifest_record* r = &records[i];
+        if (size - pos < MANIFEST_RECORD_SIZE) goto truncated;
+        const unsigned char* p = data + pos;
+        uint32_t flags = get_le32(p);
+        r->parsed.has_uid = (flags & METADATA_HAS_UID) != 0;
+        r->parsed.uid = get_le32(p + 4);
+        r->parsed.has_gid = (flags & METADATA_HAS_GID) != 0;
+        r->parsed.gid = get_le32(p + 8);
+        r->parsed.has_mode = (flags & METADATA_HAS_MODE) != 0;
+        r->parsed.mode = get_le32(p + 12);
+        r->parsed.has_capabilities = (flags & METADATA_HAS_CAPABILITIES) != 0;
+        r->parsed.capabilities = get_le64(p + 16);
+        pos += MANIFEST_RECORD_SIZE;
+
+        unsigned char* nul = memchr(data + pos, '\0', size - pos);
+        if (nul == NULL) goto truncated;
+        r->path = (char*)(data + pos);
+        pos = nul - data + 1;
+
+        nul = memchr(data + pos, '\0', size - pos);
+        if (nul == NULL) goto truncated;
+        r->parsed.selabel = (char*)(data + pos);
+        r->parsed.has_selabel = (flags & METADATA_HAS_SELABEL) != 0;
+        if (r->parsed.has_selabel && r->parsed.selabel[0] == '\0') {
+            printf("ApplyMetadataManifest: empty selabel for %s\n", r->path);
+            goto fail;
+        }
+        pos = nul - data + 1;
+
+        char* slash = strrchr(r->path, '/');
+        if (r->path[0] != '/' || slash[1] == '\0') {
+            printf("ApplyMetadataManifest: bad path \"%s\"\n", r->path);
+            goto fail;
+        }
+        r->name = slash + 1;
+    }
+
+    *out = records;
+    return count;
+
+  truncated:
+    printf("ApplyMetadataManifest: manifest truncated at record %zu\n", i);
+  fail:
+    free(records);
+    return -1;
+}
+
+int ApplyMetadataManifest(unsigned char* data, size_t size, int threads) {
+    manifest_work mw;
+    memset(&mw, 0, sizeof(mw));
+
+    ssize_t count = parse_manifest(data, size, &mw.records);
+    if (count < 0) return -1;
+    if (count == 0) return 0;
+
+    mw.groups = malloc(count * sizeof(manifest_group));
+    if (mw.groups == NULL) {
+        free(mw.records);
+        return -1;
+    }
+    ssize_t i;
+    for (i = 0; i < count; ++i) {
+        if (i == 0 || !same_parent(&mw.records[i-1], &mw.records[i])) {
+            mw.groups[mw.group_count].start = i;
+            mw.group_count++;
+        }
+        mw.groups[mw.group_count-1].end = i + 1;
+    }
+
+    threads = thread_count(threads);
+    if ((size_t)threads > mw.group_count) threads = mw.group_count;
+    pthread_mutex_init(&mw.mu, NULL);
+
+    // The calling thread is one of the workers.
+    pthread_t* tids = malloc((threads - 1) * sizeof(pthread_t));
+    int started = 0;
+    while (tids != NULL && started < threads - 1 &&
+           pthread_create(&tids[started], NULL, manifest_thread, &mw) == 0) {
+        ++started;
+    }
+    manifest_thread(&mw);
+
+    int t;
+    for (t = 0; t < started; ++t) {
+        pthread_join(tids[t], NULL);
+    }
+    free(tids);
+    pthread_mutex_destroy(&mw.mu);
+
+    printf("applied metadata to %zd files in %zu directories\n", count, mw.group_count);
+    free(mw.groups);
+    free(mw.records);
+    return mw.bad;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_METADATA_H_
+#define _UPDATER_METADATA_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+struct perm_parsed_args {
+    bool has_uid;
+    uid_t uid;
+    bool has_gid;
+    gid_t gid;
+    bool has_mode;
+    mode_t mode;
+    bool has_fmode;
+    mode_t fmode;
+    bool has_dmode;
+    mode_t dmode;
+    bool has_selabel;
+    char* selabel;
+    bool has_capabilities;
+    uint64_t capabilities;
+};
+
+// Apply 'parsed' to 'name' in the directory 'dirfd' (which may be
+// AT_FDCWD), whose lstat() is *st.  'path' names the same file from
+// the current directory; it's used for the SELinux label and
+// capabilities, which have no *at() calls, and in messages.  Symlinks
+// are left alone.  Nothing is changed that already has the wanted
+// value.  Returns the number of changes that failed.
+int ApplyParsedPermsAt(int dirfd, const char* name, const char* path,
+                       const struct stat* st, const struct perm_parsed_args* parsed);
+
+// Apply 'parsed' to 'root' and everything beneath it, without
+// following symlinks, using up to 'threads' threads (0 for one per
+// CPU).  Returns the number of changes that failed.
+int ApplyParsedPermsRecursive(const char* root, const struct perm_parsed_args* parsed,
+                              int threads);
+
+// A metadata manifest sets the metadata of many files at once,
+// replacing a long run of set_metadata() calls.  It's a header:
+//
+//   char     magic[4];     "META"
+//   uint32_t version;      1
+//   uint32_t count;        number of records
+//
+// followed by 'count' records:
+//
+//   uint32_t flags;        which of the fields below to apply
+//   uint32_t uid;
+//   uint32_t gid;
+//   uint32_t mode;
+//   uint64_t capabilities;
+//   char     path[];       absolute, NUL-terminated
+//   char     selabel[];    NUL-terminated; empty if not set
+//
+// All numbers are little-endian and nothing is padded.  The mode is
+// the final mode of the file: the generator has already chosen
+// between mode, dmode and fmode.  Records should be sorted so that
+// files in the same directory are adjacent; each run of them costs
+// one open() of the directory, and different runs may be applied in
+// parallel.
+#define METADATA_MANIFEST_MAGIC "META"
+#define METADATA_MANIFEST_VERSION 1
+
+#define METADATA_HAS_UID          0x01
+#define METADATA_HAS_GID          0x02
+#define METADATA_HAS_MODE         0x04
+#define METADATA_HAS_SELABEL      0x08
+#define METADATA_HAS_CAPABILITIES 0x10
+
+// Apply a manifest (which is modified: strings are split in place)
+// with up to 'threads' threads (0 for one per CPU).  Returns the
+// number of changes that failed, or -1 if the manifest is malformed,
+// in which case nothing has been changed.
+int ApplyMetadataManifest(unsigned char* data, size_t size, int threads);
+
+#endif
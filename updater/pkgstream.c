@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pkgstream.h"
+
+// The producer (the inflating thread) fills chunks in ring order; the
+// consumer (the caller) hands full ones to the sink.  chunks[head]
+// through chunks[head+count-1] are full.  The producer fills
+// chunks[head+count], which is always free when count <
+// ZIP_STREAM_CHUNKS.  The consumer advances head and drops count
+// together, leaving head + count alone, so the producer can copy into
+// its chunk without holding the lock.
+typedef struct {
+    const ZipArchive* za;
+    const ZipEntry* entry;
+    size_t chunk_size;
+
+    unsigned char* data[ZIP_STREAM_CHUNKS];
+    size_t len[ZIP_STREAM_CHUNKS];
+    size_t head;
+    size_t count;
+    size_t fill;            // bytes in the chunk being filled
+
+    bool done;              // producer has finished
+    bool failed;            // ... without reading the whole entry
+    bool cancelled;         // consumer has given up
+
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+} ZipStream;
+
+// Called with the lock held.
+static void publish_chunk(ZipStream* zs) {
+    zs->len[(zs->head + zs->count) % ZIP_STREAM_CHUNKS] = zs->fill;
+    zs->count++;
+    zs->fill = 0;
+    pthread_cond_broadcast(&zs->cv);
+}
+
+static bool receive_data(const unsigned char* data, int size, void* cookie) {
+    ZipStream* zs = (ZipStream*) cookie;
+
+    while (size > 0) {
+        pthread_mutex_lock(&zs->mu);
+        while (zs->count == ZIP_STREAM_CHUNKS && !zs->cancelled) {
+            pthread_cond_wait(&zs->cv, &zs->mu);
+        }
+        if (zs->cancelled) {
+            pthread_mutex_unlock(&zs->mu);
+            return false;
+        }
+        unsigned char* chunk = zs->data[(zs->head + zs->count) % ZIP_STREAM_CHUNKS];
+        pthread_mutex_unlock(&zs->mu);
+
+        size_t n = zs->chunk_size - zs->fill;
+        if (n > (size_t) size) n = size;
+        memcpy(chunk + zs->fill, data, n);
+        zs->fill += n;
+        data += n;
+        size -= n;
+
+        if (zs->fill == zs->chunk_size) {
+            pthread_mutex_lock(&zs->mu);
+            publish_chunk(zs);
+            pthread_mutex_unlock(&zs->mu);
+        }
+    }
+    return true;
+}
+
+static void* inflate_thread(void* cookie) {
+    ZipStream* zs = (ZipStream*) cookie;
+    bool ok = mzProcessZipEntryContents(zs->za, zs->entry, receive_data, zs);
+
+    pthread_mutex_lock(&zs->mu);
+    if (ok && zs->fill > 0) {
+        // count < ZIP_STREAM_CHUNKS, or receive_data couldn't have
+        // filled anything.
+        publish_chunk(zs);
+    }
+    zs->done = true;
+    zs->failed = !ok;
+    pthread_cond_broadcast(&zs->cv);
+    pthread_mutex_unlock(&zs->mu);
+    return NULL;
+}
+
+static bool stream_stored(const ZipArchive* za, const ZipEntry* entry, size_t chunk_size,
+                          ProcessZipEntryContentsFunction sink, void* cookie) {
+    const unsigned char* data = (const unsigned char*) za->map.addr +
+            mzGetZipEntryOffset(entry);
+    size_t left = mzGetZipEntryUncompLen(entry);
+
+    while (left > 0) {
+        size_t n = (left < chunk_size) ? left : chunk_size;
+        if (!sink(data, n, cookie)) return false;
+        data += n;
+        left -= n;
+    }
+    return true;
+}
+
+bool StreamZipEntry(const ZipArchive* za, const ZipEntry* entry, size_t chunk_size,
+                    ProcessZipEntryContentsFunction sink, void* cookie) {
+    if (entry->compression == 0) {          // stored
+        return stream_stored(za, entry, chunk_size, sink, cookie);
+    }
+
+    ZipStream zs;
+    memset(&zs, 0, sizeof(zs));
+    zs.za = za;
+    zs.entry = entry;
+    zs.chunk_size = chunk_size;
+
+    bool success = false;
+    int i;
+    for (i = 0; i < ZIP_STREAM_CHUNKS; ++i) {
+        zs.data[i] = malloc(chunk_size);
+        if (zs.data[i] == NULL) {
+            printf("failed to allocate %zu byte stream buffer\n", chunk_size);
+            goto done;
+        }
+    }
+
+    pthread_mutex_init(&zs.mu, NULL);
+    pthread_cond_init(&zs.cv, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, inflate_thread, &zs) != 0) {
+        printf("failed to start inflate thread: %s\n", strerror(errno));
+        goto destroy;
+    }
+
+    success = true;
+    for (;;) {
+        pthread_mutex_lock(&zs.mu);
+        while (zs.count == 0 && !zs.done) {
+            pthread_cond_wait(&zs.cv, &zs.mu);
+        }
+        if (zs.count == 0) {
+            pthread_mutex_unlock(&zs.mu);
+            break;
+        }
+        size_t c = zs.head;
+        pthread_mutex_unlock(&zs.mu);
+
+        bool ok = sink(zs.data[c], zs.len[c], cookie);
+
+        pthread_mutex_lock(&zs.mu);
+        zs.head = (zs.head + 1) % ZIP_STREAM_CHUNKS;
+        zs.count--;
+        if (!ok) zs.cancelled = true;
+        pthread_cond_broadcast(&zs.cv);
+        pthread_mutex_unlock(&zs.mu);
+
+        if (!ok) {
+            success = false;
+            break;
+        }
+    }
+    pthread_join(thread, NULL);
+    if (zs.failed && !zs.cancelled) {
+        printf("failed to read %.*s from package\n",
+               (int) entry->fileNameLen, entry->fileName);
+        success = false;
+    }
+
+  destroy:
+    pthread_cond_destroy(&zs.cv);
+    pthread_mutex_destroy(&zs.mu);
+  done:
+    for (i = 0; i < ZIP_STREAM_CHUNKS; ++i) {
+        free(zs.data[i]);
+    }
+    return success;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_PKGSTREAM_H_
+#define _UPDATER_PKGSTREAM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "minzip/Zip.h"
+
+// Chunks in flight between the inflating thread and the writer.
+#define ZIP_STREAM_CHUNKS 3
+
+// Default chunk size for callers with no better unit (an MTD erase
+// block, say).
+#define ZIP_STREAM_CHUNK_SIZE (1024 * 1024)
+
+// Pass the contents of 'entry' to 'sink' in pieces of 'chunk_size'
+// bytes (only the last may be shorter).  Deflated entries are
+// inflated on a separate thread, so inflation overlaps with whatever
+// the sink does, and no more than ZIP_STREAM_CHUNKS * chunk_size bytes
+// are buffered however large the entry is.  Stored entries are handed
+// to the sink straight from the mapped package.
+//
+// Returns true if the whole entry was read and every call to the sink
+// returned true.  Once the sink returns false it isn't called again.
+bool StreamZipEntry(const ZipArchive* za, const ZipEntry* entry, size_t chunk_size,
+                    ProcessZipEntryContentsFunction sink, void* cookie);
+
+#endif
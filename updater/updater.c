@@ -17,8 +17,13 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "edify/bytecode.h"
 #include "edify/expr.h"
+#include "edify/parsed.h"
+#include "edify/profile.h"
+#include "applypatch/contentcache.h"
 #include "updater.h"
 #include "install.h"
 #include "minzip/Zip.h"
@@ -32,8 +37,81 @@
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
 
+// The same script, checked and parsed on the host by "edify -c".
+#define PARSED_SCRIPT_NAME "META-INF/com/google/android/updater-script.parsed"
+
+// How many of the costliest script lines to put in the log, and how
+// many functions to send back to recovery for last_install.
+#define PROFILE_LOG_LINES 20
+#define PROFILE_PIPE_FUNCTIONS 10
+
+// Memory for file and partition contents kept between apply_patch(),
+// apply_patch_check() and read_file() calls.  Enough for a boot or
+// recovery image or two.
+#define CONTENT_CACHE_BUDGET (64 * 1024 * 1024)
+
 struct selabel_handle *sehandle;
 
+// The functions registered by device extensions, which may write
+// partitions without telling the content cache.
+static NamedFunction* device_functions;
+static int device_function_count;
+
+// Stands in for every device extension function.  None of them is
+// known to leave partitions alone, so the cached partition contents
+// are dropped around each call.
+static Value* DeviceExtensionFn(const char* name, State* state,
+                                int argc, Expr* argv[]) {
+    Function fn = NULL;
+    int i;
+    // The last registration of a name is the one that counts.
+    for (i = device_function_count - 1; i >= 0; --i) {
+        if (strcmp(device_functions[i].name, name) == 0) {
+            fn = device_functions[i].fn;
+            break;
+        }
+    }
+    if (fn == NULL) {
+        return ErrorAbort(state, "%s: not a device extension", name);
+    }
+
+    ContentCacheDropPartitions();
+    Value* result = fn(name, state, argc, argv);
+    ContentCacheDropPartitions();
+    return result;
+}
+
+static void RegisterCheckedDeviceExtensions() {
+    int first = RegisteredFunctionCount();
+    RegisterDeviceExtensions();
+    device_function_count = RegisteredFunctionCount() - first;
+    if (device_function_count == 0) return;
+
+    device_functions = malloc(device_function_count * sizeof(NamedFunction));
+    int i;
+    for (i = 0; i < device_function_count; ++i) {
+        device_functions[i] = ReplaceRegisteredFunction(first + i, DeviceExtensionFn);
+    }
+}
+
+// Write the execution profile to the log (our stdout) in full, and
+// send recovery a line per costliest function.
+static void report_profile(FILE* cmd_pipe, const char* script) {
+    printf("script profile:\n");
+    DumpProfile(stdout, script, PROFILE_LOG_LINES);
+
+    int count, i;
+    ProfileStat* stats = GetProfile(NULL, &count);
+    for (i = 0; i < count && i < PROFILE_PIPE_FUNCTIONS; ++i) {
+        fprintf(cmd_pipe, "log profile: %s calls=%u total_ms=%llu self_ms=%llu bytes=%llu\n",
+                stats[i].name, stats[i].calls,
+                (unsigned long long)(stats[i].total_ns / 1000000),
+                (unsigned long long)(stats[i].self_ns / 1000000),
+                (unsigned long long)stats[i].bytes);
+    }
+    free(stats);
+}
+
 int main(int argc, char** argv) {
     // Various things log information to stdout or stderr more or less
     // at random (though we've tried to standardize on stdout).  The
@@ -75,35 +153,56 @@ int main(int argc, char** argv) {
         return 3;
     }
 
-    const ZipEntry* script_entry = mzFindZipEntry(&za, SCRIPT_NAME);
-    if (script_entry == NULL) {
-        printf("failed to find %s in %s\n", SCRIPT_NAME, package_data);
-        return 4;
-    }
-
-    char* script = malloc(script_entry->uncompLen+1);
-    if (!mzReadZipEntry(&za, script_entry, script, script_entry->uncompLen)) {
-        printf("failed to read script from package\n");
-        return 5;
-    }
-    script[script_entry->uncompLen] = '\0';
-
     // Configure edify's functions.
 
     RegisterBuiltins();
     RegisterInstallFunctions();
-    RegisterDeviceExtensions();
+    RegisterCheckedDeviceExtensions();
     FinishRegistration();
 
-    // Parse the script.
+    // Let repeated checks and patches of the same source share one read.
+    ContentCacheSetBudget(CONTENT_CACHE_BUDGET);
 
-    Expr* root;
-    int error_count = 0;
-    yy_scan_string(script);
-    int error = yyparse(&root, &error_count);
-    if (error != 0 || error_count > 0) {
-        printf("%d parse errors\n", error_count);
-        return 6;
+    // Use the parsed form of the script if the package has one that
+    // loads; otherwise parse the script itself.
+
+    Expr* root = NULL;
+    char* script = NULL;
+    const ZipEntry* parsed_entry = mzFindZipEntry(&za, PARSED_SCRIPT_NAME);
+    if (parsed_entry != NULL) {
+        size_t parsed_size = mzGetZipEntryUncompLen(parsed_entry);
+        unsigned char* parsed = malloc(parsed_size);
+        if (parsed != NULL &&
+            mzReadZipEntry(&za, parsed_entry, (char*)parsed, parsed_size) &&
+            LoadParsedScript(parsed, parsed_size, &root, &script) == 0) {
+            printf("loaded %s\n", PARSED_SCRIPT_NAME);
+        } else {
+            printf("can't use %s; parsing %s instead\n", PARSED_SCRIPT_NAME, SCRIPT_NAME);
+        }
+        free(parsed);
+    }
+
+    if (root == NULL) {
+        const ZipEntry* script_entry = mzFindZipEntry(&za, SCRIPT_NAME);
+        if (script_entry == NULL) {
+            printf("failed to find %s in %s\n", SCRIPT_NAME, package_data);
+            return 4;
+        }
+
+        script = malloc(script_entry->uncompLen+1);
+        if (!mzReadZipEntry(&za, script_entry, script, script_entry->uncompLen)) {
+            printf("failed to read script from package\n");
+            return 5;
+        }
+        script[script_entry->uncompLen] = '\0';
+
+        int error_count = 0;
+        yy_scan_string(script);
+        int error = yyparse(&root, &error_count);
+        if (error != 0 || error_count > 0) {
+            printf("%d parse errors\n", error_count);
+            return 6;
+        }
     }
 
     struct selinux_opt seopts[] = {
@@ -128,7 +227,12 @@ int main(int argc, char** argv) {
     state.script = script;
     state.errmsg = NULL;
 
-    char* result = Evaluate(&state, root);
+    SetProfiling(1);
+    Program* prog = CompileExpr(root);
+    char* result = prog ? ExecuteProgram(&state, prog) : Evaluate(&state, root);
+    FreeProgram(prog);
+    SetProfiling(0);
+    report_profile(cmd_pipe, script);
     if (result == NULL) {
         if (state.errmsg == NULL) {
             printf("script aborted (no error message)\n");
@@ -152,6 +256,7 @@ int main(int argc, char** argv) {
     if (updater_info.package_zip) {
         mzCloseZipArchive(updater_info.package_zip);
     }
+    FreeParseTrees();
     free(script);
 
     return 0;